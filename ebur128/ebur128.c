@@ -5,18 +5,43 @@
 #include <float.h>
 #include <limits.h>
 #include <math.h> /* You may have to define _USE_MATH_DEFINES if you use MSVC */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* This can be replaced by any BSD-like queue implementation. */
 #include <sys/queue.h>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <io.h>
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(SYS_memfd_create) && !defined(EBUR128_NO_MIRROR_MAP)
+/* The mirror of the ring buffer is a second mapping of its pages. Define
+ * EBUR128_NO_MIRROR_MAP to copy the mirror as on other platforms. */
+#define EBUR128_MIRROR_MAP
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+#endif
+#endif
+
 #define CHECK_ERROR(condition, errorcode, goto_point)                          \
   if ((condition)) {                                                           \
     errcode = (errorcode);                                                     \
     goto goto_point;                                                           \
   }
 #define EBUR128_MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define EBUR128_MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 static int safe_size_mul(size_t nmemb, size_t size, size_t* result) {
   /* Adapted from OpenBSD reallocarray. */
@@ -30,19 +55,578 @@ static int safe_size_mul(size_t nmemb, size_t size, size_t* result) {
   return 0;
 }
 
+/* Minimal threading primitives. */
+#if defined(_WIN32)
+typedef HANDLE ebur128_thread;
+typedef CRITICAL_SECTION ebur128_mutex;
+typedef CONDITION_VARIABLE ebur128_cond;
+#define ebur128_mutex_init(m) (InitializeCriticalSection(m), 0)
+#define ebur128_mutex_destroy(m) DeleteCriticalSection(m)
+#define ebur128_mutex_lock(m) EnterCriticalSection(m)
+#define ebur128_mutex_unlock(m) LeaveCriticalSection(m)
+#define ebur128_cond_init(c) (InitializeConditionVariable(c), 0)
+#define ebur128_cond_destroy(c)
+#define ebur128_cond_wait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define ebur128_cond_signal(c) WakeConditionVariable(c)
+#define ebur128_cond_broadcast(c) WakeAllConditionVariable(c)
+
+static size_t ebur128_atomic_load(volatile size_t* p) {
+  size_t v = *p;
+  MemoryBarrier();
+  return v;
+}
+
+static void ebur128_atomic_store(volatile size_t* p, size_t v) {
+  MemoryBarrier();
+  *p = v;
+  MemoryBarrier();
+}
+#else
+typedef pthread_t ebur128_thread;
+typedef pthread_mutex_t ebur128_mutex;
+typedef pthread_cond_t ebur128_cond;
+#define ebur128_mutex_init(m) pthread_mutex_init(m, NULL)
+#define ebur128_mutex_destroy(m) pthread_mutex_destroy(m)
+#define ebur128_mutex_lock(m) pthread_mutex_lock(m)
+#define ebur128_mutex_unlock(m) pthread_mutex_unlock(m)
+#define ebur128_cond_init(c) pthread_cond_init(c, NULL)
+#define ebur128_cond_destroy(c) pthread_cond_destroy(c)
+#define ebur128_cond_wait(c, m) pthread_cond_wait(c, m)
+#define ebur128_cond_signal(c) pthread_cond_signal(c)
+#define ebur128_cond_broadcast(c) pthread_cond_broadcast(c)
+
+static size_t ebur128_atomic_load(volatile size_t* p) {
+  return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static void ebur128_atomic_store(volatile size_t* p, size_t v) {
+  __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+#endif
+
 STAILQ_HEAD(ebur128_double_queue, ebur128_dq_entry);
 struct ebur128_dq_entry {
   double z;
   STAILQ_ENTRY(ebur128_dq_entry) entries;
 };
 
+/** Append-only file of block energies, mapped into memory for queries. */
+struct ebur128_block_file {
+  FILE* file;
+  /** Number of blocks written to the file. */
+  size_t blocks;
+  /** Blocks before this index are older than the maximum history. */
+  size_t first_valid;
+  /** Mapping of the file, only valid between map and unmap. */
+  const double* map;
+};
+
+/* How many of the newest blocks stay in memory when a block file is used. */
+#define BLOCK_FILE_HOT_BLOCKS 1024
+
+static struct ebur128_block_file* ebur128_block_file_open(const char* path) {
+  struct ebur128_block_file* f;
+
+  f = (struct ebur128_block_file*) calloc(1, sizeof(*f));
+  if (!f) {
+    return NULL;
+  }
+  f->file = fopen(path, "w+b");
+  if (!f->file) {
+    free(f);
+    return NULL;
+  }
+  return f;
+}
+
+static void ebur128_block_file_close(struct ebur128_block_file* f) {
+  if (f) {
+    fclose(f->file);
+    free(f);
+  }
+}
+
+static int ebur128_block_file_append(struct ebur128_block_file* f, double z) {
+  if (fwrite(&z, sizeof(z), 1, f->file) != 1) {
+    return EBUR128_ERROR_IO;
+  }
+  f->blocks++;
+  return EBUR128_SUCCESS;
+}
+
+/* Index of the first block in the file that is still part of the history,
+ * given the number of blocks in memory and the maximum history. */
+static size_t ebur128_block_file_first(struct ebur128_block_file* f,
+                                       unsigned long list_size,
+                                       unsigned long list_max) {
+  size_t first = f->first_valid;
+  if (f->blocks + list_size > list_max &&
+      f->blocks + list_size - list_max > first) {
+    first = f->blocks + list_size - list_max;
+  }
+  return first;
+}
+
+static int ebur128_block_file_map(struct ebur128_block_file* f) {
+  size_t bytes = f->blocks * sizeof(double);
+  void* map;
+
+  f->map = NULL;
+  if (!f->blocks) {
+    return EBUR128_SUCCESS;
+  }
+  if (fflush(f->file)) {
+    return EBUR128_ERROR_IO;
+  }
+#if defined(_WIN32)
+  {
+    HANDLE handle = (HANDLE) _get_osfhandle(_fileno(f->file));
+    HANDLE mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) {
+      return EBUR128_ERROR_IO;
+    }
+    map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, bytes);
+    /* the view keeps the mapping alive */
+    CloseHandle(mapping);
+    if (!map) {
+      return EBUR128_ERROR_IO;
+    }
+  }
+#else
+  map = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fileno(f->file), 0);
+  if (map == MAP_FAILED) {
+    return EBUR128_ERROR_IO;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(map, bytes, MADV_SEQUENTIAL);
+#endif
+#endif
+  f->map = (const double*) map;
+  return EBUR128_SUCCESS;
+}
+
+static void ebur128_block_file_unmap(struct ebur128_block_file* f) {
+  if (!f->map) {
+    return;
+  }
+#if defined(_WIN32)
+  UnmapViewOfFile((LPCVOID) f->map);
+#else
+  munmap((void*) f->map, f->blocks * sizeof(double));
+#endif
+  f->map = NULL;
+}
+
+/* Number of blocks in a history list and its optional file that are still
+ * part of the history. */
+static size_t ebur128_history_blocks(struct ebur128_block_file* file,
+                                     unsigned long list_size,
+                                     unsigned long list_max) {
+  if (!file) {
+    return list_size;
+  }
+  return file->blocks - ebur128_block_file_first(file, list_size, list_max) +
+         list_size;
+}
+
+/* Append a block energy to a history list. The oldest block is dropped when
+ * the list is full, or moved to the block file if there is one and the block
+ * is still part of the history. "history_changes" is incremented if a block
+ * leaves the history. */
+static int ebur128_push_block(struct ebur128_double_queue* list,
+                              unsigned long* list_size,
+                              unsigned long list_max,
+                              struct ebur128_block_file* file,
+                              unsigned long long* history_changes,
+                              double z) {
+  struct ebur128_dq_entry* block;
+  unsigned long limit = list_max;
+
+  if (ebur128_history_blocks(file, *list_size, list_max) >= list_max) {
+    ++*history_changes;
+  }
+  if (file && limit > BLOCK_FILE_HOT_BLOCKS) {
+    limit = BLOCK_FILE_HOT_BLOCKS;
+  }
+  if (*list_size >= limit) {
+    block = STAILQ_FIRST(list);
+    STAILQ_REMOVE_HEAD(list, entries);
+    if (file && limit < list_max &&
+        ebur128_block_file_append(file, block->z)) {
+      free(block);
+      --*list_size;
+      return EBUR128_ERROR_IO;
+    }
+  } else {
+    block = (struct ebur128_dq_entry*) malloc(sizeof(struct ebur128_dq_entry));
+    if (!block) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    ++*list_size;
+  }
+  block->z = z;
+  STAILQ_INSERT_TAIL(list, block, entries);
+  return EBUR128_SUCCESS;
+}
+
+/* Block log: magic, version and recorded fields, then one record per block
+ * with the fields in this order. */
+#define BLOCK_LOG_MAGIC "EBUL"
+#define BLOCK_LOG_VERSION 1
+#define BLOCK_LOG_HEADER_SIZE 6
+#define BLOCK_LOG_MOMENTARY 0
+#define BLOCK_LOG_SHORTTERM 1
+#define BLOCK_LOG_SAMPLE_PEAK 2
+#define BLOCK_LOG_TRUE_PEAK 3
+#define BLOCK_LOG_FIELDS 4
+/* Levels are stored in steps of 0.001 dB, clamped to +-200 dB. The lowest
+ * step stands for silence. */
+#define BLOCK_LOG_STEPS_PER_DB 1000.0
+#define BLOCK_LOG_SILENCE (-200000L)
+
+/** Append-only log of the blocks, see ebur128_set_block_log(). */
+struct ebur128_block_log_writer {
+  FILE* file;
+  /** Bit "i" is set if field "i" is recorded. */
+  unsigned int fields;
+  /** Last recorded level of each field, in steps. */
+  long previous[BLOCK_LOG_FIELDS];
+  /** Energies of the last 30 100ms segments (used as ring buffer), for the
+   *  short-term loudness. */
+  double segments[30];
+  size_t segments_index;
+  /** Set once the first gating block since the audio buffer was started has
+   *  been recorded. */
+  int started;
+  /** Peaks across all channels since the last record. */
+  double sample_peak;
+  double true_peak;
+};
+
+static void
+ebur128_block_log_writer_close(struct ebur128_block_log_writer* log) {
+  if (log) {
+    if (log->file) {
+      fclose(log->file);
+    }
+    free(log);
+  }
+}
+
+static long ebur128_block_log_steps(double level) {
+  double steps = floor(level * BLOCK_LOG_STEPS_PER_DB + 0.5);
+  /* also catches -inf and NaN */
+  if (!(steps > (double) BLOCK_LOG_SILENCE)) {
+    return BLOCK_LOG_SILENCE;
+  }
+  if (steps > (double) -BLOCK_LOG_SILENCE) {
+    return -BLOCK_LOG_SILENCE;
+  }
+  return (long) steps;
+}
+
+/* Append a record of the levels in dB of the recorded fields. Each level is
+ * stored as the difference to the previous one of its field, zigzag and
+ * varint encoded, so steady levels take a byte or two. */
+static int ebur128_block_log_write(struct ebur128_block_log_writer* log,
+                                   const double* levels) {
+  /* differences of at most 400000 steps fit into 3 bytes */
+  unsigned char record[BLOCK_LOG_FIELDS * 3];
+  size_t size = 0;
+  unsigned long zigzag;
+  long steps, delta;
+  int i;
+
+  for (i = 0; i < BLOCK_LOG_FIELDS; ++i) {
+    if (!(log->fields & (1U << i))) {
+      continue;
+    }
+    steps = ebur128_block_log_steps(levels[i]);
+    delta = steps - log->previous[i];
+    log->previous[i] = steps;
+    zigzag = delta < 0 ? ((unsigned long) -delta << 1) - 1
+                       : (unsigned long) delta << 1;
+    while (zigzag >= 0x80) {
+      record[size++] = (unsigned char) (zigzag | 0x80);
+      zigzag >>= 7;
+    }
+    record[size++] = (unsigned char) zigzag;
+  }
+  if (fwrite(record, 1, size, log->file) != size) {
+    return EBUR128_ERROR_IO;
+  }
+  return EBUR128_SUCCESS;
+}
+
+/** Maximum of a peak over a sliding window of 100ms segments. Each channel
+ *  has a ring of completed segments with decreasing peaks (monotonic deque),
+ *  so the front is always the maximum. */
+struct ebur128_peak_window {
+  /** Window length in ms, and in segments including the current one. */
+  unsigned long window;
+  size_t segments;
+  /** Rings of "segments" entries, one per channel. */
+  double* peaks;
+  unsigned long long* indices;
+  size_t* first;
+  size_t* count;
+};
+
+static void ebur128_peak_window_destroy(struct ebur128_peak_window* w) {
+  if (!w) {
+    return;
+  }
+  free(w->peaks);
+  free(w->indices);
+  free(w->first);
+  free(w->count);
+  free(w);
+}
+
+static struct ebur128_peak_window*
+ebur128_peak_window_create(unsigned int channels, unsigned long window) {
+  struct ebur128_peak_window* w;
+  size_t entries;
+
+  w = (struct ebur128_peak_window*) calloc(1, sizeof(*w));
+  if (!w) {
+    return NULL;
+  }
+  w->window = window;
+  w->segments = (window + 99) / 100;
+  if (safe_size_mul(w->segments, channels, &entries)) {
+    free(w);
+    return NULL;
+  }
+  w->peaks = (double*) malloc(entries * sizeof(double));
+  w->indices =
+      (unsigned long long*) malloc(entries * sizeof(unsigned long long));
+  w->first = (size_t*) calloc(channels, sizeof(size_t));
+  w->count = (size_t*) calloc(channels, sizeof(size_t));
+  if (!w->peaks || !w->indices || !w->first || !w->count) {
+    ebur128_peak_window_destroy(w);
+    return NULL;
+  }
+  return w;
+}
+
+/* Add the peak of the completed segment "index" of channel "c". */
+static void ebur128_peak_window_push(struct ebur128_peak_window* w,
+                                     size_t c,
+                                     unsigned long long index,
+                                     double peak) {
+  double* peaks = w->peaks + c * w->segments;
+  unsigned long long* indices = w->indices + c * w->segments;
+  size_t back;
+
+  /* smaller peaks before this one can never be the maximum again */
+  while (w->count[c] > 0) {
+    back = (w->first[c] + w->count[c] - 1) % w->segments;
+    if (peaks[back] > peak) {
+      break;
+    }
+    --w->count[c];
+  }
+  back = (w->first[c] + w->count[c]) % w->segments;
+  peaks[back] = peak;
+  indices[back] = index;
+  ++w->count[c];
+  /* drop segments that left the window */
+  while (w->count[c] > 0 &&
+         indices[w->first[c]] + w->segments <= index + 1) {
+    w->first[c] = (w->first[c] + 1) % w->segments;
+    --w->count[c];
+  }
+}
+
+/* Maximum of channel "c" over the window, "current" being the peak of the
+ * segment in progress. */
+static double ebur128_peak_window_max(struct ebur128_peak_window* w,
+                                      size_t c,
+                                      double current) {
+  if (w->count[c] > 0 && w->peaks[c * w->segments + w->first[c]] > current) {
+    return w->peaks[c * w->segments + w->first[c]];
+  }
+  return current;
+}
+
+#define SKETCH_MAX_LEVELS 64
+#define SKETCH_EPOCHS 8
+/* k for a rank error of about 0.5% */
+#define SKETCH_DEFAULT_K 400
+
+/** KLL quantile sketch of short-term block energies. Level h holds items
+ *  that each stand for 2^h added items. When the sketch is over capacity,
+ *  the lowest full level is sorted and every other item, starting at a
+ *  random offset, moves up one level. The rank error is about 2/k, in
+ *  roughly 3k items. */
+struct ebur128_sketch {
+  size_t k;
+  size_t levels;
+  double* items[SKETCH_MAX_LEVELS];
+  size_t size[SKETCH_MAX_LEVELS];
+  size_t allocated[SKETCH_MAX_LEVELS];
+  /** Number and sum of all added items. */
+  unsigned long long n;
+  double sum;
+  /** xorshift state for the compaction offsets. */
+  uint32_t coin;
+};
+
+static int ebur128_double_cmp(const void* p1, const void* p2) {
+  const double* d1 = (const double*) p1;
+  const double* d2 = (const double*) p2;
+  return (*d1 > *d2) - (*d1 < *d2);
+}
+
+static struct ebur128_sketch* ebur128_sketch_create(size_t k) {
+  struct ebur128_sketch* s =
+      (struct ebur128_sketch*) calloc(1, sizeof(struct ebur128_sketch));
+  if (!s) {
+    return NULL;
+  }
+  s->k = k;
+  s->levels = 1;
+  s->coin = 2463534242U;
+  return s;
+}
+
+/* Remove all items from a sketch, keeping its buffers. */
+static void ebur128_sketch_clear(struct ebur128_sketch* s) {
+  size_t h;
+  for (h = 0; h < s->levels; ++h) {
+    s->size[h] = 0;
+  }
+  s->n = 0;
+  s->sum = 0.0;
+}
+
+static void ebur128_sketch_destroy(struct ebur128_sketch* s) {
+  size_t h;
+  if (!s) {
+    return;
+  }
+  for (h = 0; h < s->levels; ++h) {
+    free(s->items[h]);
+  }
+  free(s);
+}
+
+/* Capacity of "level" in a sketch with "levels" levels. Lower levels shrink
+ * by a factor of 2/3 per level. */
+static size_t ebur128_sketch_capacity(size_t k, size_t levels, size_t level) {
+  double capacity = (double) k;
+  size_t h;
+  for (h = level + 1; h < levels; ++h) {
+    capacity *= 2.0 / 3.0;
+  }
+  return EBUR128_MAX((size_t) ceil(capacity), 2);
+}
+
+static int ebur128_sketch_append(struct ebur128_sketch* s,
+                                 size_t level,
+                                 const double* items,
+                                 size_t count) {
+  if (s->size[level] + count > s->allocated[level]) {
+    size_t allocated =
+        EBUR128_MAX(EBUR128_MAX(2 * s->allocated[level], 16),
+                    s->size[level] + count);
+    double* new_items =
+        (double*) realloc(s->items[level], allocated * sizeof(double));
+    if (!new_items) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    s->items[level] = new_items;
+    s->allocated[level] = allocated;
+  }
+  memcpy(s->items[level] + s->size[level], items, count * sizeof(double));
+  s->size[level] += count;
+  return EBUR128_SUCCESS;
+}
+
+static int ebur128_sketch_compress(struct ebur128_sketch* s) {
+  for (;;) {
+    size_t total = 0, capacity = 0, h, i, odd, pairs, offset;
+    double* items;
+
+    for (h = 0; h < s->levels; ++h) {
+      total += s->size[h];
+      capacity += ebur128_sketch_capacity(s->k, s->levels, h);
+    }
+    if (total <= capacity) {
+      return EBUR128_SUCCESS;
+    }
+    for (h = 0; h + 1 < s->levels; ++h) {
+      if (s->size[h] >= ebur128_sketch_capacity(s->k, s->levels, h)) {
+        break;
+      }
+    }
+    if (h + 1 == s->levels) {
+      if (s->levels == SKETCH_MAX_LEVELS) {
+        return EBUR128_ERROR_NOMEM;
+      }
+      ++s->levels;
+    }
+    items = s->items[h];
+    qsort(items, s->size[h], sizeof(double), ebur128_double_cmp);
+    s->coin ^= s->coin << 13;
+    s->coin ^= s->coin >> 17;
+    s->coin ^= s->coin << 5;
+    offset = s->coin & 1;
+    /* with an odd number of items, the smallest one stays */
+    odd = s->size[h] % 2;
+    pairs = s->size[h] / 2;
+    for (i = 0; i < pairs; ++i) {
+      items[odd + i] = items[odd + 2 * i + offset];
+    }
+    if (ebur128_sketch_append(s, h + 1, items + odd, pairs)) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    s->size[h] = odd;
+  }
+}
+
+static int ebur128_sketch_add(struct ebur128_sketch* s, double item) {
+  if (ebur128_sketch_append(s, 0, &item, 1)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  ++s->n;
+  s->sum += item;
+  return ebur128_sketch_compress(s);
+}
+
+/* Blocks per sketch epoch, so that SKETCH_EPOCHS epochs cover "blocks". */
+static unsigned long ebur128_sketch_epoch_blocks(unsigned long blocks) {
+  return EBUR128_MAX(blocks / SKETCH_EPOCHS + (blocks % SKETCH_EPOCHS != 0),
+                     1);
+}
+
 #define ALMOST_ZERO 0.000001
 #define FILTER_STATE_SIZE 5
 
+/* Number of samples (frames times channels) that are run through all stages
+ * of the filter at a time, so that the input, the resampler buffers and the
+ * output stay in cache between the stages. */
+#define TILE_SAMPLES 4096
+
+/* The fixed-point engine keeps samples in Q28, that is Q31 with three guard
+ * bits for the gain of the pre-filter and for overshoot. Filter coefficients
+ * are Q29 and interpolator coefficients Q30. Squared samples are summed in
+ * two 64 bit parts, Q32 and the remaining FIXED_ENERGY_SHIFT bits. */
+#define FIXED_SAMPLE_BITS 28
+#define FIXED_COEFF_BITS 29
+#define FIXED_INTERP_BITS 30
+#define FIXED_ENERGY_SHIFT (2 * FIXED_SAMPLE_BITS - 32)
+
+/* Blocks below the absolute gate are kept in bins of 0.1 LU down to
+ * -130 LUFS, for the loudness with a gain of up to +60 dB. */
+#define SUB_GATE_BINS 600
+
 typedef struct {
   unsigned int count;  /* Number of coefficients in this subfilter */
   unsigned int* index; /* Delay index of corresponding filter coeff */
   double* coeff;       /* List of subfilter coefficients */
+  int32_t* coeff_fixed; /* Q30 coefficients (fixed-point engine only) */
 } interp_filter;
 
 typedef struct {         /* Data structure for polyphase FIR interpolator */
@@ -52,17 +636,46 @@ typedef struct {         /* Data structure for polyphase FIR interpolator */
   unsigned int delay;    /* Size of delay buffer */
   interp_filter* filter; /* List of subfilters (one for each factor) */
   float** z;             /* List of delay buffers (one for each channel) */
+  int32_t** z_fixed;     /* Q28 delay buffers (fixed-point engine only) */
   unsigned int zi;       /* Current delay buffer index */
 } interpolator;
 
 /** BS.1770 filter state. */
 typedef double filter_state[FILTER_STATE_SIZE];
 
+/** BS.1770 filter state of the fixed-point engine: the pre-filter and the RLB
+ *  high-pass as two biquads in direct form I. The rounding error of each
+ *  stage is fed back into its next output (first order noise shaping). */
+typedef struct {
+  int32_t x[2][2];
+  int32_t y[2][2];
+  int64_t err[2];
+} fixed_filter_state;
+
 struct ebur128_state_internal {
-  /** Filtered audio data (used as ring buffer). */
+  /** Filtered audio data (used as ring buffer). The ring is followed by a
+   *  mirror of itself, so that the frames before any position in the ring
+   *  are contiguous. */
   double* audio_data;
+  /** Filtered audio data in Q28, replaces audio_data in the fixed-point
+   *  engine. */
+  int32_t* audio_data_fixed;
+  /** One tile of input in Q28 (fixed-point engine only). */
+  int32_t* fixed_input;
+  /** Samples from one input frame to the next, 0 if the input has as many
+   *  channels as the state. Set for the programmes of a mux. */
+  unsigned int input_stride;
   /** Size of audio_data array. */
   size_t audio_data_frames;
+  /** Number of samples allocated for audio_data, at least audio_data_frames
+   *  times channels, and as many again for the mirror. */
+  size_t audio_data_capacity;
+  /** Set if the mirror is a second mapping of the ring, otherwise it is
+   *  updated by ebur128_mirror_audio_data(). */
+  int audio_data_mapped;
+  /** Set while the DSP buffers are not allocated, from ebur128_init() or
+   *  ebur128_hibernate() until the next frames. */
+  int hibernating;
   /** Current index for audio_data. */
   size_t audio_data_index;
   /** How many frames are needed for a gating block. Will correspond to 400ms
@@ -79,6 +692,11 @@ struct ebur128_state_internal {
   double a[5];
   /** one filter_state per channel. */
   filter_state* v;
+  /** Fixed-point filter coefficients in Q29, one biquad per stage. */
+  int32_t fixed_b[2][3];
+  int32_t fixed_a[2][3];
+  /** one fixed_filter_state per channel (fixed-point engine only). */
+  fixed_filter_state* v_fixed;
   /** Linked list of block energies. */
   struct ebur128_double_queue block_list;
   unsigned long block_list_max;
@@ -87,9 +705,38 @@ struct ebur128_state_internal {
   struct ebur128_double_queue short_term_block_list;
   unsigned long st_block_list_max;
   unsigned long st_block_list_size;
+  /** Blocks added to the block energy and short-term histories, and how
+   *  often blocks left them or were moved. Lets an aggregator read only the
+   *  new blocks. */
+  unsigned long long blocks_added;
+  unsigned long long st_blocks_added;
+  unsigned long long history_changes;
+  /** Optional files receiving the blocks that do not fit into the lists. */
+  struct ebur128_block_file* block_file;
+  struct ebur128_block_file* st_block_file;
+  /** Optional log of the blocks for offline re-aggregation. */
+  struct ebur128_block_log_writer* block_log;
+  /** Quantile sketches of the short-term block energies, oldest first. Used
+   *  instead of short_term_block_list with EBUR128_MODE_LRA_SKETCH. Each
+   *  epoch holds st_sketch_epoch_blocks blocks, so dropping the oldest one
+   *  keeps the history. */
+  struct ebur128_sketch* st_sketch[SKETCH_EPOCHS + 1];
+  size_t st_sketch_epochs;
+  unsigned long st_sketch_epoch_blocks;
+  size_t st_sketch_k;
   int use_histogram;
   unsigned long* block_energy_histogram;
+  /** Sum, minimum and maximum of the block energies in each bin of
+   *  block_energy_histogram, 3 per bin. */
+  double* block_energy_sums;
   unsigned long* short_term_block_energy_histogram;
+  /** Number and energy sum of the blocks below the absolute gate in each of
+   *  SUB_GATE_BINS bins, from -70 LUFS down. NULL until the first such
+   *  block. */
+  unsigned long* sub_gate_histogram;
+  double* sub_gate_sums;
+  /** Number of short-term blocks below the absolute gate, same bins. */
+  unsigned long* st_sub_gate_histogram;
   /** Keeps track of when a new short term block is needed. */
   size_t short_term_frame_counter;
   /** Maximum sample peak, one per channel */
@@ -98,6 +745,34 @@ struct ebur128_state_internal {
   /** Maximum true peak, one per channel */
   double* true_peak;
   double* prev_true_peak;
+  /** Absolute frame index of each peak, one per channel */
+  unsigned long long* sample_peak_frame;
+  unsigned long long* prev_sample_peak_frame;
+  unsigned long long* true_peak_frame;
+  unsigned long long* prev_true_peak_frame;
+  /** Number of frames added since initialization. */
+  unsigned long long frames_total;
+  /** Optional sliding windows of sample and true peak maxima. */
+  struct ebur128_peak_window* sample_peak_window;
+  struct ebur128_peak_window* true_peak_window;
+  /** Peaks of the current 100ms segment, one per channel. Only allocated
+   *  while a peak window is set. */
+  double* segment_sample_peak;
+  double* segment_true_peak;
+  /** Frames left in the current segment, and its index. */
+  unsigned long peak_segment_counter;
+  unsigned long long peak_segment_index;
+  /** Optional waveform overview, written into a buffer of the caller. */
+  float* overview;
+  size_t overview_buckets;
+  unsigned long overview_frames_per_bucket;
+  /** Value of frames_total when the overview was started. */
+  unsigned long long overview_start;
+  /** Minimum, maximum and sum of squares of the current bucket, one per
+   *  channel. */
+  double* overview_min;
+  double* overview_max;
+  double* overview_sum;
   interpolator* interp;
   float* resampler_buffer_input;
   size_t resampler_buffer_input_frames;
@@ -106,6 +781,27 @@ struct ebur128_state_internal {
   /** The maximum window duration in ms. */
   unsigned long window;
   unsigned long history;
+  /** How many frames of audio_data contain valid data (saturating). */
+  size_t audio_data_fill;
+  /** Step in ms between evaluations of the maximum momentary and short-term
+   *  loudness, 0 if disabled. */
+  unsigned long max_loudness_step;
+  /** Step in frames, and frames left until the next evaluation. */
+  unsigned long max_loudness_step_frames;
+  unsigned long max_loudness_step_counter;
+  /** Mean energies of the last steps (used as ring buffer). */
+  double* max_loudness_segments;
+  size_t max_loudness_segments_size;
+  size_t max_loudness_segments_index;
+  size_t max_loudness_segments_fill;
+  /** Maximum momentary and short-term energy. */
+  double max_momentary;
+  double max_shortterm;
+  /** Optional worker threads for filtering. */
+  struct ebur128_pool* pool;
+  /** Optional consumer of the filtered audio. */
+  ebur128_filtered_callback filtered_callback;
+  void* filtered_callback_data;
 };
 
 static double relative_gate = -10.0;
@@ -115,9 +811,13 @@ static double relative_gate_factor;
 static double minus_twenty_decibels;
 static double histogram_energies[1000];
 static double histogram_energy_boundaries[1001];
+/* Set once the histogram tables above have been calculated. */
+static volatile size_t histogram_tables_ready;
 
-static interpolator*
-interp_create(unsigned int taps, unsigned int factor, unsigned int channels) {
+static interpolator* interp_create(unsigned int taps,
+                                   unsigned int factor,
+                                   unsigned int channels,
+                                   int fixed) {
   int errcode; /* unused */
   interpolator* interp;
   unsigned int j;
@@ -142,14 +842,28 @@ interp_create(unsigned int taps, unsigned int factor, unsigned int channels) {
     interp->filter[j].coeff = (double*) calloc(interp->delay, sizeof(double));
     CHECK_ERROR(!interp->filter[j].index || !interp->filter[j].coeff, 0,
                 free_filter_index_coeff);
+    if (fixed) {
+      interp->filter[j].coeff_fixed =
+          (int32_t*) calloc(interp->delay, sizeof(int32_t));
+      CHECK_ERROR(!interp->filter[j].coeff_fixed, 0, free_filter_index_coeff);
+    }
   }
 
   /* One delay buffer per channel. */
-  interp->z = (float**) calloc(interp->channels, sizeof(float*));
-  CHECK_ERROR(!interp->z, 0, free_filter_index_coeff);
-  for (j = 0; j < interp->channels; j++) {
-    interp->z[j] = (float*) calloc(interp->delay, sizeof(float));
-    CHECK_ERROR(!interp->z[j], 0, free_filter_z);
+  if (fixed) {
+    interp->z_fixed = (int32_t**) calloc(interp->channels, sizeof(int32_t*));
+    CHECK_ERROR(!interp->z_fixed, 0, free_filter_index_coeff);
+    for (j = 0; j < interp->channels; j++) {
+      interp->z_fixed[j] = (int32_t*) calloc(interp->delay, sizeof(int32_t));
+      CHECK_ERROR(!interp->z_fixed[j], 0, free_filter_z);
+    }
+  } else {
+    interp->z = (float**) calloc(interp->channels, sizeof(float*));
+    CHECK_ERROR(!interp->z, 0, free_filter_index_coeff);
+    for (j = 0; j < interp->channels; j++) {
+      interp->z[j] = (float*) calloc(interp->delay, sizeof(float));
+      CHECK_ERROR(!interp->z[j], 0, free_filter_z);
+    }
   }
 
   /* Calculate the filter coefficients */
@@ -169,19 +883,30 @@ interp_create(unsigned int taps, unsigned int factor, unsigned int channels) {
       unsigned int t = interp->filter[f].count++;
       interp->filter[f].coeff[t] = c;
       interp->filter[f].index[t] = j / interp->factor;
+      if (fixed) {
+        interp->filter[f].coeff_fixed[t] =
+            (int32_t) floor(c * (double) (1 << FIXED_INTERP_BITS) + 0.5);
+      }
     }
   }
   return interp;
 
 free_filter_z:
   for (j = 0; j < interp->channels; j++) {
-    free(interp->z[j]);
+    if (interp->z) {
+      free(interp->z[j]);
+    }
+    if (interp->z_fixed) {
+      free(interp->z_fixed[j]);
+    }
   }
   free(interp->z);
+  free(interp->z_fixed);
 free_filter_index_coeff:
   for (j = 0; j < interp->factor; j++) {
     free(interp->filter[j].index);
     free(interp->filter[j].coeff);
+    free(interp->filter[j].coeff_fixed);
   }
   free(interp->filter);
 free_interp:
@@ -198,36 +923,76 @@ static void interp_destroy(interpolator* interp) {
   for (j = 0; j < interp->factor; j++) {
     free(interp->filter[j].index);
     free(interp->filter[j].coeff);
+    free(interp->filter[j].coeff_fixed);
   }
   free(interp->filter);
   for (j = 0; j < interp->channels; j++) {
-    free(interp->z[j]);
+    if (interp->z) {
+      free(interp->z[j]);
+    }
+    if (interp->z_fixed) {
+      free(interp->z_fixed[j]);
+    }
   }
   free(interp->z);
+  free(interp->z_fixed);
   free(interp);
 }
 
-static size_t
-interp_process(interpolator* interp, size_t frames, float* in, float* out) {
+/* Clear the delay buffers, as if the interpolator was newly created. */
+static void interp_reset(interpolator* interp) {
+  unsigned int j;
+  for (j = 0; j < interp->channels; j++) {
+    if (interp->z) {
+      memset(interp->z[j], 0, interp->delay * sizeof(float));
+    }
+    if (interp->z_fixed) {
+      memset(interp->z_fixed[j], 0, interp->delay * sizeof(int32_t));
+    }
+  }
+  interp->zi = 0;
+}
+
+/* Absolute index of the input frame that an interpolated sample computed
+ * while adding input frame "frame" belongs to, compensating the delay of the
+ * filter. */
+static unsigned long long interp_frame(interpolator* interp,
+                                       unsigned long long frame) {
+  unsigned long long latency = (interp->taps - 1) / (2 * interp->factor);
+  return frame >= latency ? frame - latency : 0;
+}
+
+/* Process the channels [c_begin, c_end) of "frames" frames, starting at
+ * "offset" frames past the current delay buffer index. The delay buffer
+ * index is not advanced, see interp_advance(). */
+static size_t interp_process(interpolator* interp,
+                             size_t frames,
+                             size_t offset,
+                             float* in,
+                             float* out,
+                             unsigned int c_begin,
+                             unsigned int c_end) {
   size_t frame = 0;
   unsigned int chan = 0;
   unsigned int f = 0;
   unsigned int t = 0;
   unsigned int out_stride = interp->channels * interp->factor;
+  unsigned int zi =
+      (unsigned int) ((interp->zi + offset % interp->delay) % interp->delay);
   float* outp = 0;
   double acc = 0;
   double c = 0;
 
   for (frame = 0; frame < frames; frame++) {
-    for (chan = 0; chan < interp->channels; chan++) {
+    for (chan = c_begin; chan < c_end; chan++) {
       /* Add sample to delay buffer */
-      interp->z[chan][interp->zi] = *in++;
+      interp->z[chan][zi] = in[chan];
       /* Apply coefficients */
       outp = out + chan;
       for (f = 0; f < interp->factor; f++) {
         acc = 0.0;
         for (t = 0; t < interp->filter[f].count; t++) {
-          int i = (int) interp->zi - (int) interp->filter[f].index[t];
+          int i = (int) zi - (int) interp->filter[f].index[t];
           if (i < 0) {
             i += (int) interp->delay;
           }
@@ -238,19 +1003,270 @@ interp_process(interpolator* interp, size_t frames, float* in, float* out) {
         outp += interp->channels;
       }
     }
+    in += interp->channels;
     out += out_stride;
-    interp->zi++;
-    if (interp->zi == interp->delay) {
-      interp->zi = 0;
+    zi++;
+    if (zi == interp->delay) {
+      zi = 0;
     }
   }
 
   return frames * interp->factor;
 }
 
-static int ebur128_init_filter(ebur128_state* st) {
-  int errcode = EBUR128_SUCCESS;
-  int i, j;
+/* Fixed-point version of interp_process() for channel "chan". Instead of
+ * writing out the interpolated samples, the largest one is returned and the
+ * frame it was computed at is stored in "peak_frame". */
+static double interp_process_fixed(interpolator* interp,
+                                   size_t frames,
+                                   size_t offset,
+                                   const int32_t* in,
+                                   unsigned int chan,
+                                   size_t* peak_frame) {
+  size_t frame = 0;
+  unsigned int f = 0;
+  unsigned int t = 0;
+  int32_t* z = interp->z_fixed[chan];
+  unsigned int zi =
+      (unsigned int) ((interp->zi + offset % interp->delay) % interp->delay);
+  int64_t max = 0;
+
+  *peak_frame = 0;
+  for (frame = 0; frame < frames; frame++) {
+    /* Add sample to delay buffer */
+    z[zi] = in[frame * interp->channels + chan];
+    /* Apply coefficients */
+    for (f = 0; f < interp->factor; f++) {
+      int64_t acc = 0;
+      for (t = 0; t < interp->filter[f].count; t++) {
+        int i = (int) zi - (int) interp->filter[f].index[t];
+        if (i < 0) {
+          i += (int) interp->delay;
+        }
+        acc += (int64_t) interp->filter[f].coeff_fixed[t] * z[i];
+      }
+      if (acc < 0) {
+        acc = -acc;
+      }
+      if (acc > max) {
+        max = acc;
+        *peak_frame = frame;
+      }
+    }
+    zi++;
+    if (zi == interp->delay) {
+      zi = 0;
+    }
+  }
+  return ldexp((double) max, -(FIXED_SAMPLE_BITS + FIXED_INTERP_BITS));
+}
+
+static void interp_advance(interpolator* interp, size_t frames) {
+  interp->zi = (unsigned int) ((interp->zi + frames) % interp->delay);
+}
+
+typedef void (*ebur128_filter_fn)(ebur128_state* st,
+                                  const void* src,
+                                  size_t frames,
+                                  unsigned int c_begin,
+                                  unsigned int c_end);
+
+/* Channel groups are multiples of this. If the number of channels is a
+ * multiple of 8 too, threads do not share cache lines of audio_data. */
+#define CHANNEL_GROUP_ALIGN 8
+
+/** Worker threads that filter groups of channels of the same chunk. */
+struct ebur128_pool {
+  /** Number of worker threads. The calling thread filters the first group. */
+  unsigned int threads;
+  struct ebur128_pool_worker* workers;
+  ebur128_mutex mutex;
+  ebur128_cond start_cond;
+  ebur128_cond done_cond;
+  /** Incremented for every job. */
+  unsigned long generation;
+  /** Workers that have not finished the current job. */
+  unsigned int pending;
+  int quit;
+  /** The current job. */
+  ebur128_filter_fn filter;
+  ebur128_state* st;
+  const void* src;
+  size_t frames;
+  unsigned int group_size;
+};
+
+struct ebur128_pool_worker {
+  struct ebur128_pool* pool;
+  unsigned int index;
+  ebur128_thread thread;
+};
+
+static void ebur128_pool_work(struct ebur128_pool_worker* worker) {
+  struct ebur128_pool* pool = worker->pool;
+  unsigned long generation = 0;
+  unsigned int c_begin, c_end;
+
+  ebur128_mutex_lock(&pool->mutex);
+  for (;;) {
+    while (!pool->quit && pool->generation == generation) {
+      ebur128_cond_wait(&pool->start_cond, &pool->mutex);
+    }
+    if (pool->quit) {
+      break;
+    }
+    generation = pool->generation;
+    c_begin = worker->index * pool->group_size;
+    c_end = c_begin + pool->group_size;
+    if (c_end > pool->st->channels) {
+      c_end = pool->st->channels;
+    }
+    ebur128_mutex_unlock(&pool->mutex);
+
+    if (c_begin < c_end) {
+      pool->filter(pool->st, pool->src, pool->frames, c_begin, c_end);
+    }
+
+    ebur128_mutex_lock(&pool->mutex);
+    if (--pool->pending == 0) {
+      ebur128_cond_signal(&pool->done_cond);
+    }
+  }
+  ebur128_mutex_unlock(&pool->mutex);
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI ebur128_pool_thread(LPVOID worker) {
+  ebur128_pool_work((struct ebur128_pool_worker*) worker);
+  return 0;
+}
+#else
+static void* ebur128_pool_thread(void* worker) {
+  ebur128_pool_work((struct ebur128_pool_worker*) worker);
+  return NULL;
+}
+#endif
+
+static void ebur128_pool_destroy(struct ebur128_pool* pool) {
+  unsigned int i;
+
+  if (!pool) {
+    return;
+  }
+  ebur128_mutex_lock(&pool->mutex);
+  pool->quit = 1;
+  ebur128_cond_broadcast(&pool->start_cond);
+  ebur128_mutex_unlock(&pool->mutex);
+  for (i = 0; i < pool->threads; ++i) {
+#if defined(_WIN32)
+    WaitForSingleObject(pool->workers[i].thread, INFINITE);
+    CloseHandle(pool->workers[i].thread);
+#else
+    pthread_join(pool->workers[i].thread, NULL);
+#endif
+  }
+  ebur128_cond_destroy(&pool->done_cond);
+  ebur128_cond_destroy(&pool->start_cond);
+  ebur128_mutex_destroy(&pool->mutex);
+  free(pool->workers);
+  free(pool);
+}
+
+static struct ebur128_pool* ebur128_pool_create(unsigned int threads) {
+  int errcode; /* unused */
+  struct ebur128_pool* pool;
+
+  pool = (struct ebur128_pool*) calloc(1, sizeof(struct ebur128_pool));
+  CHECK_ERROR(!pool, 0, exit)
+  pool->workers = (struct ebur128_pool_worker*) calloc(
+      threads, sizeof(struct ebur128_pool_worker));
+  CHECK_ERROR(!pool->workers, 0, free_pool)
+  CHECK_ERROR(ebur128_mutex_init(&pool->mutex), 0, free_workers)
+  CHECK_ERROR(ebur128_cond_init(&pool->start_cond), 0, destroy_mutex)
+  CHECK_ERROR(ebur128_cond_init(&pool->done_cond), 0, destroy_start_cond)
+
+  for (pool->threads = 0; pool->threads < threads; ++pool->threads) {
+    struct ebur128_pool_worker* worker = &pool->workers[pool->threads];
+    worker->pool = pool;
+    worker->index = pool->threads + 1;
+#if defined(_WIN32)
+    worker->thread =
+        CreateThread(NULL, 0, ebur128_pool_thread, worker, 0, NULL);
+    CHECK_ERROR(!worker->thread, 0, destroy_pool)
+#else
+    CHECK_ERROR(
+        pthread_create(&worker->thread, NULL, ebur128_pool_thread, worker), 0,
+        destroy_pool)
+#endif
+  }
+  return pool;
+
+destroy_pool:
+  /* stops the threads started so far */
+  ebur128_pool_destroy(pool);
+  return NULL;
+destroy_start_cond:
+  ebur128_cond_destroy(&pool->start_cond);
+destroy_mutex:
+  ebur128_mutex_destroy(&pool->mutex);
+free_workers:
+  free(pool->workers);
+free_pool:
+  free(pool);
+exit:
+  return NULL;
+}
+
+static void ebur128_pool_run(struct ebur128_pool* pool,
+                             ebur128_state* st,
+                             ebur128_filter_fn filter,
+                             const void* src,
+                             size_t frames) {
+  unsigned int groups = pool->threads + 1;
+  unsigned int group_size = (st->channels + groups - 1) / groups;
+
+  group_size = (group_size + CHANNEL_GROUP_ALIGN - 1) / CHANNEL_GROUP_ALIGN *
+               CHANNEL_GROUP_ALIGN;
+
+  ebur128_mutex_lock(&pool->mutex);
+  pool->filter = filter;
+  pool->st = st;
+  pool->src = src;
+  pool->frames = frames;
+  pool->group_size = group_size;
+  pool->pending = pool->threads;
+  pool->generation++;
+  ebur128_cond_broadcast(&pool->start_cond);
+  ebur128_mutex_unlock(&pool->mutex);
+
+  filter(st, src, frames, 0, EBUR128_MIN(group_size, st->channels));
+
+  ebur128_mutex_lock(&pool->mutex);
+  while (pool->pending) {
+    ebur128_cond_wait(&pool->done_cond, &pool->mutex);
+  }
+  ebur128_mutex_unlock(&pool->mutex);
+}
+
+/* Filter a chunk of frames, in parallel if there is a pool. */
+static void ebur128_run_filter(ebur128_state* st,
+                               ebur128_filter_fn filter,
+                               const void* src,
+                               size_t frames) {
+  if (st->d->pool && st->channels > CHANNEL_GROUP_ALIGN) {
+    ebur128_pool_run(st->d->pool, st, filter, src, frames);
+  } else {
+    filter(st, src, frames, 0, st->channels);
+  }
+  if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK &&
+      st->d->interp) {
+    interp_advance(st->d->interp, frames);
+  }
+}
+
+/* Calculate the filter coefficients for the current samplerate. */
+static void ebur128_calc_filter(ebur128_state* st) {
+  int j;
 
   double f0 = 1681.974450955533;
   double G = 3.999843853973347;
@@ -296,19 +1312,60 @@ static int ebur128_init_filter(ebur128_state* st) {
   st->d->a[3] = pa[1] * ra[2] + pa[2] * ra[1];
   st->d->a[4] = pa[2] * ra[2];
 
-  st->d->v = (filter_state*) malloc(st->channels * sizeof(filter_state));
-  CHECK_ERROR(!st->d->v, EBUR128_ERROR_NOMEM, exit);
+  for (j = 0; j < 3; ++j) {
+    double scale = (double) (1 << FIXED_COEFF_BITS);
+    st->d->fixed_b[0][j] = (int32_t) floor(pb[j] * scale + 0.5);
+    st->d->fixed_a[0][j] = (int32_t) floor(pa[j] * scale + 0.5);
+    st->d->fixed_b[1][j] = (int32_t) floor(rb[j] * scale + 0.5);
+    st->d->fixed_a[1][j] = (int32_t) floor(ra[j] * scale + 0.5);
+  }
+}
+
+/* Clear the filter state of all channels. */
+static void ebur128_clear_filter(ebur128_state* st) {
+  int i, j;
+
   for (i = 0; i < (int) st->channels; ++i) {
     for (j = 0; j < FILTER_STATE_SIZE; ++j) {
       st->d->v[i][j] = 0.0;
     }
   }
-
-exit:
-  return errcode;
+  if (st->d->v_fixed) {
+    memset(st->d->v_fixed, 0, st->channels * sizeof(fixed_filter_state));
+  }
 }
 
-static int ebur128_init_channel_map(ebur128_state* st) {
+static int ebur128_init_filter(ebur128_state* st) {
+  int errcode = EBUR128_SUCCESS;
+  int i, j;
+
+  ebur128_calc_filter(st);
+
+  st->d->v = (filter_state*) malloc(st->channels * sizeof(filter_state));
+  CHECK_ERROR(!st->d->v, EBUR128_ERROR_NOMEM, exit);
+  for (i = 0; i < (int) st->channels; ++i) {
+    for (j = 0; j < FILTER_STATE_SIZE; ++j) {
+      st->d->v[i][j] = 0.0;
+    }
+  }
+
+  st->d->v_fixed = NULL;
+  if ((st->mode & EBUR128_MODE_FIXED_POINT) == EBUR128_MODE_FIXED_POINT) {
+    st->d->v_fixed = (fixed_filter_state*) calloc(st->channels,
+                                                  sizeof(fixed_filter_state));
+    CHECK_ERROR(!st->d->v_fixed, EBUR128_ERROR_NOMEM, free_v);
+  }
+
+exit:
+  return errcode;
+
+free_v:
+  free(st->d->v);
+  st->d->v = NULL;
+  return errcode;
+}
+
+static int ebur128_init_channel_map(ebur128_state* st) {
   size_t i;
   st->d->channel_map = (int*) malloc(st->channels * sizeof(int));
   if (!st->d->channel_map) {
@@ -341,14 +1398,25 @@ static int ebur128_init_channel_map(ebur128_state* st) {
   return EBUR128_SUCCESS;
 }
 
+/* Oversampling factor of the true peak interpolator, 0 if none is needed. */
+static unsigned int ebur128_interp_factor(unsigned long samplerate) {
+  if (samplerate < 96000) {
+    return 4;
+  } else if (samplerate < 192000) {
+    return 2;
+  }
+  return 0;
+}
+
 static int ebur128_init_resampler(ebur128_state* st) {
   int errcode = EBUR128_SUCCESS;
 
-  if (st->samplerate < 96000) {
-    st->d->interp = interp_create(49, 4, st->channels);
-    CHECK_ERROR(!st->d->interp, EBUR128_ERROR_NOMEM, exit)
-  } else if (st->samplerate < 192000) {
-    st->d->interp = interp_create(49, 2, st->channels);
+  int fixed =
+      (st->mode & EBUR128_MODE_FIXED_POINT) == EBUR128_MODE_FIXED_POINT;
+  unsigned int factor = ebur128_interp_factor(st->samplerate);
+
+  if (factor) {
+    st->d->interp = interp_create(49, factor, st->channels, fixed);
     CHECK_ERROR(!st->d->interp, EBUR128_ERROR_NOMEM, exit)
   } else {
     st->d->resampler_buffer_input = NULL;
@@ -357,6 +1425,13 @@ static int ebur128_init_resampler(ebur128_state* st) {
     goto exit;
   }
 
+  if (fixed) {
+    /* the fixed-point engine reads from fixed_input directly */
+    st->d->resampler_buffer_input = NULL;
+    st->d->resampler_buffer_output = NULL;
+    goto exit;
+  }
+
   st->d->resampler_buffer_input_frames = st->d->samples_in_100ms * 4;
   st->d->resampler_buffer_input = (float*) malloc(
       st->d->resampler_buffer_input_frames * st->channels * sizeof(float));
@@ -389,6 +1464,187 @@ static void ebur128_destroy_resampler(ebur128_state* st) {
   st->d->interp = NULL;
 }
 
+/* Set up the resampler after a change of the samplerate or channels. The
+ * interpolator only depends on its factor and the channels, so it is kept
+ * (with cleared delay buffers) if both are unchanged and the buffers are
+ * large enough for the new samplerate. */
+static int ebur128_reinit_resampler(ebur128_state* st) {
+  interpolator* interp = st->d->interp;
+
+  if (interp && interp->channels == st->channels &&
+      interp->factor == ebur128_interp_factor(st->samplerate) &&
+      (!st->d->resampler_buffer_input ||
+       st->d->resampler_buffer_input_frames >= st->d->samples_in_100ms * 4)) {
+    interp_reset(interp);
+    return EBUR128_SUCCESS;
+  }
+  ebur128_destroy_resampler(st);
+  return ebur128_init_resampler(st);
+}
+
+/* Size of a ring buffer of at least "frames" frames of "frame_size" bytes.
+ * A ring that is mirrored by mapping its pages twice has to be a whole
+ * number of pages. */
+static size_t ebur128_ring_frames(size_t frames, size_t frame_size) {
+#ifdef EBUR128_MIRROR_MAP
+  long page = sysconf(_SC_PAGESIZE);
+  if (page > 0) {
+    size_t step = (size_t) page;
+    size_t a = step, b = frame_size;
+    while (b) {
+      size_t t = a % b;
+      a = b;
+      b = t;
+    }
+    step /= a;
+    frames = (frames + step - 1) / step * step;
+  }
+#else
+  (void) frame_size;
+#endif
+  return frames;
+}
+
+/* Allocate a zeroed ring buffer of "bytes" bytes, directly followed by its
+ * mirror. Where possible, the mirror is a second mapping of the pages of the
+ * ring and "*mapped" is set. */
+static void* ebur128_ring_alloc(size_t bytes, int* mapped) {
+#ifdef EBUR128_MIRROR_MAP
+  int fd = (int) syscall(SYS_memfd_create, "ebur128", MFD_CLOEXEC);
+  if (fd >= 0) {
+    char* ring = (char*) mmap(NULL, 2 * bytes, PROT_NONE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring != (char*) MAP_FAILED) {
+      if (ftruncate(fd, (off_t) bytes) == 0 &&
+          mmap(ring, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+               0) == (void*) ring &&
+          mmap(ring + bytes, bytes, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, fd, 0) == (void*) (ring + bytes)) {
+        close(fd);
+        *mapped = 1;
+        return ring;
+      }
+      munmap(ring, 2 * bytes);
+    }
+    close(fd);
+  }
+#endif
+  *mapped = 0;
+  return calloc(2, bytes);
+}
+
+static void ebur128_free_audio_data(ebur128_state* st) {
+  if (st->d->audio_data_mapped) {
+#ifdef EBUR128_MIRROR_MAP
+    size_t bytes = st->d->audio_data_capacity *
+                   (st->d->audio_data_fixed ? sizeof(int32_t) : sizeof(double));
+    munmap(st->d->audio_data_fixed ? (void*) st->d->audio_data_fixed
+                                   : (void*) st->d->audio_data,
+           2 * bytes);
+#endif
+  } else {
+    free(st->d->audio_data);
+    free(st->d->audio_data_fixed);
+  }
+  st->d->audio_data = NULL;
+  st->d->audio_data_fixed = NULL;
+  st->d->audio_data_capacity = 0;
+  st->d->audio_data_mapped = 0;
+}
+
+/* Copy "frames" frames that have just been filtered into the ring buffer to
+ * its mirror, unless the mirror is mapped. */
+static void ebur128_mirror_audio_data(ebur128_state* st, size_t frames) {
+  size_t mirror = st->d->audio_data_frames * st->channels;
+  size_t index = st->d->audio_data_index;
+
+  if (st->d->audio_data_mapped) {
+    return;
+  }
+  if (st->d->audio_data_fixed) {
+    memcpy(st->d->audio_data_fixed + mirror + index,
+           st->d->audio_data_fixed + index,
+           frames * st->channels * sizeof(int32_t));
+  } else {
+    memcpy(st->d->audio_data + mirror + index, st->d->audio_data + index,
+           frames * st->channels * sizeof(double));
+  }
+}
+
+/* Offset in samples of the first of the last "frames" filtered frames. The
+ * frames up to the current position are contiguous from there, using the
+ * mirror if the ring wraps around. */
+static size_t ebur128_window_offset(ebur128_state* st, size_t frames) {
+  size_t index = st->d->audio_data_index;
+  if (index < frames * st->channels) {
+    index += st->d->audio_data_frames * st->channels;
+  }
+  return index - frames * st->channels;
+}
+
+/* Zero the part of the ring buffer (and its mirror) that holds audio and
+ * rewind it. Until the ring wraps around, only its first audio_data_fill
+ * frames were written. */
+static void ebur128_clear_audio_data(ebur128_state* st) {
+  size_t samples = st->d->audio_data_fill * st->channels;
+  size_t mirror = st->d->audio_data_frames * st->channels;
+  size_t j;
+
+  if (st->d->audio_data_fixed) {
+    memset(st->d->audio_data_fixed, 0, samples * sizeof(int32_t));
+    if (!st->d->audio_data_mapped) {
+      memset(st->d->audio_data_fixed + mirror, 0, samples * sizeof(int32_t));
+    }
+  } else if (st->d->audio_data) {
+    for (j = 0; j < samples; ++j) {
+      st->d->audio_data[j] = 0.0;
+    }
+    for (j = 0; !st->d->audio_data_mapped && j < samples; ++j) {
+      st->d->audio_data[mirror + j] = 0.0;
+    }
+  }
+  st->d->audio_data_index = 0;
+  st->d->audio_data_fill = 0;
+}
+
+/* Replace the ring buffer by a zeroed one of at least "frames" frames. The
+ * current buffer is cleared and reused if it fits, and kept on failure. */
+static int ebur128_alloc_audio_data(ebur128_state* st, size_t frames) {
+  int fixed =
+      (st->mode & EBUR128_MODE_FIXED_POINT) == EBUR128_MODE_FIXED_POINT;
+  size_t sample_size = fixed ? sizeof(int32_t) : sizeof(double);
+  size_t samples;
+
+  frames = ebur128_ring_frames(frames, st->channels * sample_size);
+  samples = frames * st->channels;
+  if (samples <= st->d->audio_data_capacity &&
+      (!st->d->audio_data_mapped ||
+       st->d->audio_data_capacity % st->channels == 0)) {
+    ebur128_clear_audio_data(st);
+    /* a mapped mirror starts right after the ring, so the ring keeps its
+     * size */
+    if (st->d->audio_data_mapped) {
+      frames = st->d->audio_data_capacity / st->channels;
+    }
+  } else {
+    int mapped;
+    void* ring = ebur128_ring_alloc(samples * sample_size, &mapped);
+    if (!ring) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    ebur128_free_audio_data(st);
+    if (fixed) {
+      st->d->audio_data_fixed = (int32_t*) ring;
+    } else {
+      st->d->audio_data = (double*) ring;
+    }
+    st->d->audio_data_capacity = samples;
+    st->d->audio_data_mapped = mapped;
+  }
+  st->d->audio_data_frames = frames;
+  return EBUR128_SUCCESS;
+}
+
 void ebur128_get_version(int* major, int* minor, int* patch) {
   *major = EBUR128_VERSION_MAJOR;
   *minor = EBUR128_VERSION_MINOR;
@@ -409,13 +1665,33 @@ void ebur128_get_version(int* major, int* minor, int* patch) {
     }                                                                          \
   } while (0);
 
+/* Initialize the static constants, and the histogram tables if "histogram"
+ * is set and they are not ready yet. */
+static void ebur128_init_constants(int histogram) {
+  size_t i;
+
+  relative_gate_factor = pow(10.0, relative_gate / 10.0);
+  minus_twenty_decibels = pow(10.0, -20.0 / 10.0);
+  histogram_energy_boundaries[0] = pow(10.0, (-70.0 + 0.691) / 10.0);
+  if (histogram && !ebur128_atomic_load(&histogram_tables_ready)) {
+    for (i = 0; i < 1000; ++i) {
+      histogram_energies[i] =
+          pow(10.0, ((double) i / 10.0 - 69.95 + 0.691) / 10.0);
+    }
+    for (i = 1; i < 1001; ++i) {
+      histogram_energy_boundaries[i] =
+          pow(10.0, ((double) i / 10.0 - 70.0 + 0.691) / 10.0);
+    }
+    ebur128_atomic_store(&histogram_tables_ready, 1);
+  }
+}
+
 ebur128_state*
 ebur128_init(unsigned int channels, unsigned long samplerate, int mode) {
-  int result;
   int errcode;
   ebur128_state* st;
   unsigned int i;
-  size_t j;
+  size_t frames;
 
   VALIDATE_CHANNELS_AND_SAMPLERATE(NULL);
 
@@ -442,6 +1718,31 @@ ebur128_init(unsigned int channels, unsigned long samplerate, int mode) {
     st->d->true_peak[i] = 0.0;
     st->d->prev_true_peak[i] = 0.0;
   }
+  st->d->sample_peak_frame =
+      (unsigned long long*) calloc(channels, sizeof(unsigned long long));
+  st->d->prev_sample_peak_frame =
+      (unsigned long long*) calloc(channels, sizeof(unsigned long long));
+  st->d->true_peak_frame =
+      (unsigned long long*) calloc(channels, sizeof(unsigned long long));
+  st->d->prev_true_peak_frame =
+      (unsigned long long*) calloc(channels, sizeof(unsigned long long));
+  CHECK_ERROR(!st->d->sample_peak_frame || !st->d->prev_sample_peak_frame ||
+                  !st->d->true_peak_frame || !st->d->prev_true_peak_frame,
+              0, free_peak_frames)
+  st->d->frames_total = 0;
+  st->d->sample_peak_window = NULL;
+  st->d->true_peak_window = NULL;
+  st->d->segment_sample_peak = NULL;
+  st->d->segment_true_peak = NULL;
+  st->d->peak_segment_counter = 0;
+  st->d->peak_segment_index = 0;
+  st->d->overview = NULL;
+  st->d->overview_buckets = 0;
+  st->d->overview_frames_per_bucket = 0;
+  st->d->overview_start = 0;
+  st->d->overview_min = NULL;
+  st->d->overview_max = NULL;
+  st->d->overview_sum = NULL;
 
   st->d->use_histogram = mode & EBUR128_MODE_HISTOGRAM ? 1 : 0;
   st->d->history = ULONG_MAX;
@@ -453,88 +1754,91 @@ ebur128_init(unsigned int channels, unsigned long samplerate, int mode) {
   } else if ((mode & EBUR128_MODE_M) == EBUR128_MODE_M) {
     st->d->window = 400;
   } else {
-    goto free_prev_true_peak;
+    goto free_peak_frames;
   }
-  st->d->audio_data_frames = st->samplerate * st->d->window / 1000;
-  if (st->d->audio_data_frames % st->d->samples_in_100ms) {
+  frames = st->samplerate * st->d->window / 1000;
+  if (frames % st->d->samples_in_100ms) {
     /* round up to multiple of samples_in_100ms */
-    st->d->audio_data_frames =
-        (st->d->audio_data_frames + st->d->samples_in_100ms) -
-        (st->d->audio_data_frames % st->d->samples_in_100ms);
-  }
-  st->d->audio_data = (double*) malloc(st->d->audio_data_frames * st->channels *
-                                       sizeof(double));
-  CHECK_ERROR(!st->d->audio_data, 0, free_prev_true_peak)
-  for (j = 0; j < st->d->audio_data_frames * st->channels; ++j) {
-    st->d->audio_data[j] = 0.0;
+    frames = (frames + st->d->samples_in_100ms) -
+             (frames % st->d->samples_in_100ms);
   }
+  st->d->audio_data = NULL;
+  st->d->audio_data_fixed = NULL;
+  st->d->audio_data_capacity = 0;
+  st->d->audio_data_mapped = 0;
+  st->d->audio_data_frames = frames;
+  st->d->fixed_input = NULL;
+  st->d->input_stride = 0;
+  st->d->interp = NULL;
+  st->d->resampler_buffer_input = NULL;
+  st->d->resampler_buffer_output = NULL;
+  /* the DSP buffers are allocated with the first frames */
+  st->d->hibernating = 1;
 
   errcode = ebur128_init_filter(st);
-  CHECK_ERROR(errcode, 0, free_audio_data)
+  CHECK_ERROR(errcode, 0, free_peak_frames)
 
-  if (st->d->use_histogram) {
-    st->d->block_energy_histogram =
-        (unsigned long*) malloc(1000 * sizeof(unsigned long));
-    CHECK_ERROR(!st->d->block_energy_histogram, 0, free_filter)
-    for (i = 0; i < 1000; ++i) {
-      st->d->block_energy_histogram[i] = 0;
-    }
-  } else {
-    st->d->block_energy_histogram = NULL;
-  }
-  if (st->d->use_histogram) {
-    st->d->short_term_block_energy_histogram =
-        (unsigned long*) malloc(1000 * sizeof(unsigned long));
-    CHECK_ERROR(!st->d->short_term_block_energy_histogram, 0,
-                free_block_energy_histogram)
-    for (i = 0; i < 1000; ++i) {
-      st->d->short_term_block_energy_histogram[i] = 0;
-    }
-  } else {
-    st->d->short_term_block_energy_histogram = NULL;
-  }
+  /* the histograms are allocated with their first block */
+  st->d->block_energy_histogram = NULL;
+  st->d->block_energy_sums = NULL;
+  st->d->short_term_block_energy_histogram = NULL;
   STAILQ_INIT(&st->d->block_list);
   st->d->block_list_size = 0;
   st->d->block_list_max = st->d->history / 100;
   STAILQ_INIT(&st->d->short_term_block_list);
   st->d->st_block_list_size = 0;
+  st->d->sub_gate_histogram = NULL;
+  st->d->sub_gate_sums = NULL;
+  st->d->st_sub_gate_histogram = NULL;
+  st->d->blocks_added = 0;
+  st->d->st_blocks_added = 0;
+  st->d->history_changes = 0;
   st->d->st_block_list_max = st->d->history / 3000;
+  st->d->block_file = NULL;
+  st->d->block_log = NULL;
+  st->d->st_block_file = NULL;
   st->d->short_term_frame_counter = 0;
-
-  result = ebur128_init_resampler(st);
-  CHECK_ERROR(result, 0, free_short_term_block_energy_histogram)
+  st->d->st_sketch_epochs = 0;
+  st->d->st_sketch_epoch_blocks =
+      ebur128_sketch_epoch_blocks(st->d->st_block_list_max);
+  st->d->st_sketch_k = SKETCH_DEFAULT_K;
+  if ((mode & EBUR128_MODE_LRA_SKETCH) == EBUR128_MODE_LRA_SKETCH) {
+    st->d->st_sketch[0] = ebur128_sketch_create(st->d->st_sketch_k);
+    CHECK_ERROR(!st->d->st_sketch[0], 0, free_filter)
+    st->d->st_sketch_epochs = 1;
+  }
 
   /* the first block needs 400ms of audio data */
   st->d->needed_frames = st->d->samples_in_100ms * 4;
   /* start at the beginning of the buffer */
   st->d->audio_data_index = 0;
-
-  /* initialize static constants */
-  relative_gate_factor = pow(10.0, relative_gate / 10.0);
-  minus_twenty_decibels = pow(10.0, -20.0 / 10.0);
-  histogram_energy_boundaries[0] = pow(10.0, (-70.0 + 0.691) / 10.0);
-  if (st->d->use_histogram) {
-    for (i = 0; i < 1000; ++i) {
-      histogram_energies[i] =
-          pow(10.0, ((double) i / 10.0 - 69.95 + 0.691) / 10.0);
-    }
-    for (i = 1; i < 1001; ++i) {
-      histogram_energy_boundaries[i] =
-          pow(10.0, ((double) i / 10.0 - 70.0 + 0.691) / 10.0);
-    }
-  }
+  st->d->audio_data_fill = 0;
+
+  st->d->max_loudness_step = 0;
+  st->d->max_loudness_step_frames = 0;
+  st->d->max_loudness_step_counter = 0;
+  st->d->max_loudness_segments = NULL;
+  st->d->max_loudness_segments_size = 0;
+  st->d->max_loudness_segments_index = 0;
+  st->d->max_loudness_segments_fill = 0;
+  st->d->max_momentary = 0.0;
+  st->d->max_shortterm = 0.0;
+  st->d->filtered_callback = NULL;
+  st->d->filtered_callback_data = NULL;
+  st->d->pool = NULL;
+
+  ebur128_init_constants(st->d->use_histogram);
 
   return st;
 
-free_short_term_block_energy_histogram:
-  free(st->d->short_term_block_energy_histogram);
-free_block_energy_histogram:
-  free(st->d->block_energy_histogram);
 free_filter:
   free(st->d->v);
-free_audio_data:
-  free(st->d->audio_data);
-free_prev_true_peak:
+  free(st->d->v_fixed);
+free_peak_frames:
+  free(st->d->sample_peak_frame);
+  free(st->d->prev_sample_peak_frame);
+  free(st->d->true_peak_frame);
+  free(st->d->prev_true_peak_frame);
   free(st->d->prev_true_peak);
 free_true_peak:
   free(st->d->true_peak);
@@ -554,15 +1858,36 @@ exit:
 
 void ebur128_destroy(ebur128_state** st) {
   struct ebur128_dq_entry* entry;
+  size_t i;
   free((*st)->d->short_term_block_energy_histogram);
+  for (i = 0; i < (*st)->d->st_sketch_epochs; ++i) {
+    ebur128_sketch_destroy((*st)->d->st_sketch[i]);
+  }
   free((*st)->d->block_energy_histogram);
+  free((*st)->d->block_energy_sums);
+  free((*st)->d->sub_gate_histogram);
+  free((*st)->d->sub_gate_sums);
+  free((*st)->d->st_sub_gate_histogram);
   free((*st)->d->v);
-  free((*st)->d->audio_data);
+  free((*st)->d->v_fixed);
+  ebur128_free_audio_data(*st);
+  free((*st)->d->fixed_input);
   free((*st)->d->channel_map);
   free((*st)->d->sample_peak);
   free((*st)->d->prev_sample_peak);
   free((*st)->d->true_peak);
   free((*st)->d->prev_true_peak);
+  free((*st)->d->sample_peak_frame);
+  free((*st)->d->prev_sample_peak_frame);
+  free((*st)->d->true_peak_frame);
+  free((*st)->d->prev_true_peak_frame);
+  ebur128_peak_window_destroy((*st)->d->sample_peak_window);
+  ebur128_peak_window_destroy((*st)->d->true_peak_window);
+  free((*st)->d->segment_sample_peak);
+  free((*st)->d->segment_true_peak);
+  free((*st)->d->overview_min);
+  free((*st)->d->overview_max);
+  free((*st)->d->overview_sum);
   while (!STAILQ_EMPTY(&(*st)->d->block_list)) {
     entry = STAILQ_FIRST(&(*st)->d->block_list);
     STAILQ_REMOVE_HEAD(&(*st)->d->block_list, entries);
@@ -573,28 +1898,71 @@ void ebur128_destroy(ebur128_state** st) {
     STAILQ_REMOVE_HEAD(&(*st)->d->short_term_block_list, entries);
     free(entry);
   }
+  ebur128_pool_destroy((*st)->d->pool);
+  ebur128_block_file_close((*st)->d->block_file);
+  ebur128_block_file_close((*st)->d->st_block_file);
+  ebur128_block_log_writer_close((*st)->d->block_log);
   ebur128_destroy_resampler(*st);
+  free((*st)->d->max_loudness_segments);
   free((*st)->d);
   free(*st);
   *st = NULL;
 }
 
-static void ebur128_check_true_peak(ebur128_state* st, size_t frames) {
+/* Merge the sample peak "peak" of channel "c", found at absolute frame
+ * "frame", into the peaks of the current call and of the current segment. */
+static void ebur128_merge_sample_peak(ebur128_state* st,
+                                      size_t c,
+                                      double peak,
+                                      unsigned long long frame) {
+  if (peak > st->d->prev_sample_peak[c]) {
+    st->d->prev_sample_peak[c] = peak;
+    st->d->prev_sample_peak_frame[c] = frame;
+  }
+  if (st->d->segment_sample_peak && peak > st->d->segment_sample_peak[c]) {
+    st->d->segment_sample_peak[c] = peak;
+  }
+}
+
+/* Same as ebur128_merge_sample_peak() for the true peak. */
+static void ebur128_merge_true_peak(ebur128_state* st,
+                                    size_t c,
+                                    double peak,
+                                    unsigned long long frame) {
+  if (peak > st->d->prev_true_peak[c]) {
+    st->d->prev_true_peak[c] = peak;
+    st->d->prev_true_peak_frame[c] = frame;
+  }
+  if (st->d->segment_true_peak && peak > st->d->segment_true_peak[c]) {
+    st->d->segment_true_peak[c] = peak;
+  }
+}
+
+static void ebur128_check_true_peak(ebur128_state* st,
+                                    size_t frames,
+                                    size_t offset,
+                                    unsigned int c_begin,
+                                    unsigned int c_end) {
   size_t c, i, frames_out;
 
-  frames_out =
-      interp_process(st->d->interp, frames, st->d->resampler_buffer_input,
-                     st->d->resampler_buffer_output);
+  frames_out = interp_process(st->d->interp, frames, offset,
+                              st->d->resampler_buffer_input,
+                              st->d->resampler_buffer_output, c_begin, c_end);
 
-  for (i = 0; i < frames_out; ++i) {
-    for (c = 0; c < st->channels; ++c) {
+  for (c = c_begin; c < c_end; ++c) {
+    double max = 0.0;
+    size_t max_frame = 0;
+    for (i = 0; i < frames_out; ++i) {
       double val =
           (double) st->d->resampler_buffer_output[i * st->channels + c];
-
-      if (EBUR128_MAX(val, -val) > st->d->prev_true_peak[c]) {
-        st->d->prev_true_peak[c] = EBUR128_MAX(val, -val);
+      if (EBUR128_MAX(val, -val) > max) {
+        max = EBUR128_MAX(val, -val);
+        max_frame = i / st->d->interp->factor;
       }
     }
+    ebur128_merge_true_peak(
+        st, c, max,
+        interp_frame(st->d->interp, st->d->frames_total + offset + max_frame));
   }
 }
 
@@ -616,65 +1984,165 @@ static void ebur128_check_true_peak(ebur128_state* st, size_t frames) {
   st->d->v[c][1] = fabs(st->d->v[c][1]) < DBL_MIN ? 0.0 : st->d->v[c][1];
 #endif
 
+/* Number of frames from absolute frame "frame" to the end of its overview
+ * bucket. */
+static size_t ebur128_overview_left(ebur128_state* st,
+                                    unsigned long long frame) {
+  return (size_t) (st->d->overview_frames_per_bucket -
+                   (frame - st->d->overview_start) %
+                       st->d->overview_frames_per_bucket);
+}
+
+/* Write the overview of channel "c" for the bucket containing absolute frame
+ * "frame". "frames" is the number of frames accumulated in the bucket. */
+static void ebur128_overview_write(ebur128_state* st,
+                                   unsigned int c,
+                                   unsigned long long frame,
+                                   unsigned long frames) {
+  unsigned long long bucket =
+      (frame - st->d->overview_start) / st->d->overview_frames_per_bucket;
+  float* out;
+
+  if (bucket >= st->d->overview_buckets) {
+    return;
+  }
+  out = st->d->overview + ((size_t) bucket * st->channels + c) * 3;
+  out[0] = (float) st->d->overview_min[c];
+  out[1] = (float) st->d->overview_max[c];
+  out[2] = (float) sqrt(st->d->overview_sum[c] / (double) frames);
+}
+
+static void ebur128_overview_reset(ebur128_state* st, unsigned int c) {
+  st->d->overview_min[c] = HUGE_VAL;
+  st->d->overview_max[c] = -HUGE_VAL;
+  st->d->overview_sum[c] = 0.0;
+}
+
+/* Store the accumulated overview of channel "c" up to absolute frame "end",
+ * and write out the bucket if "end" completes it. */
+static void ebur128_overview_store(ebur128_state* st,
+                                   unsigned int c,
+                                   unsigned long long end,
+                                   double min,
+                                   double max,
+                                   double sum) {
+  st->d->overview_min[c] = min;
+  st->d->overview_max[c] = max;
+  st->d->overview_sum[c] = sum;
+  if ((end - st->d->overview_start) % st->d->overview_frames_per_bucket == 0) {
+    ebur128_overview_write(st, c, end - 1, st->d->overview_frames_per_bucket);
+    ebur128_overview_reset(st, c);
+  }
+}
+
+/* Samples from one input frame to the next. */
+static size_t ebur128_input_stride(const ebur128_state* st) {
+  return st->d->input_stride ? st->d->input_stride : st->channels;
+}
+
+/* Filters the channels [c_begin, c_end) of "frames" frames. */
 #define EBUR128_FILTER(type, min_scale, max_scale)                             \
-  static void ebur128_filter_##type(ebur128_state* st, const type* src,        \
-                                    size_t frames) {                           \
+  static void ebur128_filter_##type(ebur128_state* st, const void* source,     \
+                                    size_t frames, unsigned int c_begin,       \
+                                    unsigned int c_end) {                      \
     static double scaling_factor =                                             \
         EBUR128_MAX(-((double) (min_scale)), (double) (max_scale));            \
                                                                                \
-    double* audio_data = st->d->audio_data + st->d->audio_data_index;          \
-    size_t i, c;                                                               \
+    size_t tile = EBUR128_MAX(TILE_SAMPLES / st->channels, 1);                 \
+    size_t stride = ebur128_input_stride(st);                                  \
+    size_t t, i, c;                                                            \
                                                                                \
     TURN_ON_FTZ                                                                \
                                                                                \
-    if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK) {   \
-      for (c = 0; c < st->channels; ++c) {                                     \
-        double max = 0.0;                                                      \
-        for (i = 0; i < frames; ++i) {                                         \
-          double cur = (double) src[i * st->channels + c];                     \
-          if (EBUR128_MAX(cur, -cur) > max) {                                  \
-            max = EBUR128_MAX(cur, -cur);                                      \
+    for (t = 0; t < frames; t += tile) {                                       \
+      const type* src = (const type*) source + t * stride;                     \
+      double* audio_data =                                                     \
+          st->d->audio_data + st->d->audio_data_index + t * st->channels;      \
+      size_t tile_frames = EBUR128_MIN(tile, frames - t);                      \
+                                                                               \
+      if (st->d->overview) {                                                   \
+        /* sample peak and overview in one scan of the tile */                 \
+        for (c = c_begin; c < c_end; ++c) {                                    \
+          double max = 0.0;                                                    \
+          size_t max_frame = 0;                                                \
+          for (i = 0; i < tile_frames;) {                                      \
+            size_t end = EBUR128_MIN(                                          \
+                tile_frames,                                                   \
+                i + ebur128_overview_left(st, st->d->frames_total + t + i));   \
+            double lo = st->d->overview_min[c];                                \
+            double hi = st->d->overview_max[c];                                \
+            double sum = st->d->overview_sum[c];                               \
+            for (; i < end; ++i) {                                             \
+              double raw = (double) src[i * stride + c];                       \
+              double cur = raw / scaling_factor;                               \
+              if (EBUR128_MAX(raw, -raw) > max) {                              \
+                max = EBUR128_MAX(raw, -raw);                                  \
+                max_frame = i;                                                 \
+              }                                                                \
+              lo = EBUR128_MIN(lo, cur);                                       \
+              hi = EBUR128_MAX(hi, cur);                                       \
+              sum += cur * cur;                                                \
+            }                                                                  \
+            ebur128_overview_store(st, (unsigned int) c,                       \
+                                   st->d->frames_total + t + i, lo, hi, sum);  \
+          }                                                                    \
+          if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) ==                         \
+              EBUR128_MODE_SAMPLE_PEAK) {                                      \
+            ebur128_merge_sample_peak(st, c, max / scaling_factor,             \
+                                      st->d->frames_total + t + max_frame);    \
           }                                                                    \
         }                                                                      \
-        max /= scaling_factor;                                                 \
-        if (max > st->d->prev_sample_peak[c]) {                                \
-          st->d->prev_sample_peak[c] = max;                                    \
+      } else if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) ==                      \
+                 EBUR128_MODE_SAMPLE_PEAK) {                                   \
+        for (c = c_begin; c < c_end; ++c) {                                    \
+          double max = 0.0;                                                    \
+          size_t max_frame = 0;                                                \
+          for (i = 0; i < tile_frames; ++i) {                                  \
+            double cur = (double) src[i * stride + c];                         \
+            if (EBUR128_MAX(cur, -cur) > max) {                                \
+              max = EBUR128_MAX(cur, -cur);                                    \
+              max_frame = i;                                                   \
+            }                                                                  \
+          }                                                                    \
+          ebur128_merge_sample_peak(st, c, max / scaling_factor,               \
+                                    st->d->frames_total + t + max_frame);      \
         }                                                                      \
       }                                                                        \
-    }                                                                          \
-    if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK &&       \
-        st->d->interp) {                                                       \
-      for (i = 0; i < frames; ++i) {                                           \
-        for (c = 0; c < st->channels; ++c) {                                   \
-          st->d->resampler_buffer_input[i * st->channels + c] =                \
-              (float) ((double) src[i * st->channels + c] / scaling_factor);   \
+      if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK &&     \
+          st->d->interp) {                                                     \
+        for (i = 0; i < tile_frames; ++i) {                                    \
+          for (c = c_begin; c < c_end; ++c) {                                  \
+            st->d->resampler_buffer_input[i * st->channels + c] =              \
+                (float) ((double) src[i * stride + c] / scaling_factor);       \
+          }                                                                    \
         }                                                                      \
+        ebur128_check_true_peak(st, tile_frames, t, (unsigned int) c_begin,    \
+                                (unsigned int) c_end);                         \
       }                                                                        \
-      ebur128_check_true_peak(st, frames);                                     \
-    }                                                                          \
-    for (c = 0; c < st->channels; ++c) {                                       \
-      if (st->d->channel_map[c] == EBUR128_UNUSED) {                           \
-        continue;                                                              \
-      }                                                                        \
-      for (i = 0; i < frames; ++i) {                                           \
-        st->d->v[c][0] =                                                       \
-            (double) ((double) src[i * st->channels + c] / scaling_factor) -   \
-            st->d->a[1] * st->d->v[c][1] - /**/                                \
-            st->d->a[2] * st->d->v[c][2] - /**/                                \
-            st->d->a[3] * st->d->v[c][3] - /**/                                \
-            st->d->a[4] * st->d->v[c][4];                                      \
-        audio_data[i * st->channels + c] = /**/                                \
-            st->d->b[0] * st->d->v[c][0] + /**/                                \
-            st->d->b[1] * st->d->v[c][1] + /**/                                \
-            st->d->b[2] * st->d->v[c][2] + /**/                                \
-            st->d->b[3] * st->d->v[c][3] + /**/                                \
-            st->d->b[4] * st->d->v[c][4];                                      \
-        st->d->v[c][4] = st->d->v[c][3];                                       \
-        st->d->v[c][3] = st->d->v[c][2];                                       \
-        st->d->v[c][2] = st->d->v[c][1];                                       \
-        st->d->v[c][1] = st->d->v[c][0];                                       \
+      for (c = c_begin; c < c_end; ++c) {                                      \
+        if (st->d->channel_map[c] == EBUR128_UNUSED) {                         \
+          continue;                                                            \
+        }                                                                      \
+        for (i = 0; i < tile_frames; ++i) {                                    \
+          st->d->v[c][0] =                                                     \
+              (double) ((double) src[i * stride + c] / scaling_factor) -       \
+              st->d->a[1] * st->d->v[c][1] - /**/                              \
+              st->d->a[2] * st->d->v[c][2] - /**/                              \
+              st->d->a[3] * st->d->v[c][3] - /**/                              \
+              st->d->a[4] * st->d->v[c][4];                                    \
+          audio_data[i * st->channels + c] = /**/                              \
+              st->d->b[0] * st->d->v[c][0] + /**/                              \
+              st->d->b[1] * st->d->v[c][1] + /**/                              \
+              st->d->b[2] * st->d->v[c][2] + /**/                              \
+              st->d->b[3] * st->d->v[c][3] + /**/                              \
+              st->d->b[4] * st->d->v[c][4];                                    \
+          st->d->v[c][4] = st->d->v[c][3];                                     \
+          st->d->v[c][3] = st->d->v[c][2];                                     \
+          st->d->v[c][2] = st->d->v[c][1];                                     \
+          st->d->v[c][1] = st->d->v[c][0];                                     \
+        }                                                                      \
+        FLUSH_MANUALLY                                                         \
       }                                                                        \
-      FLUSH_MANUALLY                                                           \
     }                                                                          \
     TURN_OFF_FTZ                                                               \
   }
@@ -684,6 +2152,150 @@ EBUR128_FILTER(int, INT_MIN, INT_MAX)
 EBUR128_FILTER(float, -1.0f, 1.0f)
 EBUR128_FILTER(double, -1.0, 1.0)
 
+/* Runs the fixed-point engine over the channels [c_begin, c_end) of one tile
+ * of "frames" frames in fixed_input, which starts "offset" frames into the
+ * current chunk. */
+static void ebur128_filter_fixed_tile(ebur128_state* st,
+                                      size_t offset,
+                                      size_t frames,
+                                      unsigned int c_begin,
+                                      unsigned int c_end) {
+  const int32_t* in = st->d->fixed_input;
+  int32_t* audio_data = st->d->audio_data_fixed + st->d->audio_data_index +
+                        offset * st->channels;
+  size_t i;
+  unsigned int c;
+  int k;
+
+  if (st->d->overview) {
+    /* sample peak and overview in one scan of the tile */
+    for (c = c_begin; c < c_end; ++c) {
+      int32_t max = 0;
+      size_t max_frame = 0;
+      for (i = 0; i < frames;) {
+        size_t end = EBUR128_MIN(
+            frames,
+            i + ebur128_overview_left(st, st->d->frames_total + offset + i));
+        double lo = st->d->overview_min[c];
+        double hi = st->d->overview_max[c];
+        double sum = st->d->overview_sum[c];
+        for (; i < end; ++i) {
+          int32_t raw = in[i * st->channels + c];
+          double cur = ldexp((double) raw, -FIXED_SAMPLE_BITS);
+          if (EBUR128_MAX(raw, -raw) > max) {
+            max = EBUR128_MAX(raw, -raw);
+            max_frame = i;
+          }
+          lo = EBUR128_MIN(lo, cur);
+          hi = EBUR128_MAX(hi, cur);
+          sum += cur * cur;
+        }
+        ebur128_overview_store(st, c, st->d->frames_total + offset + i, lo, hi,
+                               sum);
+      }
+      if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK) {
+        ebur128_merge_sample_peak(st, c,
+                                  ldexp((double) max, -FIXED_SAMPLE_BITS),
+                                  st->d->frames_total + offset + max_frame);
+      }
+    }
+  } else if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) ==
+             EBUR128_MODE_SAMPLE_PEAK) {
+    for (c = c_begin; c < c_end; ++c) {
+      int32_t max = 0;
+      size_t max_frame = 0;
+      for (i = 0; i < frames; ++i) {
+        int32_t cur = in[i * st->channels + c];
+        if (EBUR128_MAX(cur, -cur) > max) {
+          max = EBUR128_MAX(cur, -cur);
+          max_frame = i;
+        }
+      }
+      ebur128_merge_sample_peak(st, c, ldexp((double) max, -FIXED_SAMPLE_BITS),
+                                st->d->frames_total + offset + max_frame);
+    }
+  }
+  if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK &&
+      st->d->interp) {
+    for (c = c_begin; c < c_end; ++c) {
+      size_t max_frame;
+      double peak = interp_process_fixed(st->d->interp, frames, offset, in, c,
+                                         &max_frame);
+      ebur128_merge_true_peak(
+          st, c, peak,
+          interp_frame(st->d->interp,
+                       st->d->frames_total + offset + max_frame));
+    }
+  }
+  for (c = c_begin; c < c_end; ++c) {
+    fixed_filter_state v;
+    if (st->d->channel_map[c] == EBUR128_UNUSED) {
+      continue;
+    }
+    v = st->d->v_fixed[c];
+    for (i = 0; i < frames; ++i) {
+      int32_t x = in[i * st->channels + c];
+      for (k = 0; k < 2; ++k) {
+        int64_t acc = v.err[k] + /**/
+                      (int64_t) st->d->fixed_b[k][0] * x +
+                      (int64_t) st->d->fixed_b[k][1] * v.x[k][0] +
+                      (int64_t) st->d->fixed_b[k][2] * v.x[k][1] -
+                      (int64_t) st->d->fixed_a[k][1] * v.y[k][0] -
+                      (int64_t) st->d->fixed_a[k][2] * v.y[k][1];
+        int64_t y = acc >> FIXED_COEFF_BITS;
+        if (y > INT32_MAX || y < -INT32_MAX) {
+          y = y > 0 ? INT32_MAX : -INT32_MAX;
+          v.err[k] = 0;
+        } else {
+          v.err[k] = acc - y * ((int64_t) 1 << FIXED_COEFF_BITS);
+        }
+        v.x[k][1] = v.x[k][0];
+        v.x[k][0] = x;
+        v.y[k][1] = v.y[k][0];
+        v.y[k][0] = (int32_t) y;
+        x = (int32_t) y;
+      }
+      audio_data[i * st->channels + c] = x;
+    }
+    st->d->v_fixed[c] = v;
+  }
+}
+
+#define SHORT_TO_FIXED(x) ((int32_t) (x) * (1 << (FIXED_SAMPLE_BITS - 15)))
+#define INT_TO_FIXED(x) ((int32_t) ((x) >> (31 - FIXED_SAMPLE_BITS)))
+/* Input above +12 dBFS is clipped. */
+#define REAL_TO_FIXED(x)                                                       \
+  ((int32_t) (EBUR128_MIN(EBUR128_MAX((x), -4), 4) * (1 << FIXED_SAMPLE_BITS)))
+
+/* Fixed-point version of ebur128_filter_##type. */
+#define EBUR128_FILTER_FIXED(type, to_fixed)                                   \
+  static void ebur128_filter_fixed_##type(ebur128_state* st,                   \
+                                          const void* source, size_t frames,   \
+                                          unsigned int c_begin,                \
+                                          unsigned int c_end) {                \
+    size_t tile = EBUR128_MAX(TILE_SAMPLES / st->channels, 1);                 \
+    size_t stride = ebur128_input_stride(st);                                  \
+    size_t t, i, c;                                                            \
+                                                                               \
+    for (t = 0; t < frames; t += tile) {                                       \
+      const type* src = (const type*) source + t * stride;                     \
+      size_t tile_frames = EBUR128_MIN(tile, frames - t);                      \
+                                                                               \
+      for (i = 0; i < tile_frames; ++i) {                                      \
+        for (c = c_begin; c < c_end; ++c) {                                    \
+          st->d->fixed_input[i * st->channels + c] =                           \
+              to_fixed(src[i * stride + c]);                                   \
+        }                                                                      \
+      }                                                                        \
+      ebur128_filter_fixed_tile(st, t, tile_frames, c_begin, c_end);           \
+    }                                                                          \
+  }
+
+EBUR128_FILTER_FIXED(short, SHORT_TO_FIXED)
+EBUR128_FILTER_FIXED(int, INT_TO_FIXED)
+EBUR128_FILTER_FIXED(float, REAL_TO_FIXED)
+EBUR128_FILTER_FIXED(double, REAL_TO_FIXED)
+
 static double ebur128_energy_to_loudness(double energy) {
   return 10 * (log(energy) / log(10.0)) - 0.691;
 }
@@ -705,46 +2317,155 @@ static size_t find_histogram_index(double energy) {
   return index_min;
 }
 
+/* Sum of the squares of the last "frames_per_block" filtered frames of
+ * channel "c", fixed-point engine. */
+static double ebur128_fixed_channel_sum(ebur128_state* st,
+                                        size_t c,
+                                        size_t frames_per_block) {
+  const int32_t* audio_data = st->d->audio_data_fixed +
+                              ebur128_window_offset(st, frames_per_block) + c;
+  size_t i;
+  /* The squares are split into their upper bits and FIXED_ENERGY_SHIFT lower
+   * bits, so that the sum is exact without overflowing. */
+  int64_t sum = 0;
+  int64_t sum_low = 0;
+
+  for (i = 0; i < frames_per_block; ++i) {
+    int64_t cur = audio_data[i * st->channels];
+    int64_t square = cur * cur;
+    sum += square >> FIXED_ENERGY_SHIFT;
+    sum_low += square & (((int64_t) 1 << FIXED_ENERGY_SHIFT) - 1);
+  }
+  return ldexp((double) sum, -32) +
+         ldexp((double) sum_low, -2 * FIXED_SAMPLE_BITS);
+}
+
+/* Bin of a block energy below the absolute gate, SUB_GATE_BINS if it is too
+ * low to be kept. */
+static size_t ebur128_sub_gate_index(double energy) {
+  double bin = (-70.0 - ebur128_energy_to_loudness(energy)) * 10.0;
+  if (!(bin < (double) SUB_GATE_BINS)) {
+    return SUB_GATE_BINS;
+  }
+  return bin > 0.0 ? (size_t) bin : 0;
+}
+
+/* Energy at the centre of a bin below the absolute gate. */
+static double ebur128_sub_gate_energy(size_t bin) {
+  return pow(10.0, (-70.0 - ((double) bin + 0.5) / 10.0 + 0.691) / 10.0);
+}
+
+/* Allocate a zeroed histogram of "bins" bins, and "sums_per_bin" zeroed
+ * sums per bin unless "sums" is NULL, on its first block. The sums come
+ * first, so that they exist whenever the histogram does. */
+static int ebur128_alloc_histogram(unsigned long** histogram,
+                                   double** sums,
+                                   size_t bins,
+                                   size_t sums_per_bin) {
+  if (sums && !*sums) {
+    *sums = (double*) calloc(bins * sums_per_bin, sizeof(double));
+    if (!*sums) {
+      return EBUR128_ERROR_NOMEM;
+    }
+  }
+  if (!*histogram) {
+    *histogram = (unsigned long*) calloc(bins, sizeof(unsigned long));
+    if (!*histogram) {
+      return EBUR128_ERROR_NOMEM;
+    }
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Count a block below the absolute gate, and add its energy to "sums"
+ * unless that is NULL. The bins are allocated with the first block. */
+static int ebur128_add_sub_gate_block(unsigned long** histogram,
+                                      double** sums,
+                                      double energy) {
+  size_t index = ebur128_sub_gate_index(energy);
+
+  if (index == SUB_GATE_BINS) {
+    return EBUR128_SUCCESS;
+  }
+  if (ebur128_alloc_histogram(histogram, sums, SUB_GATE_BINS, 1)) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  ++(*histogram)[index];
+  if (sums) {
+    (*sums)[index] += energy;
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Add the energy of a completed gating block to the block history. */
+static int ebur128_add_gating_block(ebur128_state* st, double sum) {
+  if (sum >= histogram_energy_boundaries[0]) {
+    ++st->d->blocks_added;
+    if (st->d->use_histogram) {
+      size_t index = find_histogram_index(sum);
+      double* bin;
+      if (ebur128_alloc_histogram(&st->d->block_energy_histogram,
+                                  &st->d->block_energy_sums, 1000, 3)) {
+        return EBUR128_ERROR_NOMEM;
+      }
+      bin = st->d->block_energy_sums + 3 * index;
+      if (!st->d->block_energy_histogram[index]++) {
+        bin[1] = bin[2] = sum;
+      }
+      bin[0] += sum;
+      bin[1] = EBUR128_MIN(bin[1], sum);
+      bin[2] = EBUR128_MAX(bin[2], sum);
+    } else {
+      return ebur128_push_block(&st->d->block_list, &st->d->block_list_size,
+                                st->d->block_list_max, st->d->block_file,
+                                &st->d->history_changes, sum);
+    }
+  } else {
+    return ebur128_add_sub_gate_block(&st->d->sub_gate_histogram,
+                                      &st->d->sub_gate_sums, sum);
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Weight of a channel in the sum of the channel energies. */
+static double ebur128_channel_weight(int channel) {
+  if (channel == EBUR128_Mp110 || channel == EBUR128_Mm110 ||
+      channel == EBUR128_Mp060 || channel == EBUR128_Mm060 ||
+      channel == EBUR128_Mp090 || channel == EBUR128_Mm090) {
+    return 1.41;
+  } else if (channel == EBUR128_DUAL_MONO) {
+    return 2.0;
+  } else if (channel == EBUR128_UNUSED) {
+    return 0.0;
+  }
+  return 1.0;
+}
+
 static int ebur128_calc_gating_block(ebur128_state* st,
                                      size_t frames_per_block,
                                      double* optional_output) {
   size_t i, c;
   double sum = 0.0;
   double channel_sum;
+  const double* audio_data = NULL;
+  if (!st->d->audio_data_fixed) {
+    audio_data =
+        st->d->audio_data + ebur128_window_offset(st, frames_per_block);
+  }
   for (c = 0; c < st->channels; ++c) {
     if (st->d->channel_map[c] == EBUR128_UNUSED) {
       continue;
     }
     channel_sum = 0.0;
-    if (st->d->audio_data_index < frames_per_block * st->channels) {
-      for (i = 0; i < st->d->audio_data_index / st->channels; ++i) {
-        channel_sum += st->d->audio_data[i * st->channels + c] *
-                       st->d->audio_data[i * st->channels + c];
-      }
-      for (i = st->d->audio_data_frames -
-               (frames_per_block - st->d->audio_data_index / st->channels);
-           i < st->d->audio_data_frames; ++i) {
-        channel_sum += st->d->audio_data[i * st->channels + c] *
-                       st->d->audio_data[i * st->channels + c];
-      }
+    if (st->d->audio_data_fixed) {
+      channel_sum = ebur128_fixed_channel_sum(st, c, frames_per_block);
     } else {
-      for (i = st->d->audio_data_index / st->channels - frames_per_block;
-           i < st->d->audio_data_index / st->channels; ++i) {
-        channel_sum += st->d->audio_data[i * st->channels + c] *
-                       st->d->audio_data[i * st->channels + c];
+      for (i = 0; i < frames_per_block; ++i) {
+        channel_sum += audio_data[i * st->channels + c] *
+                       audio_data[i * st->channels + c];
       }
     }
-    if (st->d->channel_map[c] == EBUR128_Mp110 ||
-        st->d->channel_map[c] == EBUR128_Mm110 ||
-        st->d->channel_map[c] == EBUR128_Mp060 ||
-        st->d->channel_map[c] == EBUR128_Mm060 ||
-        st->d->channel_map[c] == EBUR128_Mp090 ||
-        st->d->channel_map[c] == EBUR128_Mm090) {
-      channel_sum *= 1.41;
-    } else if (st->d->channel_map[c] == EBUR128_DUAL_MONO) {
-      channel_sum *= 2.0;
-    }
-    sum += channel_sum;
+    sum += ebur128_channel_weight(st->d->channel_map[c]) * channel_sum;
   }
 
   sum /= (double) frames_per_block;
@@ -753,29 +2474,76 @@ static int ebur128_calc_gating_block(ebur128_state* st,
     *optional_output = sum;
     return EBUR128_SUCCESS;
   }
-
-  if (sum >= histogram_energy_boundaries[0]) {
-    if (st->d->use_histogram) {
-      ++st->d->block_energy_histogram[find_histogram_index(sum)];
-    } else {
-      struct ebur128_dq_entry* block;
-      if (st->d->block_list_size == st->d->block_list_max) {
-        block = STAILQ_FIRST(&st->d->block_list);
-        STAILQ_REMOVE_HEAD(&st->d->block_list, entries);
-      } else {
-        block =
-            (struct ebur128_dq_entry*) malloc(sizeof(struct ebur128_dq_entry));
-        if (!block) {
-          return EBUR128_ERROR_NOMEM;
-        }
-        st->d->block_list_size++;
-      }
-      block->z = sum;
-      STAILQ_INSERT_TAIL(&st->d->block_list, block, entries);
-    }
-  }
-
-  return EBUR128_SUCCESS;
+  return ebur128_add_gating_block(st, sum);
+}
+
+static int ebur128_calc_max_loudness_step(ebur128_state* st,
+                                          unsigned long step,
+                                          unsigned long* step_frames,
+                                          size_t* segments) {
+  unsigned long steps_in_100ms;
+
+  if (step == 0 || 100 % step) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  steps_in_100ms = 100 / step;
+  if (st->d->samples_in_100ms % steps_in_100ms) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  *step_frames = st->d->samples_in_100ms / steps_in_100ms;
+  if ((st->mode & EBUR128_MODE_S) == EBUR128_MODE_S) {
+    *segments = 30 * (size_t) steps_in_100ms;
+  } else {
+    *segments = 4 * (size_t) steps_in_100ms;
+  }
+  return EBUR128_SUCCESS;
+}
+
+static void ebur128_reset_max_loudness(ebur128_state* st) {
+  st->d->max_loudness_segments_index = 0;
+  st->d->max_loudness_segments_fill = 0;
+  st->d->max_loudness_step_counter = st->d->max_loudness_step_frames;
+}
+
+static void ebur128_update_max_loudness(ebur128_state* st) {
+  size_t i, index;
+  size_t momentary_segments =
+      4 * (size_t) (st->d->samples_in_100ms / st->d->max_loudness_step_frames);
+  double energy;
+  double sum = 0.0;
+
+  /* Momentary and short-term energies are the means of the mean energies of
+   * the last 400ms and 3s worth of steps. */
+  ebur128_calc_gating_block(st, st->d->max_loudness_step_frames, &energy);
+  index = st->d->max_loudness_segments_index;
+  st->d->max_loudness_segments[index] = energy;
+  if (++st->d->max_loudness_segments_index ==
+      st->d->max_loudness_segments_size) {
+    st->d->max_loudness_segments_index = 0;
+  }
+  if (st->d->max_loudness_segments_fill < st->d->max_loudness_segments_size) {
+    st->d->max_loudness_segments_fill++;
+  }
+
+  for (i = 0; i < st->d->max_loudness_segments_fill; ++i) {
+    sum += st->d->max_loudness_segments[index];
+    index = index ? index - 1 : st->d->max_loudness_segments_size - 1;
+    if (i + 1 == momentary_segments) {
+      energy = sum / (double) momentary_segments;
+      if (energy > st->d->max_momentary) {
+        st->d->max_momentary = energy;
+      }
+    }
+  }
+  if ((st->mode & EBUR128_MODE_S) == EBUR128_MODE_S &&
+      st->d->max_loudness_segments_fill == st->d->max_loudness_segments_size) {
+    energy = sum / (double) st->d->max_loudness_segments_size;
+    if (energy > st->d->max_shortterm) {
+      st->d->max_shortterm = energy;
+    }
+  }
+
+  st->d->max_loudness_step_counter = st->d->max_loudness_step_frames;
 }
 
 int ebur128_set_channel(ebur128_state* st,
@@ -793,11 +2561,123 @@ int ebur128_set_channel(ebur128_state* st,
   return EBUR128_SUCCESS;
 }
 
+/* Allocate the segment peaks when a peak window or a block log with peaks
+ * is set, free them otherwise. */
+static int ebur128_update_peak_segments(ebur128_state* st) {
+  if (!st->d->sample_peak_window && !st->d->true_peak_window &&
+      !(st->d->block_log &&
+        (st->mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK)) {
+    free(st->d->segment_sample_peak);
+    st->d->segment_sample_peak = NULL;
+    free(st->d->segment_true_peak);
+    st->d->segment_true_peak = NULL;
+    return EBUR128_SUCCESS;
+  }
+  if (!st->d->segment_sample_peak) {
+    st->d->segment_sample_peak = (double*) calloc(st->channels, sizeof(double));
+    st->d->segment_true_peak = (double*) calloc(st->channels, sizeof(double));
+    if (!st->d->segment_sample_peak || !st->d->segment_true_peak) {
+      free(st->d->segment_sample_peak);
+      st->d->segment_sample_peak = NULL;
+      free(st->d->segment_true_peak);
+      st->d->segment_true_peak = NULL;
+      return EBUR128_ERROR_NOMEM;
+    }
+    /* segments end with the gating blocks */
+    st->d->peak_segment_counter =
+        st->d->needed_frames % st->d->samples_in_100ms;
+    if (!st->d->peak_segment_counter) {
+      st->d->peak_segment_counter = st->d->samples_in_100ms;
+    }
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Restart the short-term segments of the block log and align the peak
+ * segments with the gating blocks again, after the audio buffer has been
+ * restarted. */
+static void ebur128_restart_block_log(ebur128_state* st) {
+  size_t i;
+
+  if (st->d->block_log) {
+    for (i = 0; i < 30; ++i) {
+      st->d->block_log->segments[i] = 0.0;
+    }
+    st->d->block_log->segments_index = 0;
+    st->d->block_log->started = 0;
+  }
+  if (st->d->segment_sample_peak) {
+    st->d->peak_segment_counter = st->d->samples_in_100ms;
+  }
+}
+
+/* Restart the peak windows with their current lengths, for the current
+ * number of channels. Windows that cannot be allocated are removed. */
+static int ebur128_reset_peak_windows(ebur128_state* st) {
+  struct ebur128_peak_window** windows[2];
+  int errcode = EBUR128_SUCCESS;
+  int i;
+
+  windows[0] = &st->d->sample_peak_window;
+  windows[1] = &st->d->true_peak_window;
+  for (i = 0; i < 2; ++i) {
+    if (*windows[i]) {
+      unsigned long window = (*windows[i])->window;
+      ebur128_peak_window_destroy(*windows[i]);
+      *windows[i] = ebur128_peak_window_create(st->channels, window);
+      if (!*windows[i]) {
+        errcode = EBUR128_ERROR_NOMEM;
+      }
+    }
+  }
+  free(st->d->segment_sample_peak);
+  st->d->segment_sample_peak = NULL;
+  free(st->d->segment_true_peak);
+  st->d->segment_true_peak = NULL;
+  if (ebur128_update_peak_segments(st)) {
+    ebur128_peak_window_destroy(st->d->sample_peak_window);
+    st->d->sample_peak_window = NULL;
+    ebur128_peak_window_destroy(st->d->true_peak_window);
+    st->d->true_peak_window = NULL;
+    errcode = EBUR128_ERROR_NOMEM;
+  }
+  return errcode;
+}
+
+/* Reallocate the DSP buffers released by ebur128_hibernate(). The ring
+ * keeps its size, and all buffers start cleared. */
+static int ebur128_resume(ebur128_state* st) {
+  if (!st->d->hibernating) {
+    return EBUR128_SUCCESS;
+  }
+  if ((st->mode & EBUR128_MODE_FIXED_POINT) == EBUR128_MODE_FIXED_POINT) {
+    st->d->fixed_input = (int32_t*) malloc(TILE_SAMPLES * sizeof(int32_t));
+    if (!st->d->fixed_input) {
+      return EBUR128_ERROR_NOMEM;
+    }
+  }
+  if (ebur128_alloc_audio_data(st, st->d->audio_data_frames)) {
+    goto free_fixed_input;
+  }
+  if (ebur128_init_resampler(st)) {
+    goto free_audio_data;
+  }
+  st->d->hibernating = 0;
+  return EBUR128_SUCCESS;
+
+free_audio_data:
+  ebur128_free_audio_data(st);
+free_fixed_input:
+  free(st->d->fixed_input);
+  st->d->fixed_input = NULL;
+  return EBUR128_ERROR_NOMEM;
+}
+
 int ebur128_change_parameters(ebur128_state* st,
                               unsigned int channels,
                               unsigned long samplerate) {
   int errcode = EBUR128_SUCCESS;
-  size_t j;
+  size_t frames;
 
   /* This is needed to suppress a clang-tidy warning. */
 #ifndef __has_builtin
@@ -815,8 +2695,10 @@ int ebur128_change_parameters(ebur128_state* st,
     return EBUR128_ERROR_NO_CHANGE;
   }
 
-  free(st->d->audio_data);
-  st->d->audio_data = NULL;
+  /* the layout of the overview depends on the channels */
+  ebur128_set_overview(st, 0, NULL, 0);
+  /* the ring buffer is reused if it is large enough */
+  ebur128_clear_audio_data(st);
 
   if (channels != st->channels) {
     unsigned int i;
@@ -831,6 +2713,18 @@ int ebur128_change_parameters(ebur128_state* st,
     st->d->true_peak = NULL;
     free(st->d->prev_true_peak);
     st->d->prev_true_peak = NULL;
+    free(st->d->sample_peak_frame);
+    st->d->sample_peak_frame = NULL;
+    free(st->d->prev_sample_peak_frame);
+    st->d->prev_sample_peak_frame = NULL;
+    free(st->d->true_peak_frame);
+    st->d->true_peak_frame = NULL;
+    free(st->d->prev_true_peak_frame);
+    st->d->prev_true_peak_frame = NULL;
+    free(st->d->v);
+    st->d->v = NULL;
+    free(st->d->v_fixed);
+    st->d->v_fixed = NULL;
     st->channels = channels;
 
     errcode = ebur128_init_channel_map(st);
@@ -850,43 +2744,75 @@ int ebur128_change_parameters(ebur128_state* st,
       st->d->true_peak[i] = 0.0;
       st->d->prev_true_peak[i] = 0.0;
     }
+    st->d->sample_peak_frame =
+        (unsigned long long*) calloc(channels, sizeof(unsigned long long));
+    CHECK_ERROR(!st->d->sample_peak_frame, EBUR128_ERROR_NOMEM, exit)
+    st->d->prev_sample_peak_frame =
+        (unsigned long long*) calloc(channels, sizeof(unsigned long long));
+    CHECK_ERROR(!st->d->prev_sample_peak_frame, EBUR128_ERROR_NOMEM, exit)
+    st->d->true_peak_frame =
+        (unsigned long long*) calloc(channels, sizeof(unsigned long long));
+    CHECK_ERROR(!st->d->true_peak_frame, EBUR128_ERROR_NOMEM, exit)
+    st->d->prev_true_peak_frame =
+        (unsigned long long*) calloc(channels, sizeof(unsigned long long));
+    CHECK_ERROR(!st->d->prev_true_peak_frame, EBUR128_ERROR_NOMEM, exit)
   }
   if (samplerate != st->samplerate) {
     st->samplerate = samplerate;
     st->d->samples_in_100ms = (st->samplerate + 5) / 10;
   }
 
-  /* If we're here, either samplerate or channels
-   * have changed. Re-init filter. */
-  free(st->d->v);
-  st->d->v = NULL;
-  errcode = ebur128_init_filter(st);
-  CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+  /* If we're here, either samplerate or channels have changed. Re-init
+   * filter, keeping the filter state if the channels are unchanged. */
+  if (st->d->v) {
+    ebur128_calc_filter(st);
+    ebur128_clear_filter(st);
+  } else {
+    errcode = ebur128_init_filter(st);
+    CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+  }
 
-  st->d->audio_data_frames = st->samplerate * st->d->window / 1000;
-  if (st->d->audio_data_frames % st->d->samples_in_100ms) {
+  frames = st->samplerate * st->d->window / 1000;
+  if (frames % st->d->samples_in_100ms) {
     /* round up to multiple of samples_in_100ms */
-    st->d->audio_data_frames =
-        (st->d->audio_data_frames + st->d->samples_in_100ms) -
-        (st->d->audio_data_frames % st->d->samples_in_100ms);
+    frames = (frames + st->d->samples_in_100ms) -
+             (frames % st->d->samples_in_100ms);
   }
-  st->d->audio_data = (double*) malloc(st->d->audio_data_frames * st->channels *
-                                       sizeof(double));
-  CHECK_ERROR(!st->d->audio_data, EBUR128_ERROR_NOMEM, exit)
-  for (j = 0; j < st->d->audio_data_frames * st->channels; ++j) {
-    st->d->audio_data[j] = 0.0;
+  if (st->d->hibernating) {
+    /* the buffers are allocated with the next frames */
+    st->d->audio_data_frames = frames;
+  } else {
+    errcode = ebur128_alloc_audio_data(st, frames);
+    CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+
+    errcode = ebur128_reinit_resampler(st);
+    CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
   }
 
-  ebur128_destroy_resampler(st);
-  errcode = ebur128_init_resampler(st);
-  CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+  if (st->d->max_loudness_step) {
+    size_t segments;
+    if (ebur128_calc_max_loudness_step(st, st->d->max_loudness_step,
+                                       &st->d->max_loudness_step_frames,
+                                       &segments)) {
+      /* fall back to 100ms steps, which always fit */
+      ebur128_calc_max_loudness_step(st, 100, &st->d->max_loudness_step_frames,
+                                     &segments);
+      st->d->max_loudness_step = 100;
+      st->d->max_loudness_segments_size = segments;
+    }
+  }
 
   /* the first block needs 400ms of audio data */
   st->d->needed_frames = st->d->samples_in_100ms * 4;
   /* start at the beginning of the buffer */
   st->d->audio_data_index = 0;
+  st->d->audio_data_fill = 0;
   /* reset short term frame counter */
   st->d->short_term_frame_counter = 0;
+  ebur128_reset_max_loudness(st);
+
+  errcode = ebur128_reset_peak_windows(st);
+  ebur128_restart_block_log(st);
 
 exit:
   return errcode;
@@ -894,7 +2820,6 @@ exit:
 
 int ebur128_set_max_window(ebur128_state* st, unsigned long window) {
   int errcode = EBUR128_SUCCESS;
-  size_t j;
 
   if ((st->mode & EBUR128_MODE_S) == EBUR128_MODE_S && window < 3000) {
     window = 3000;
@@ -923,28 +2848,102 @@ int ebur128_set_max_window(ebur128_state* st, unsigned long window) {
     return EBUR128_ERROR_NOMEM;
   }
 
-  double* new_audio_data = (double*) malloc(new_audio_data_size);
-  CHECK_ERROR(!new_audio_data, EBUR128_ERROR_NOMEM, exit)
+  if (st->d->hibernating) {
+    /* the buffers are allocated with the next frames */
+    st->d->audio_data_frames = new_audio_data_frames;
+  } else {
+    errcode = ebur128_alloc_audio_data(st, new_audio_data_frames);
+    CHECK_ERROR(errcode, EBUR128_ERROR_NOMEM, exit)
+  }
 
   st->d->window = window;
-  free(st->d->audio_data);
-  st->d->audio_data = new_audio_data;
-  st->d->audio_data_frames = new_audio_data_frames;
-  for (j = 0; j < st->d->audio_data_frames * st->channels; ++j) {
-    st->d->audio_data[j] = 0.0;
-  }
 
   /* the first block needs 400ms of audio data */
   st->d->needed_frames = st->d->samples_in_100ms * 4;
   /* start at the beginning of the buffer */
   st->d->audio_data_index = 0;
+  st->d->audio_data_fill = 0;
   /* reset short term frame counter */
   st->d->short_term_frame_counter = 0;
+  ebur128_reset_max_loudness(st);
+  ebur128_restart_block_log(st);
 
 exit:
   return errcode;
 }
 
+int ebur128_hibernate(ebur128_state* st) {
+  if (st->d->hibernating) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+  ebur128_free_audio_data(st);
+  free(st->d->fixed_input);
+  st->d->fixed_input = NULL;
+  ebur128_destroy_resampler(st);
+  ebur128_clear_filter(st);
+
+  /* the first block needs 400ms of audio data */
+  st->d->needed_frames = st->d->samples_in_100ms * 4;
+  /* start at the beginning of the buffer */
+  st->d->audio_data_index = 0;
+  st->d->audio_data_fill = 0;
+  /* reset short term frame counter */
+  st->d->short_term_frame_counter = 0;
+  ebur128_reset_max_loudness(st);
+  ebur128_restart_block_log(st);
+  st->d->hibernating = 1;
+  return EBUR128_SUCCESS;
+}
+
+/* Drop the oldest sketch epochs that are no longer needed for the history. */
+static void ebur128_drop_sketch_epochs(ebur128_state* st) {
+  unsigned long epochs =
+      st->d->st_block_list_max / st->d->st_sketch_epoch_blocks +
+      (st->d->st_block_list_max % st->d->st_sketch_epoch_blocks != 0);
+
+  while (st->d->st_sketch_epochs > EBUR128_MAX(epochs, 1)) {
+    ebur128_sketch_destroy(st->d->st_sketch[0]);
+    memmove(st->d->st_sketch, st->d->st_sketch + 1,
+            (st->d->st_sketch_epochs - 1) * sizeof(struct ebur128_sketch*));
+    --st->d->st_sketch_epochs;
+  }
+}
+
+static int ebur128_sketch_add_block(ebur128_state* st, double energy) {
+  struct ebur128_sketch* current =
+      st->d->st_sketch[st->d->st_sketch_epochs - 1];
+
+  if (current->n >= st->d->st_sketch_epoch_blocks) {
+    current = ebur128_sketch_create(st->d->st_sketch_k);
+    if (!current) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    st->d->st_sketch[st->d->st_sketch_epochs++] = current;
+    ebur128_drop_sketch_epochs(st);
+  }
+  return ebur128_sketch_add(current, energy);
+}
+
+int ebur128_set_lra_sketch_epsilon(ebur128_state* st, double epsilon) {
+  size_t k, i;
+
+  if (!st->d->st_sketch_epochs || !(epsilon > 0.0 && epsilon < 1.0)) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  k = (size_t) ceil(2.0 / epsilon);
+  if (k == st->d->st_sketch_k) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+  st->d->st_sketch_k = k;
+  for (i = 0; i < st->d->st_sketch_epochs; ++i) {
+    st->d->st_sketch[i]->k = k;
+    if (ebur128_sketch_compress(st->d->st_sketch[i])) {
+      return EBUR128_ERROR_NOMEM;
+    }
+  }
+  return EBUR128_SUCCESS;
+}
+
 int ebur128_set_max_history(ebur128_state* st, unsigned long history) {
   if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA && history < 3000) {
     history = 3000;
@@ -954,6 +2953,18 @@ int ebur128_set_max_history(ebur128_state* st, unsigned long history) {
   if (history == st->d->history) {
     return EBUR128_ERROR_NO_CHANGE;
   }
+  ++st->d->history_changes;
+  if (st->d->block_file) {
+    st->d->block_file->first_valid =
+        ebur128_block_file_first(st->d->block_file, st->d->block_list_size,
+                                 st->d->block_list_max);
+  }
+  if (st->d->st_block_file) {
+    st->d->st_block_file->first_valid =
+        ebur128_block_file_first(st->d->st_block_file,
+                                 st->d->st_block_list_size,
+                                 st->d->st_block_list_max);
+  }
   st->d->history = history;
   st->d->block_list_max = st->d->history / 100;
   st->d->st_block_list_max = st->d->history / 3000;
@@ -970,506 +2981,3396 @@ int ebur128_set_max_history(ebur128_state* st, unsigned long history) {
     free(block);
     st->d->st_block_list_size--;
   }
+  st->d->st_sketch_epoch_blocks =
+      ebur128_sketch_epoch_blocks(st->d->st_block_list_max);
+  ebur128_drop_sketch_epochs(st);
   return EBUR128_SUCCESS;
 }
 
-static int ebur128_energy_shortterm(ebur128_state* st, double* out);
-#define EBUR128_ADD_FRAMES(type)                                               \
-  int ebur128_add_frames_##type(ebur128_state* st, const type* src,            \
-                                size_t frames) {                               \
-    size_t src_index = 0;                                                      \
-    unsigned int c = 0;                                                        \
-    for (c = 0; c < st->channels; c++) {                                       \
-      st->d->prev_sample_peak[c] = 0.0;                                        \
-      st->d->prev_true_peak[c] = 0.0;                                          \
-    }                                                                          \
-    while (frames > 0) {                                                       \
-      if (frames >= st->d->needed_frames) {                                    \
-        ebur128_filter_##type(st, src + src_index, st->d->needed_frames);      \
-        src_index += st->d->needed_frames * st->channels;                      \
-        frames -= st->d->needed_frames;                                        \
-        st->d->audio_data_index += st->d->needed_frames * st->channels;        \
-        /* calculate the new gating block */                                   \
-        if ((st->mode & EBUR128_MODE_I) == EBUR128_MODE_I) {                   \
-          if (ebur128_calc_gating_block(st, st->d->samples_in_100ms * 4,       \
-                                        NULL)) {                               \
-            return EBUR128_ERROR_NOMEM;                                        \
-          }                                                                    \
-        }                                                                      \
-        if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {               \
-          st->d->short_term_frame_counter += st->d->needed_frames;             \
-          if (st->d->short_term_frame_counter ==                               \
-              st->d->samples_in_100ms * 30) {                                  \
-            struct ebur128_dq_entry* block;                                    \
-            double st_energy;                                                  \
-            if (ebur128_energy_shortterm(st, &st_energy) == EBUR128_SUCCESS && \
-                st_energy >= histogram_energy_boundaries[0]) {                 \
-              if (st->d->use_histogram) {                                      \
-                ++st->d->short_term_block_energy_histogram                     \
-                      [find_histogram_index(st_energy)];                       \
-              } else {                                                         \
-                if (st->d->st_block_list_size == st->d->st_block_list_max) {   \
-                  block = STAILQ_FIRST(&st->d->short_term_block_list);         \
-                  STAILQ_REMOVE_HEAD(&st->d->short_term_block_list, entries);  \
-                } else {                                                       \
-                  block = (struct ebur128_dq_entry*) malloc(                   \
-                      sizeof(struct ebur128_dq_entry));                        \
-                  if (!block) {                                                \
-                    return EBUR128_ERROR_NOMEM;                                \
-                  }                                                            \
-                  st->d->st_block_list_size++;                                 \
-                }                                                              \
-                block->z = st_energy;                                          \
-                STAILQ_INSERT_TAIL(&st->d->short_term_block_list, block,       \
-                                   entries);                                   \
-              }                                                                \
-            }                                                                  \
-            st->d->short_term_frame_counter = st->d->samples_in_100ms * 20;    \
-          }                                                                    \
-        }                                                                      \
-        /* 100ms are needed for all blocks besides the first one */            \
-        st->d->needed_frames = st->d->samples_in_100ms;                        \
-        /* reset audio_data_index when buffer full */                          \
-        if (st->d->audio_data_index ==                                         \
-            st->d->audio_data_frames * st->channels) {                         \
-          st->d->audio_data_index = 0;                                         \
-        }                                                                      \
-      } else {                                                                 \
-        ebur128_filter_##type(st, src + src_index, frames);                    \
-        st->d->audio_data_index += frames * st->channels;                      \
-        if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {               \
-          st->d->short_term_frame_counter += frames;                           \
-        }                                                                      \
-        st->d->needed_frames -= (unsigned long) frames;                        \
-        frames = 0;                                                            \
-      }                                                                        \
-    }                                                                          \
-    for (c = 0; c < st->channels; c++) {                                       \
-      if (st->d->prev_sample_peak[c] > st->d->sample_peak[c]) {                \
-        st->d->sample_peak[c] = st->d->prev_sample_peak[c];                    \
-      }                                                                        \
-      if (st->d->prev_true_peak[c] > st->d->true_peak[c]) {                    \
-        st->d->true_peak[c] = st->d->prev_true_peak[c];                        \
-      }                                                                        \
-    }                                                                          \
-    return EBUR128_SUCCESS;                                                    \
+static int ebur128_move_blocks_to_file(struct ebur128_double_queue* list,
+                                       unsigned long* list_size,
+                                       struct ebur128_block_file* file) {
+  while (*list_size > BLOCK_FILE_HOT_BLOCKS) {
+    struct ebur128_dq_entry* block = STAILQ_FIRST(list);
+    STAILQ_REMOVE_HEAD(list, entries);
+    --*list_size;
+    if (ebur128_block_file_append(file, block->z)) {
+      free(block);
+      return EBUR128_ERROR_IO;
+    }
+    free(block);
   }
+  return EBUR128_SUCCESS;
+}
 
-EBUR128_ADD_FRAMES(short)
-EBUR128_ADD_FRAMES(int)
-EBUR128_ADD_FRAMES(float)
-EBUR128_ADD_FRAMES(double)
+int ebur128_set_block_files(ebur128_state* st,
+                            const char* block_file,
+                            const char* short_term_block_file) {
+  struct ebur128_block_file* new_block_file = NULL;
+  struct ebur128_block_file* new_st_block_file = NULL;
+  int errcode = EBUR128_SUCCESS;
 
-static int ebur128_calc_relative_threshold(ebur128_state* st,
-                                           size_t* above_thresh_counter,
-                                           double* relative_threshold) {
-  struct ebur128_dq_entry* it;
-  size_t i;
+  if (st->d->use_histogram || st->d->block_file || st->d->st_block_file ||
+      (short_term_block_file && st->d->st_sketch_epochs)) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  if (!block_file && !short_term_block_file) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
 
-  if (st->d->use_histogram) {
-    for (i = 0; i < 1000; ++i) {
-      *relative_threshold +=
-          st->d->block_energy_histogram[i] * histogram_energies[i];
-      *above_thresh_counter += st->d->block_energy_histogram[i];
-    }
-  } else {
-    STAILQ_FOREACH(it, &st->d->block_list, entries) {
-      ++*above_thresh_counter;
-      *relative_threshold += it->z;
-    }
+  if (block_file) {
+    new_block_file = ebur128_block_file_open(block_file);
+    CHECK_ERROR(!new_block_file, EBUR128_ERROR_IO, exit)
+  }
+  if (short_term_block_file) {
+    new_st_block_file = ebur128_block_file_open(short_term_block_file);
+    CHECK_ERROR(!new_st_block_file, EBUR128_ERROR_IO, close_block_file)
   }
 
-  return EBUR128_SUCCESS;
+  st->d->block_file = new_block_file;
+  st->d->st_block_file = new_st_block_file;
+  ++st->d->history_changes;
+  if (new_block_file) {
+    errcode = ebur128_move_blocks_to_file(&st->d->block_list,
+                                          &st->d->block_list_size,
+                                          new_block_file);
+  }
+  if (!errcode && new_st_block_file) {
+    errcode = ebur128_move_blocks_to_file(&st->d->short_term_block_list,
+                                          &st->d->st_block_list_size,
+                                          new_st_block_file);
+  }
+  return errcode;
+
+close_block_file:
+  ebur128_block_file_close(new_block_file);
+exit:
+  return errcode;
 }
 
-static int
-ebur128_gated_loudness(ebur128_state** sts, size_t size, double* out) {
-  struct ebur128_dq_entry* it;
-  double gated_loudness = 0.0;
-  double relative_threshold = 0.0;
-  size_t above_thresh_counter = 0;
-  size_t i, j, start_index;
+/* Push the energies of the "segments" 100ms segments before the last
+ * "offset" frames into the segment ring of the block log, oldest first. They
+ * are the differences of the energies of growing intervals. */
+static void
+ebur128_block_log_segments(ebur128_state* st, size_t offset, size_t segments) {
+  struct ebur128_block_log_writer* log = st->d->block_log;
+  size_t frames = st->d->samples_in_100ms;
+  double total, previous = 0.0;
+  size_t i;
 
-  for (i = 0; i < size; i++) {
-    if (sts[i] && (sts[i]->mode & EBUR128_MODE_I) != EBUR128_MODE_I) {
-      return EBUR128_ERROR_INVALID_MODE;
-    }
+  if (offset) {
+    ebur128_calc_gating_block(st, offset, &previous);
+    previous *= (double) offset;
+  }
+  for (i = 1; i <= segments; ++i) {
+    ebur128_calc_gating_block(st, offset + i * frames, &total);
+    total *= (double) (offset + i * frames);
+    log->segments[(log->segments_index + segments - i) % 30] =
+        EBUR128_MAX((total - previous) / (double) frames, 0.0);
+    previous = total;
   }
+  log->segments_index = (log->segments_index + segments) % 30;
+}
 
-  for (i = 0; i < size; i++) {
-    if (!sts[i]) {
-      continue;
+/* Record a completed gating block of energy "momentary". */
+static int ebur128_block_log_add(ebur128_state* st, double momentary) {
+  struct ebur128_block_log_writer* log = st->d->block_log;
+  double levels[BLOCK_LOG_FIELDS] = { 0.0 };
+  double sum = 0.0;
+  size_t i;
+
+  levels[BLOCK_LOG_MOMENTARY] = ebur128_energy_to_loudness(momentary);
+  if (log->fields & (1U << BLOCK_LOG_SHORTTERM)) {
+    /* the first block completes 4 segments */
+    ebur128_block_log_segments(st, 0, log->started ? 1 : 4);
+    for (i = 0; i < 30; ++i) {
+      sum += log->segments[i];
     }
-    ebur128_calc_relative_threshold(sts[i], &above_thresh_counter,
-                                    &relative_threshold);
-  }
-  if (!above_thresh_counter) {
-    *out = -HUGE_VAL;
-    return EBUR128_SUCCESS;
+    levels[BLOCK_LOG_SHORTTERM] = ebur128_energy_to_loudness(sum / 30.0);
   }
+  levels[BLOCK_LOG_SAMPLE_PEAK] = 20.0 * log10(log->sample_peak);
+  levels[BLOCK_LOG_TRUE_PEAK] = 20.0 * log10(log->true_peak);
+  log->sample_peak = 0.0;
+  log->true_peak = 0.0;
+  log->started = 1;
+  return ebur128_block_log_write(log, levels);
+}
 
-  relative_threshold /= (double) above_thresh_counter;
-  relative_threshold *= relative_gate_factor;
+int ebur128_set_block_log(ebur128_state* st, const char* path) {
+  struct ebur128_block_log_writer* log = NULL;
+  struct ebur128_block_log_writer* old_log = st->d->block_log;
+  unsigned char header[BLOCK_LOG_HEADER_SIZE];
+  size_t offset, segments;
+  int errcode = EBUR128_SUCCESS;
 
-  above_thresh_counter = 0;
-  if (relative_threshold < histogram_energy_boundaries[0]) {
-    start_index = 0;
-  } else {
-    start_index = find_histogram_index(relative_threshold);
-    if (relative_threshold > histogram_energies[start_index]) {
-      ++start_index;
-    }
+  if (!path && !old_log) {
+    return EBUR128_ERROR_NO_CHANGE;
   }
-  for (i = 0; i < size; i++) {
-    if (!sts[i]) {
-      continue;
+
+  if (path) {
+    log = (struct ebur128_block_log_writer*) calloc(1, sizeof(*log));
+    CHECK_ERROR(!log, EBUR128_ERROR_NOMEM, exit)
+    log->file = fopen(path, "wb");
+    CHECK_ERROR(!log->file, EBUR128_ERROR_IO, free_log)
+    log->fields = 1U << BLOCK_LOG_MOMENTARY;
+    if ((st->mode & EBUR128_MODE_S) == EBUR128_MODE_S) {
+      log->fields |= 1U << BLOCK_LOG_SHORTTERM;
     }
-    if (sts[i]->d->use_histogram) {
-      for (j = start_index; j < 1000; ++j) {
-        gated_loudness +=
-            sts[i]->d->block_energy_histogram[j] * histogram_energies[j];
-        above_thresh_counter += sts[i]->d->block_energy_histogram[j];
-      }
-    } else {
-      STAILQ_FOREACH(it, &sts[i]->d->block_list, entries) {
-        if (it->z >= relative_threshold) {
-          ++above_thresh_counter;
-          gated_loudness += it->z;
-        }
-      }
+    if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK) {
+      log->fields |= 1U << BLOCK_LOG_SAMPLE_PEAK;
+    }
+    if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
+      log->fields |= 1U << BLOCK_LOG_TRUE_PEAK;
     }
+    memcpy(header, BLOCK_LOG_MAGIC, 4);
+    header[4] = BLOCK_LOG_VERSION;
+    header[5] = (unsigned char) log->fields;
+    CHECK_ERROR(fwrite(header, 1, BLOCK_LOG_HEADER_SIZE, log->file) !=
+                    BLOCK_LOG_HEADER_SIZE,
+                EBUR128_ERROR_IO, free_log)
   }
-  if (!above_thresh_counter) {
-    *out = -HUGE_VAL;
-    return EBUR128_SUCCESS;
+
+  st->d->block_log = log;
+  if (ebur128_update_peak_segments(st)) {
+    st->d->block_log = old_log;
+    errcode = EBUR128_ERROR_NOMEM;
+    goto free_log;
+  }
+  ebur128_block_log_writer_close(old_log);
+
+  /* Once the first gating block is complete, the short-term loudness of the
+   * first records includes the audio before the log. */
+  if (log && (st->mode & EBUR128_MODE_S) == EBUR128_MODE_S &&
+      st->d->audio_data_fill >= st->d->samples_in_100ms * 4) {
+    offset = st->d->samples_in_100ms - st->d->needed_frames;
+    segments = (st->d->audio_data_frames - offset) / st->d->samples_in_100ms;
+    ebur128_block_log_segments(st, offset, EBUR128_MIN(segments, 30));
+    log->started = 1;
   }
-  gated_loudness /= (double) above_thresh_counter;
-  *out = ebur128_energy_to_loudness(gated_loudness);
   return EBUR128_SUCCESS;
+
+free_log:
+  ebur128_block_log_writer_close(log);
+exit:
+  return errcode;
 }
 
-int ebur128_relative_threshold(ebur128_state* st, double* out) {
-  double relative_threshold = 0.0;
-  size_t above_thresh_counter = 0;
+int ebur128_set_threads(ebur128_state* st, unsigned int threads) {
+  struct ebur128_pool* pool = NULL;
 
-  if ((st->mode & EBUR128_MODE_I) != EBUR128_MODE_I) {
-    return EBUR128_ERROR_INVALID_MODE;
+  if (threads == 0) {
+    threads = 1;
+  }
+  if (threads == (st->d->pool ? st->d->pool->threads + 1 : 1)) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+  if (threads > 1) {
+    pool = ebur128_pool_create(threads - 1);
+    if (!pool) {
+      return EBUR128_ERROR_NOMEM;
+    }
   }
+  ebur128_pool_destroy(st->d->pool);
+  st->d->pool = pool;
+  return EBUR128_SUCCESS;
+}
 
-  ebur128_calc_relative_threshold(st, &above_thresh_counter,
-                                  &relative_threshold);
+int ebur128_set_max_loudness_step(ebur128_state* st, unsigned long step) {
+  unsigned long step_frames;
+  size_t segments;
+  double* new_segments;
 
-  if (!above_thresh_counter) {
-    *out = -70.0;
+  if (step == st->d->max_loudness_step) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+  if (step == 0) {
+    free(st->d->max_loudness_segments);
+    st->d->max_loudness_segments = NULL;
+    st->d->max_loudness_step = 0;
     return EBUR128_SUCCESS;
   }
+  if (ebur128_calc_max_loudness_step(st, step, &step_frames, &segments)) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
 
-  relative_threshold /= (double) above_thresh_counter;
-  relative_threshold *= relative_gate_factor;
-
-  *out = ebur128_energy_to_loudness(relative_threshold);
+  new_segments = (double*) malloc(segments * sizeof(double));
+  if (!new_segments) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  free(st->d->max_loudness_segments);
+  st->d->max_loudness_segments = new_segments;
+  st->d->max_loudness_segments_size = segments;
+  st->d->max_loudness_step = step;
+  st->d->max_loudness_step_frames = step_frames;
+  ebur128_reset_max_loudness(st);
   return EBUR128_SUCCESS;
 }
 
-int ebur128_loudness_global(ebur128_state* st, double* out) {
-  return ebur128_gated_loudness(&st, 1, out);
-}
+static int ebur128_set_peak_window(ebur128_state* st,
+                                   struct ebur128_peak_window** w,
+                                   unsigned long window) {
+  struct ebur128_peak_window* old_window = *w;
+  struct ebur128_peak_window* new_window = NULL;
+  int errcode;
 
-int ebur128_loudness_global_multiple(ebur128_state** sts,
-                                     size_t size,
-                                     double* out) {
-  return ebur128_gated_loudness(sts, size, out);
+  if (window == (old_window ? old_window->window : 0)) {
+    return EBUR128_ERROR_NO_CHANGE;
+  }
+  if (window) {
+    new_window = ebur128_peak_window_create(st->channels, window);
+    if (!new_window) {
+      return EBUR128_ERROR_NOMEM;
+    }
+  }
+  *w = new_window;
+  errcode = ebur128_update_peak_segments(st);
+  if (errcode) {
+    *w = old_window;
+    ebur128_peak_window_destroy(new_window);
+    return errcode;
+  }
+  ebur128_peak_window_destroy(old_window);
+  return EBUR128_SUCCESS;
 }
 
-static int ebur128_energy_in_interval(ebur128_state* st,
-                                      size_t interval_frames,
-                                      double* out) {
-  if (interval_frames > st->d->audio_data_frames) {
+int ebur128_set_sample_peak_window(ebur128_state* st, unsigned long window) {
+  if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) != EBUR128_MODE_SAMPLE_PEAK) {
     return EBUR128_ERROR_INVALID_MODE;
   }
-  ebur128_calc_gating_block(st, interval_frames, out);
+  return ebur128_set_peak_window(st, &st->d->sample_peak_window, window);
+}
+
+int ebur128_set_true_peak_window(ebur128_state* st, unsigned long window) {
+  if ((st->mode & EBUR128_MODE_TRUE_PEAK) != EBUR128_MODE_TRUE_PEAK) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  return ebur128_set_peak_window(st, &st->d->true_peak_window, window);
+}
+
+int ebur128_set_overview(ebur128_state* st,
+                         unsigned long frames_per_bucket,
+                         float* buffer,
+                         size_t buckets) {
+  double* overview_min = NULL;
+  double* overview_max = NULL;
+  double* overview_sum = NULL;
+  unsigned int c;
+
+  if (frames_per_bucket > 0 && buffer && buckets > 0) {
+    overview_min = (double*) malloc(st->channels * sizeof(double));
+    overview_max = (double*) malloc(st->channels * sizeof(double));
+    overview_sum = (double*) malloc(st->channels * sizeof(double));
+    if (!overview_min || !overview_max || !overview_sum) {
+      free(overview_min);
+      free(overview_max);
+      free(overview_sum);
+      return EBUR128_ERROR_NOMEM;
+    }
+  } else {
+    buffer = NULL;
+    buckets = 0;
+    frames_per_bucket = 0;
+  }
+  free(st->d->overview_min);
+  free(st->d->overview_max);
+  free(st->d->overview_sum);
+  st->d->overview_min = overview_min;
+  st->d->overview_max = overview_max;
+  st->d->overview_sum = overview_sum;
+  st->d->overview = buffer;
+  st->d->overview_buckets = buckets;
+  st->d->overview_frames_per_bucket = frames_per_bucket;
+  st->d->overview_start = st->d->frames_total;
+  if (buffer) {
+    for (c = 0; c < st->channels; ++c) {
+      ebur128_overview_reset(st, c);
+    }
+  }
   return EBUR128_SUCCESS;
 }
 
-static int ebur128_energy_shortterm(ebur128_state* st, double* out) {
-  return ebur128_energy_in_interval(st, st->d->samples_in_100ms * 30, out);
+int ebur128_overview_buckets(ebur128_state* st, size_t* out) {
+  unsigned long long frames;
+  unsigned long partial;
+  unsigned int c;
+
+  if (!st->d->overview) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  frames = st->d->frames_total - st->d->overview_start;
+  partial = (unsigned long) (frames % st->d->overview_frames_per_bucket);
+  if (partial > 0) {
+    for (c = 0; c < st->channels; ++c) {
+      ebur128_overview_write(st, c, st->d->frames_total, partial);
+    }
+  }
+  frames = (frames + st->d->overview_frames_per_bucket - 1) /
+           st->d->overview_frames_per_bucket;
+  *out = (size_t) EBUR128_MIN(frames, st->d->overview_buckets);
+  return EBUR128_SUCCESS;
 }
 
-int ebur128_loudness_momentary(ebur128_state* st, double* out) {
-  double energy;
-  int error;
+/* Move the peaks of the completed 100ms segment into the peak windows. */
+static void ebur128_push_peak_segment(ebur128_state* st) {
+  unsigned int c;
 
-  error = ebur128_energy_in_interval(st, st->d->samples_in_100ms * 4, &energy);
-  if (error) {
-    return error;
+  for (c = 0; c < st->channels; ++c) {
+    double sample_peak = st->d->segment_sample_peak[c];
+    double true_peak = st->d->segment_true_peak[c];
+    if (st->d->sample_peak_window) {
+      ebur128_peak_window_push(st->d->sample_peak_window, c,
+                               st->d->peak_segment_index, sample_peak);
+    }
+    if (st->d->true_peak_window) {
+      ebur128_peak_window_push(st->d->true_peak_window, c,
+                               st->d->peak_segment_index,
+                               EBUR128_MAX(true_peak, sample_peak));
+    }
+    if (st->d->block_log) {
+      struct ebur128_block_log_writer* log = st->d->block_log;
+      log->sample_peak = EBUR128_MAX(log->sample_peak, sample_peak);
+      log->true_peak = EBUR128_MAX(log->true_peak, true_peak);
+      log->true_peak = EBUR128_MAX(log->true_peak, sample_peak);
+    }
+    st->d->segment_sample_peak[c] = 0.0;
+    st->d->segment_true_peak[c] = 0.0;
   }
+  ++st->d->peak_segment_index;
+  st->d->peak_segment_counter = st->d->samples_in_100ms;
+}
 
-  if (energy <= 0.0) {
+static int ebur128_energy_shortterm(ebur128_state* st, double* out);
+
+/* Account for "frames" frames that have just been filtered into audio_data,
+ * and calculate all blocks that have been completed by them. */
+static int ebur128_advance(ebur128_state* st, size_t frames) {
+  int errcode;
+
+  ebur128_mirror_audio_data(st, frames);
+  if (st->d->filtered_callback) {
+    st->d->filtered_callback(st->d->filtered_callback_data,
+                             st->d->audio_data + st->d->audio_data_index,
+                             frames, st->channels);
+  }
+  st->d->audio_data_index += frames * st->channels;
+  if (st->d->audio_data_index == st->d->audio_data_frames * st->channels) {
+    st->d->audio_data_index = 0;
+  }
+  st->d->frames_total += frames;
+  st->d->audio_data_fill += frames;
+  if (st->d->audio_data_fill > st->d->audio_data_frames) {
+    st->d->audio_data_fill = st->d->audio_data_frames;
+  }
+  /* the block log takes the peaks of segments ending with this block */
+  if (st->d->segment_sample_peak) {
+    st->d->peak_segment_counter -= (unsigned long) frames;
+    if (st->d->peak_segment_counter == 0) {
+      ebur128_push_peak_segment(st);
+    }
+  }
+  if (frames == st->d->needed_frames) {
+    /* calculate the new gating block */
+    if ((st->mode & EBUR128_MODE_I) == EBUR128_MODE_I || st->d->block_log) {
+      double energy;
+      ebur128_calc_gating_block(st, st->d->samples_in_100ms * 4, &energy);
+      if ((st->mode & EBUR128_MODE_I) == EBUR128_MODE_I) {
+        errcode = ebur128_add_gating_block(st, energy);
+        if (errcode) {
+          return errcode;
+        }
+      }
+      if (st->d->block_log) {
+        errcode = ebur128_block_log_add(st, energy);
+        if (errcode) {
+          return errcode;
+        }
+      }
+    }
+    if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {
+      st->d->short_term_frame_counter += st->d->needed_frames;
+      if (st->d->short_term_frame_counter == st->d->samples_in_100ms * 30) {
+        double st_energy = 0.0;
+        if (ebur128_energy_shortterm(st, &st_energy) == EBUR128_SUCCESS &&
+            st_energy >= histogram_energy_boundaries[0]) {
+          ++st->d->st_blocks_added;
+          if (st->d->st_sketch_epochs) {
+            errcode = ebur128_sketch_add_block(st, st_energy);
+            if (errcode) {
+              return errcode;
+            }
+          } else if (st->d->use_histogram) {
+            if (ebur128_alloc_histogram(
+                    &st->d->short_term_block_energy_histogram, NULL, 1000, 0)) {
+              return EBUR128_ERROR_NOMEM;
+            }
+            ++st->d->short_term_block_energy_histogram[find_histogram_index(
+                st_energy)];
+          } else {
+            errcode = ebur128_push_block(
+                &st->d->short_term_block_list, &st->d->st_block_list_size,
+                st->d->st_block_list_max, st->d->st_block_file,
+                &st->d->history_changes, st_energy);
+            if (errcode) {
+              return errcode;
+            }
+          }
+        } else if (st_energy < histogram_energy_boundaries[0]) {
+          errcode = ebur128_add_sub_gate_block(&st->d->st_sub_gate_histogram,
+                                               NULL, st_energy);
+          if (errcode) {
+            return errcode;
+          }
+        }
+        st->d->short_term_frame_counter = st->d->samples_in_100ms * 20;
+      }
+    }
+    /* 100ms are needed for all blocks besides the first one */
+    st->d->needed_frames = st->d->samples_in_100ms;
+  } else {
+    if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {
+      st->d->short_term_frame_counter += frames;
+    }
+    st->d->needed_frames -= (unsigned long) frames;
+  }
+  if (st->d->max_loudness_step) {
+    st->d->max_loudness_step_counter -= (unsigned long) frames;
+    if (st->d->max_loudness_step_counter == 0) {
+      ebur128_update_max_loudness(st);
+    }
+  }
+  return EBUR128_SUCCESS;
+}
+
+#define EBUR128_ADD_FRAMES(type)                                               \
+  int ebur128_add_frames_##type(ebur128_state* st, const type* src,            \
+                                size_t frames) {                               \
+    size_t src_index = 0;                                                      \
+    size_t chunk;                                                              \
+    unsigned int c = 0;                                                        \
+    int errcode;                                                               \
+    ebur128_filter_fn filter = ebur128_filter_##type;                          \
+    if (ebur128_resume(st)) {                                                  \
+      return EBUR128_ERROR_NOMEM;                                              \
+    }                                                                          \
+    if (st->d->audio_data_fixed) {                                             \
+      filter = ebur128_filter_fixed_##type;                                    \
+    }                                                                          \
+    for (c = 0; c < st->channels; c++) {                                       \
+      st->d->prev_sample_peak[c] = 0.0;                                        \
+      st->d->prev_true_peak[c] = 0.0;                                          \
+    }                                                                          \
+    while (frames > 0) {                                                       \
+      chunk = st->d->needed_frames;                                            \
+      if (st->d->max_loudness_step &&                                          \
+          st->d->max_loudness_step_counter < chunk) {                          \
+        chunk = st->d->max_loudness_step_counter;                              \
+      }                                                                        \
+      if (st->d->segment_sample_peak &&                                        \
+          st->d->peak_segment_counter < chunk) {                               \
+        chunk = st->d->peak_segment_counter;                                   \
+      }                                                                        \
+      /* the ring is a whole number of pages, not of blocks */                 \
+      if (st->d->audio_data_frames -                                           \
+              st->d->audio_data_index / st->channels <                         \
+          chunk) {                                                             \
+        chunk = st->d->audio_data_frames -                                     \
+                st->d->audio_data_index / st->channels;                        \
+      }                                                                        \
+      if (frames < chunk) {                                                    \
+        chunk = frames;                                                        \
+      }                                                                        \
+      ebur128_run_filter(st, filter, src + src_index, chunk);                  \
+      src_index += chunk * ebur128_input_stride(st);                           \
+      frames -= chunk;                                                         \
+      errcode = ebur128_advance(st, chunk);                                    \
+      if (errcode) {                                                           \
+        return errcode;                                                        \
+      }                                                                        \
+    }                                                                          \
+    for (c = 0; c < st->channels; c++) {                                       \
+      if (st->d->prev_sample_peak[c] > st->d->sample_peak[c]) {                \
+        st->d->sample_peak[c] = st->d->prev_sample_peak[c];                    \
+        st->d->sample_peak_frame[c] = st->d->prev_sample_peak_frame[c];        \
+      }                                                                        \
+      if (st->d->prev_true_peak[c] > st->d->true_peak[c]) {                    \
+        st->d->true_peak[c] = st->d->prev_true_peak[c];                        \
+        st->d->true_peak_frame[c] = st->d->prev_true_peak_frame[c];            \
+      }                                                                        \
+    }                                                                          \
+    return EBUR128_SUCCESS;                                                    \
+  }
+
+EBUR128_ADD_FRAMES(short)
+EBUR128_ADD_FRAMES(int)
+EBUR128_ADD_FRAMES(float)
+EBUR128_ADD_FRAMES(double)
+
+struct ebur128_mux {
+  /** Channels of the interleaved input. */
+  unsigned int channels;
+  size_t programmes;
+  /** One state per programme, reading its channels from the input. */
+  ebur128_state** states;
+  unsigned int* first_channel;
+};
+
+ebur128_mux* ebur128_mux_create(unsigned int channels,
+                                unsigned long samplerate,
+                                int mode,
+                                const unsigned int* first_channels,
+                                const unsigned int* programme_channels,
+                                size_t programmes) {
+  ebur128_mux* mux;
+  size_t p;
+
+  if (programmes == 0) {
+    return NULL;
+  }
+  for (p = 0; p < programmes; ++p) {
+    if (first_channels[p] >= channels ||
+        programme_channels[p] > channels - first_channels[p]) {
+      return NULL;
+    }
+  }
+
+  mux = (ebur128_mux*) calloc(1, sizeof(ebur128_mux));
+  if (!mux) {
+    return NULL;
+  }
+  mux->channels = channels;
+  mux->programmes = programmes;
+  mux->states = (ebur128_state**) calloc(programmes, sizeof(ebur128_state*));
+  mux->first_channel =
+      (unsigned int*) malloc(programmes * sizeof(unsigned int));
+  if (!mux->states || !mux->first_channel) {
+    goto free_mux;
+  }
+  for (p = 0; p < programmes; ++p) {
+    mux->first_channel[p] = first_channels[p];
+    mux->states[p] = ebur128_init(programme_channels[p], samplerate, mode);
+    if (!mux->states[p]) {
+      goto free_mux;
+    }
+    mux->states[p]->d->input_stride = channels;
+  }
+  return mux;
+
+free_mux:
+  ebur128_mux_destroy(&mux);
+  return NULL;
+}
+
+void ebur128_mux_destroy(ebur128_mux** mux) {
+  size_t p;
+
+  if (!*mux) {
+    return;
+  }
+  if ((*mux)->states) {
+    for (p = 0; p < (*mux)->programmes; ++p) {
+      if ((*mux)->states[p]) {
+        ebur128_destroy(&(*mux)->states[p]);
+      }
+    }
+  }
+  free((*mux)->states);
+  free((*mux)->first_channel);
+  free(*mux);
+  *mux = NULL;
+}
+
+ebur128_state* ebur128_mux_state(ebur128_mux* mux, size_t programme) {
+  if (programme >= mux->programmes) {
+    return NULL;
+  }
+  return mux->states[programme];
+}
+
+/* Each programme filters its channels straight from the interleaved input,
+ * so every sample is read once and nothing is copied. */
+#define EBUR128_MUX_ADD_FRAMES(type)                                           \
+  int ebur128_mux_add_frames_##type(ebur128_mux* mux, const type* src,         \
+                                    size_t frames) {                           \
+    size_t p;                                                                  \
+    int errcode;                                                               \
+    for (p = 0; p < mux->programmes; ++p) {                                    \
+      errcode = ebur128_add_frames_##type(                                     \
+          mux->states[p], src + mux->first_channel[p], frames);                \
+      if (errcode) {                                                           \
+        return errcode;                                                        \
+      }                                                                        \
+    }                                                                          \
+    return EBUR128_SUCCESS;                                                    \
+  }
+
+EBUR128_MUX_ADD_FRAMES(short)
+EBUR128_MUX_ADD_FRAMES(int)
+EBUR128_MUX_ADD_FRAMES(float)
+EBUR128_MUX_ADD_FRAMES(double)
+
+struct ebur128_stems {
+  size_t stems;
+  /** One state per stem, reading its channels from the wide input. */
+  ebur128_state** states;
+  /** Filtered frames of each stem, scratch for the sums. */
+  const double** filtered;
+  /** Samples of one frame of each stem and the sums of their products,
+   *  scratch for the sums. */
+  double* samples;
+  double* sums;
+  /** Number of products of pairs of stems i <= j. */
+  size_t pairs;
+  /** One row of "pairs" sums per 100ms segment. Each sum is over the frames
+   *  of the segment and the channels, with the channel weights, of the
+   *  products of the filtered samples of a pair of stems. The row after the
+   *  complete segments is the segment being filled. */
+  double* segments;
+  /** Number of complete segments. */
+  size_t segments_size;
+  /** Number of rows allocated in segments and mixed. */
+  size_t segments_max;
+  /** Frames in the segment being filled. */
+  unsigned long segment_frames;
+  /** Energy of each segment for the gains of the last query, and the
+   *  coefficient of each pair for these gains. */
+  double* mixed;
+  double* coefficients;
+};
+
+ebur128_stems* ebur128_stems_create(unsigned int channels,
+                                    unsigned long samplerate,
+                                    size_t stems) {
+  ebur128_stems* st;
+  size_t s;
+
+  if (stems == 0 || channels == 0 || channels > UINT_MAX / stems) {
+    return NULL;
+  }
+
+  st = (ebur128_stems*) calloc(1, sizeof(ebur128_stems));
+  if (!st) {
+    return NULL;
+  }
+  st->stems = stems;
+  st->pairs = stems * (stems + 1) / 2;
+  st->states = (ebur128_state**) calloc(stems, sizeof(ebur128_state*));
+  st->filtered = (const double**) malloc(stems * sizeof(const double*));
+  st->samples = (double*) malloc(stems * sizeof(double));
+  st->sums = (double*) malloc(st->pairs * sizeof(double));
+  st->coefficients = (double*) malloc(st->pairs * sizeof(double));
+  if (!st->states || !st->filtered || !st->samples || !st->sums ||
+      !st->coefficients) {
+    goto free_stems;
+  }
+  for (s = 0; s < stems; ++s) {
+    st->states[s] = ebur128_init(channels, samplerate, EBUR128_MODE_S);
+    if (!st->states[s]) {
+      goto free_stems;
+    }
+    st->states[s]->d->input_stride = channels * (unsigned int) stems;
+  }
+  return st;
+
+free_stems:
+  ebur128_stems_destroy(&st);
+  return NULL;
+}
+
+void ebur128_stems_destroy(ebur128_stems** stems) {
+  size_t s;
+
+  if (!*stems) {
+    return;
+  }
+  if ((*stems)->states) {
+    for (s = 0; s < (*stems)->stems; ++s) {
+      if ((*stems)->states[s]) {
+        ebur128_destroy(&(*stems)->states[s]);
+      }
+    }
+  }
+  free((*stems)->states);
+  free((*stems)->filtered);
+  free((*stems)->samples);
+  free((*stems)->sums);
+  free((*stems)->segments);
+  free((*stems)->mixed);
+  free((*stems)->coefficients);
+  free(*stems);
+  *stems = NULL;
+}
+
+int ebur128_stems_set_channel(ebur128_stems* stems,
+                              unsigned int channel_number,
+                              int value) {
+  size_t s;
+  int errcode;
+
+  for (s = 0; s < stems->stems; ++s) {
+    errcode = ebur128_set_channel(stems->states[s], channel_number, value);
+    if (errcode) {
+      return errcode;
+    }
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Make sure that the row of the segment being filled exists, and zero it
+ * when the segment starts. */
+static int ebur128_stems_reserve(ebur128_stems* stems) {
+  if (stems->segments_size == stems->segments_max) {
+    size_t max = stems->segments_max ? 2 * stems->segments_max : 64;
+    double* segments;
+    double* mixed;
+    if (max > ((size_t) -1) / sizeof(double) / stems->pairs) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    segments = (double*) realloc(stems->segments,
+                                 max * stems->pairs * sizeof(double));
+    if (!segments) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    stems->segments = segments;
+    mixed = (double*) realloc(stems->mixed, max * sizeof(double));
+    if (!mixed) {
+      return EBUR128_ERROR_NOMEM;
+    }
+    stems->mixed = mixed;
+    stems->segments_max = max;
+  }
+  if (stems->segment_frames == 0) {
+    memset(stems->segments + stems->segments_size * stems->pairs, 0,
+           stems->pairs * sizeof(double));
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Add the products of the "frames" frames just filtered by all stems to the
+ * segment being filled. The frames are contiguous in the mirrored rings. */
+static void ebur128_stems_accumulate(ebur128_stems* stems, size_t frames) {
+  ebur128_state* first = stems->states[0];
+  unsigned int channels = first->channels;
+  double* row = stems->segments + stems->segments_size * stems->pairs;
+  size_t i, j, s, p;
+  unsigned int c;
+
+  for (s = 0; s < stems->stems; ++s) {
+    stems->filtered[s] = stems->states[s]->d->audio_data +
+                         ebur128_window_offset(stems->states[s], frames);
+  }
+  for (c = 0; c < channels; ++c) {
+    double weight = ebur128_channel_weight(first->d->channel_map[c]);
+    size_t t;
+    if (weight == 0.0) {
+      continue;
+    }
+    /* all pairs in one pass over the frames, the sums stay in cache */
+    memset(stems->sums, 0, stems->pairs * sizeof(double));
+    for (t = 0; t < frames * channels; t += channels) {
+      for (s = 0; s < stems->stems; ++s) {
+        stems->samples[s] = stems->filtered[s][t + c];
+      }
+      p = 0;
+      for (i = 0; i < stems->stems; ++i) {
+        for (j = i; j < stems->stems; ++j) {
+          stems->sums[p++] += stems->samples[i] * stems->samples[j];
+        }
+      }
+    }
+    for (p = 0; p < stems->pairs; ++p) {
+      row[p] += weight * stems->sums[p];
+    }
+  }
+  stems->segment_frames += (unsigned long) frames;
+  if (stems->segment_frames == first->d->samples_in_100ms) {
+    ++stems->segments_size;
+    stems->segment_frames = 0;
+  }
+}
+
+/* The stems are added in chunks that end at the 100ms segment boundaries,
+ * so that the products of each chunk can be read from the rings. */
+#define EBUR128_STEMS_ADD_FRAMES(type)                                         \
+  int ebur128_stems_add_frames_##type(ebur128_stems* stems, const type* src,   \
+                                      size_t frames) {                         \
+    unsigned int channels = stems->states[0]->channels;                        \
+    size_t s, chunk;                                                           \
+    int errcode;                                                               \
+    while (frames > 0) {                                                       \
+      chunk = stems->states[0]->d->samples_in_100ms - stems->segment_frames;   \
+      if (frames < chunk) {                                                    \
+        chunk = frames;                                                        \
+      }                                                                        \
+      errcode = ebur128_stems_reserve(stems);                                  \
+      if (errcode) {                                                           \
+        return errcode;                                                        \
+      }                                                                        \
+      for (s = 0; s < stems->stems; ++s) {                                     \
+        errcode = ebur128_add_frames_##type(stems->states[s],                  \
+                                            src + s * channels, chunk);        \
+        if (errcode) {                                                         \
+          return errcode;                                                      \
+        }                                                                      \
+      }                                                                        \
+      ebur128_stems_accumulate(stems, chunk);                                  \
+      src += chunk * stems->stems * channels;                                  \
+      frames -= chunk;                                                         \
+    }                                                                          \
+    return EBUR128_SUCCESS;                                                    \
+  }
+
+EBUR128_STEMS_ADD_FRAMES(short)
+EBUR128_STEMS_ADD_FRAMES(int)
+EBUR128_STEMS_ADD_FRAMES(float)
+EBUR128_STEMS_ADD_FRAMES(double)
+
+int ebur128_stems_loudness_global(ebur128_stems* stems,
+                                  const double* gains,
+                                  double* out) {
+  double frames_per_block =
+      4.0 * (double) stems->states[0]->d->samples_in_100ms;
+  double relative_threshold = 0.0;
+  double gated_loudness = 0.0;
+  size_t above_thresh_counter = 0;
+  size_t i, j, p, k;
+
+  /* the energy of the mix is a quadratic form in the gains */
+  p = 0;
+  for (i = 0; i < stems->stems; ++i) {
+    for (j = i; j < stems->stems; ++j) {
+      stems->coefficients[p++] = (i == j ? 1.0 : 2.0) * gains[i] * gains[j];
+    }
+  }
+  for (k = 0; k < stems->segments_size; ++k) {
+    const double* row = stems->segments + k * stems->pairs;
+    double energy = 0.0;
+    for (p = 0; p < stems->pairs; ++p) {
+      energy += stems->coefficients[p] * row[p];
+    }
+    stems->mixed[k] = EBUR128_MAX(energy, 0.0);
+  }
+
+  /* gating blocks of 400ms start every 100ms */
+  for (k = 0; k + 4 <= stems->segments_size; ++k) {
+    double energy = (stems->mixed[k] + stems->mixed[k + 1] +
+                     stems->mixed[k + 2] + stems->mixed[k + 3]) /
+                    frames_per_block;
+    if (energy >= histogram_energy_boundaries[0]) {
+      ++above_thresh_counter;
+      relative_threshold += energy;
+    }
+  }
+  if (!above_thresh_counter) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+  relative_threshold /= (double) above_thresh_counter;
+  relative_threshold *= relative_gate_factor;
+
+  above_thresh_counter = 0;
+  for (k = 0; k + 4 <= stems->segments_size; ++k) {
+    double energy = (stems->mixed[k] + stems->mixed[k + 1] +
+                     stems->mixed[k + 2] + stems->mixed[k + 3]) /
+                    frames_per_block;
+    if (energy >= histogram_energy_boundaries[0] &&
+        energy >= relative_threshold) {
+      ++above_thresh_counter;
+      gated_loudness += energy;
+    }
+  }
+  if (!above_thresh_counter) {
     *out = -HUGE_VAL;
     return EBUR128_SUCCESS;
   }
+  gated_loudness /= (double) above_thresh_counter;
+  *out = ebur128_energy_to_loudness(gated_loudness);
+  return EBUR128_SUCCESS;
+}
+
+/* Loudness of the mix of the last "frames_per_block" filtered frames of the
+ * stems, mixed from the rings. */
+static void ebur128_stems_loudness_window(ebur128_stems* stems,
+                                          const double* gains,
+                                          size_t frames_per_block,
+                                          double* out) {
+  ebur128_state* first = stems->states[0];
+  unsigned int channels = first->channels;
+  double energy = 0.0;
+  size_t i, s;
+  unsigned int c;
+
+  if (first->d->hibernating) {
+    /* no frames have been added yet */
+    *out = -HUGE_VAL;
+    return;
+  }
+  for (s = 0; s < stems->stems; ++s) {
+    stems->filtered[s] =
+        stems->states[s]->d->audio_data +
+        ebur128_window_offset(stems->states[s], frames_per_block);
+  }
+  for (c = 0; c < channels; ++c) {
+    double weight = ebur128_channel_weight(first->d->channel_map[c]);
+    double channel_sum = 0.0;
+    if (weight == 0.0) {
+      continue;
+    }
+    for (i = 0; i < frames_per_block; ++i) {
+      double mix = 0.0;
+      for (s = 0; s < stems->stems; ++s) {
+        mix += gains[s] * stems->filtered[s][i * channels + c];
+      }
+      channel_sum += mix * mix;
+    }
+    energy += weight * channel_sum;
+  }
+  energy /= (double) frames_per_block;
 
+  if (energy <= 0.0) {
+    *out = -HUGE_VAL;
+    return;
+  }
   *out = ebur128_energy_to_loudness(energy);
+}
+
+int ebur128_stems_loudness_momentary(ebur128_stems* stems,
+                                     const double* gains,
+                                     double* out) {
+  ebur128_stems_loudness_window(
+      stems, gains, stems->states[0]->d->samples_in_100ms * 4, out);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_stems_loudness_shortterm(ebur128_stems* stems,
+                                     const double* gains,
+                                     double* out) {
+  ebur128_stems_loudness_window(
+      stems, gains, stems->states[0]->d->samples_in_100ms * 30, out);
+  return EBUR128_SUCCESS;
+}
+
+/* Bin of the block energy histogram that contains the relative gate. */
+static size_t ebur128_histogram_gate_index(double relative_threshold) {
+  if (relative_threshold < histogram_energy_boundaries[0]) {
+    return 0;
+  }
+  return find_histogram_index(relative_threshold);
+}
+
+/* Add the blocks of a block energy histogram that are above the relative
+ * gate. Bins above the gate count with their exact energy sums. The bin
+ * containing the gate is exact too if all its blocks are on one side of the
+ * gate, and otherwise taken as a whole if its centre is not below the
+ * gate. */
+static void ebur128_gate_histogram(const unsigned long* histogram,
+                                   const double* sums,
+                                   double relative_threshold,
+                                   double* gated_loudness,
+                                   size_t* above_thresh_counter) {
+  size_t j = ebur128_histogram_gate_index(relative_threshold);
+  const double* bin;
+
+  if (!histogram) {
+    /* the histogram is allocated with its first block */
+    return;
+  }
+  bin = sums + 3 * j;
+  if (histogram[j] &&
+      (bin[1] >= relative_threshold ||
+       (bin[2] >= relative_threshold &&
+        histogram_energies[j] >= relative_threshold))) {
+    *gated_loudness += bin[0];
+    *above_thresh_counter += histogram[j];
+  }
+  for (++j; j < 1000; ++j) {
+    *gated_loudness += sums[3 * j];
+    *above_thresh_counter += histogram[j];
+  }
+}
+
+/* Add the blocks below the absolute gate whose bins are not below "gate",
+ * which is lower than the absolute gate. */
+static void ebur128_gate_sub_gate(ebur128_state* st,
+                                  double gate,
+                                  double* gated_loudness,
+                                  size_t* above_thresh_counter) {
+  size_t j;
+
+  if (!st->d->sub_gate_histogram) {
+    return;
+  }
+  for (j = 0; j < SUB_GATE_BINS && ebur128_sub_gate_energy(j) >= gate; ++j) {
+    *gated_loudness += st->d->sub_gate_sums[j];
+    *above_thresh_counter += st->d->sub_gate_histogram[j];
+  }
+}
+
+/* Sum and number of the blocks not below "gate", the absolute gate for the
+ * blocks before a gain. */
+static int ebur128_calc_relative_threshold(ebur128_state* st,
+                                           double gate,
+                                           size_t* above_thresh_counter,
+                                           double* relative_threshold) {
+  struct ebur128_dq_entry* it;
+  size_t i;
+
+  if (gate < histogram_energy_boundaries[0]) {
+    ebur128_gate_sub_gate(st, gate, relative_threshold, above_thresh_counter);
+  }
+  if (st->d->use_histogram) {
+    ebur128_gate_histogram(st->d->block_energy_histogram,
+                           st->d->block_energy_sums, gate, relative_threshold,
+                           above_thresh_counter);
+  } else {
+    struct ebur128_block_file* file = st->d->block_file;
+    if (file) {
+      int errcode = ebur128_block_file_map(file);
+      if (errcode) {
+        return errcode;
+      }
+      for (i = ebur128_block_file_first(file, st->d->block_list_size,
+                                        st->d->block_list_max);
+           i < file->blocks; ++i) {
+        if (file->map[i] >= gate) {
+          ++*above_thresh_counter;
+          *relative_threshold += file->map[i];
+        }
+      }
+      ebur128_block_file_unmap(file);
+    }
+    STAILQ_FOREACH(it, &st->d->block_list, entries) {
+      if (it->z >= gate) {
+        ++*above_thresh_counter;
+        *relative_threshold += it->z;
+      }
+    }
+  }
+
+  return EBUR128_SUCCESS;
+}
+
+/* Integrated loudness after a gain of "gain" in energy. The blocks are
+ * gated before the gain, with the absolute gate divided by the gain. */
+static int ebur128_gated_loudness(ebur128_state** sts,
+                                  size_t size,
+                                  double gain,
+                                  double* out,
+                                  double* relative_threshold_out) {
+  struct ebur128_dq_entry* it;
+  double gated_loudness = 0.0;
+  double relative_threshold = 0.0;
+  double gate = histogram_energy_boundaries[0] / gain;
+  size_t above_thresh_counter = 0;
+  size_t i, j;
+  int errcode;
+
+  for (i = 0; i < size; i++) {
+    if (sts[i] && (sts[i]->mode & EBUR128_MODE_I) != EBUR128_MODE_I) {
+      return EBUR128_ERROR_INVALID_MODE;
+    }
+  }
+
+  for (i = 0; i < size; i++) {
+    if (!sts[i]) {
+      continue;
+    }
+    errcode = ebur128_calc_relative_threshold(
+        sts[i], gate, &above_thresh_counter, &relative_threshold);
+    if (errcode) {
+      return errcode;
+    }
+  }
+  if (!above_thresh_counter) {
+    if (relative_threshold_out) {
+      *relative_threshold_out = -70.0;
+    }
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+
+  relative_threshold /= (double) above_thresh_counter;
+  relative_threshold *= relative_gate_factor;
+  if (relative_threshold_out) {
+    *relative_threshold_out =
+        ebur128_energy_to_loudness(relative_threshold * gain);
+  }
+  /* with a gain, the relative gate can be below the absolute gate */
+  relative_threshold = EBUR128_MAX(relative_threshold, gate);
+
+  above_thresh_counter = 0;
+  for (i = 0; i < size; i++) {
+    if (!sts[i]) {
+      continue;
+    }
+    if (relative_threshold < histogram_energy_boundaries[0]) {
+      ebur128_gate_sub_gate(sts[i], relative_threshold, &gated_loudness,
+                            &above_thresh_counter);
+    }
+    if (sts[i]->d->use_histogram) {
+      ebur128_gate_histogram(sts[i]->d->block_energy_histogram,
+                             sts[i]->d->block_energy_sums, relative_threshold,
+                             &gated_loudness, &above_thresh_counter);
+    } else {
+      struct ebur128_block_file* file = sts[i]->d->block_file;
+      if (file) {
+        errcode = ebur128_block_file_map(file);
+        if (errcode) {
+          return errcode;
+        }
+        for (j = ebur128_block_file_first(file, sts[i]->d->block_list_size,
+                                          sts[i]->d->block_list_max);
+             j < file->blocks; ++j) {
+          if (file->map[j] >= relative_threshold) {
+            ++above_thresh_counter;
+            gated_loudness += file->map[j];
+          }
+        }
+        ebur128_block_file_unmap(file);
+      }
+      STAILQ_FOREACH(it, &sts[i]->d->block_list, entries) {
+        if (it->z >= relative_threshold) {
+          ++above_thresh_counter;
+          gated_loudness += it->z;
+        }
+      }
+    }
+  }
+  if (!above_thresh_counter) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+  gated_loudness /= (double) above_thresh_counter;
+  *out = ebur128_energy_to_loudness(gated_loudness * gain);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_relative_threshold(ebur128_state* st, double* out) {
+  double relative_threshold = 0.0;
+  size_t above_thresh_counter = 0;
+  int errcode;
+
+  if ((st->mode & EBUR128_MODE_I) != EBUR128_MODE_I) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  errcode = ebur128_calc_relative_threshold(
+      st, histogram_energy_boundaries[0], &above_thresh_counter,
+      &relative_threshold);
+  if (errcode) {
+    return errcode;
+  }
+
+  if (!above_thresh_counter) {
+    *out = -70.0;
+    return EBUR128_SUCCESS;
+  }
+
+  relative_threshold /= (double) above_thresh_counter;
+  relative_threshold *= relative_gate_factor;
+
+  *out = ebur128_energy_to_loudness(relative_threshold);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_loudness_global(ebur128_state* st, double* out) {
+  return ebur128_gated_loudness(&st, 1, 1.0, out, NULL);
+}
+
+int ebur128_loudness_global_multiple(ebur128_state** sts,
+                                     size_t size,
+                                     double* out) {
+  return ebur128_gated_loudness(sts, size, 1.0, out, NULL);
+}
+
+int ebur128_loudness_global_with_gain(ebur128_state* st,
+                                      double gain,
+                                      double* out) {
+  return ebur128_gated_loudness(&st, 1, pow(10.0, gain / 10.0), out, NULL);
+}
+
+static int ebur128_energy_in_interval(ebur128_state* st,
+                                      size_t interval_frames,
+                                      double* out) {
+  if (interval_frames > st->d->audio_data_frames) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  if (st->d->hibernating) {
+    /* the ring restarts with silence */
+    *out = 0.0;
+    return EBUR128_SUCCESS;
+  }
+  ebur128_calc_gating_block(st, interval_frames, out);
+  return EBUR128_SUCCESS;
+}
+
+static int ebur128_energy_shortterm(ebur128_state* st, double* out) {
+  return ebur128_energy_in_interval(st, st->d->samples_in_100ms * 30, out);
+}
+
+int ebur128_loudness_momentary(ebur128_state* st, double* out) {
+  double energy;
+  int error;
+
+  error = ebur128_energy_in_interval(st, st->d->samples_in_100ms * 4, &energy);
+  if (error) {
+    return error;
+  }
+
+  if (energy <= 0.0) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+
+  *out = ebur128_energy_to_loudness(energy);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_loudness_shortterm(ebur128_state* st, double* out) {
+  double energy;
+  int error;
+
+  error = ebur128_energy_shortterm(st, &energy);
+  if (error) {
+    return error;
+  }
+
+  if (energy <= 0.0) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+
+  *out = ebur128_energy_to_loudness(energy);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_loudness_momentary_max(ebur128_state* st, double* out) {
+  if (!st->d->max_loudness_step) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if (st->d->max_momentary <= 0.0) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+
+  *out = ebur128_energy_to_loudness(st->d->max_momentary);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_loudness_shortterm_max(ebur128_state* st, double* out) {
+  if ((st->mode & EBUR128_MODE_S) != EBUR128_MODE_S ||
+      !st->d->max_loudness_step) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if (st->d->max_shortterm <= 0.0) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+
+  *out = ebur128_energy_to_loudness(st->d->max_shortterm);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_loudness_window(ebur128_state* st,
+                            unsigned long window,
+                            double* out) {
+  double energy;
+  size_t interval_frames;
+  int error;
+
+  if (window > st->d->window) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  interval_frames = st->samplerate * window / 1000;
+  error = ebur128_energy_in_interval(st, interval_frames, &energy);
+  if (error) {
+    return error;
+  }
+
+  if (energy <= 0.0) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+
+  *out = ebur128_energy_to_loudness(energy);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_filtered_frames(ebur128_state* st,
+                            size_t frames,
+                            const double** first,
+                            size_t* first_frames,
+                            const double** second,
+                            size_t* second_frames) {
+  if (!st->d->audio_data || frames > st->d->audio_data_fill) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  /* the mirror makes the frames contiguous even if the ring wraps around */
+  *first = st->d->audio_data + ebur128_window_offset(st, frames);
+  *first_frames = frames;
+  *second = NULL;
+  *second_frames = 0;
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_set_filtered_callback(ebur128_state* st,
+                                  ebur128_filtered_callback callback,
+                                  void* user_data) {
+  if ((st->mode & EBUR128_MODE_FIXED_POINT) == EBUR128_MODE_FIXED_POINT) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  st->d->filtered_callback = callback;
+  st->d->filtered_callback_data = user_data;
+  return EBUR128_SUCCESS;
+}
+
+/* EBU - TECH 3342 on a short-term block energy histogram. */
+static void ebur128_histogram_loudness_range(const unsigned long* hist,
+                                             double* out,
+                                             double* low_out,
+                                             double* high_out) {
+  size_t percentile_low, percentile_high;
+  size_t index, j;
+  size_t stl_size = 0;
+  double stl_power = 0.0;
+  double stl_integrated, h_en, l_en;
+
+  for (j = 0; j < 1000; ++j) {
+    stl_size += hist[j];
+    stl_power += hist[j] * histogram_energies[j];
+  }
+  if (!stl_size) {
+    *out = 0.0;
+    *low_out = *high_out = -HUGE_VAL;
+    return;
+  }
+
+  stl_power /= stl_size;
+  stl_integrated = minus_twenty_decibels * stl_power;
+
+  if (stl_integrated < histogram_energy_boundaries[0]) {
+    index = 0;
+  } else {
+    index = find_histogram_index(stl_integrated);
+    if (stl_integrated > histogram_energies[index]) {
+      ++index;
+    }
+  }
+  stl_size = 0;
+  for (j = index; j < 1000; ++j) {
+    stl_size += hist[j];
+  }
+  if (!stl_size) {
+    *out = 0.0;
+    *low_out = *high_out = -HUGE_VAL;
+    return;
+  }
+
+  percentile_low = (size_t) ((stl_size - 1) * 0.1 + 0.5);
+  percentile_high = (size_t) ((stl_size - 1) * 0.95 + 0.5);
+
+  stl_size = 0;
+  j = index;
+  while (stl_size <= percentile_low) {
+    stl_size += hist[j++];
+  }
+  l_en = histogram_energies[j - 1];
+  while (stl_size <= percentile_high) {
+    stl_size += hist[j++];
+  }
+  h_en = histogram_energies[j - 1];
+
+  *low_out = ebur128_energy_to_loudness(l_en);
+  *high_out = ebur128_energy_to_loudness(h_en);
+  *out = *high_out - *low_out;
+}
+
+/** Sketch item or bin with the number of blocks it stands for. */
+struct ebur128_weighted_energy {
+  double energy;
+  unsigned long long weight;
+};
+
+static int ebur128_weighted_energy_cmp(const void* p1, const void* p2) {
+  const struct ebur128_weighted_energy* w1 =
+      (const struct ebur128_weighted_energy*) p1;
+  const struct ebur128_weighted_energy* w2 =
+      (const struct ebur128_weighted_energy*) p2;
+  return (w1->energy > w2->energy) - (w1->energy < w2->energy);
+}
+
+/* EBU - TECH 3342 on "count" weighted short-term block energies, which are
+ * sorted in place. "n" is the sum of their weights and "sum" the sum of the
+ * blocks they stand for. */
+static void ebur128_weighted_loudness_range(
+    struct ebur128_weighted_energy* items,
+    size_t count,
+    unsigned long long n,
+    double sum,
+    double* out,
+    double* low_out,
+    double* high_out) {
+  unsigned long long rank = 0, gated;
+  unsigned long long percentile_low, percentile_high;
+  double stl_integrated, h_en, l_en;
+  size_t j;
+
+  qsort(items, count, sizeof(struct ebur128_weighted_energy),
+        ebur128_weighted_energy_cmp);
+
+  stl_integrated = minus_twenty_decibels * sum / (double) n;
+  gated = n;
+  for (j = 0; j < count && items[j].energy < stl_integrated; ++j) {
+    gated -= items[j].weight;
+  }
+  if (!gated) {
+    *out = 0.0;
+    *low_out = *high_out = -HUGE_VAL;
+    return;
+  }
+
+  /* the weights of the gated items add up to "gated", so both searches end
+   * before the end of the array */
+  percentile_low = (unsigned long long) ((double) (gated - 1) * 0.1 + 0.5);
+  percentile_high = (unsigned long long) ((double) (gated - 1) * 0.95 + 0.5);
+  while (rank + items[j].weight <= percentile_low) {
+    rank += items[j++].weight;
+  }
+  l_en = items[j].energy;
+  while (rank + items[j].weight <= percentile_high) {
+    rank += items[j++].weight;
+  }
+  h_en = items[j].energy;
+
+  *low_out = ebur128_energy_to_loudness(l_en);
+  *high_out = ebur128_energy_to_loudness(h_en);
+  *out = *high_out - *low_out;
+}
+
+/* EBU - TECH 3342 on the merged sketches of all states. The mean for the
+ * relative gate is exact, the percentiles have the rank error of the
+ * sketches. */
+static int ebur128_calc_loudness_range_sketch(ebur128_state** sts,
+                                              size_t size,
+                                              double* out,
+                                              double* low_out,
+                                              double* high_out) {
+  struct ebur128_weighted_energy* items;
+  struct ebur128_sketch* s;
+  size_t count = 0, i, e, h, j, k;
+  unsigned long long n = 0;
+  double sum = 0.0;
+
+  for (i = 0; i < size; ++i) {
+    for (e = 0; sts[i] && e < sts[i]->d->st_sketch_epochs; ++e) {
+      s = sts[i]->d->st_sketch[e];
+      n += s->n;
+      sum += s->sum;
+      for (h = 0; h < s->levels; ++h) {
+        count += s->size[h];
+      }
+    }
+  }
+  if (!n) {
+    *out = 0.0;
+    *low_out = *high_out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+  items = (struct ebur128_weighted_energy*) malloc(
+      count * sizeof(struct ebur128_weighted_energy));
+  if (!items) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  j = 0;
+  for (i = 0; i < size; ++i) {
+    for (e = 0; sts[i] && e < sts[i]->d->st_sketch_epochs; ++e) {
+      s = sts[i]->d->st_sketch[e];
+      for (h = 0; h < s->levels; ++h) {
+        for (k = 0; k < s->size[h]; ++k) {
+          items[j].energy = s->items[h][k];
+          items[j].weight = 1ULL << h;
+          ++j;
+        }
+      }
+    }
+  }
+  ebur128_weighted_loudness_range(items, count, n, sum, out, low_out,
+                                  high_out);
+  free(items);
+  return EBUR128_SUCCESS;
+}
+
+/* EBU - TECH 3342 */
+/* Loudness range of "stl_size" short-term block energies, which are sorted
+ * in place. */
+static void ebur128_vector_loudness_range(double* stl_vector,
+                                          size_t stl_size,
+                                          double* out,
+                                          double* low_out,
+                                          double* high_out) {
+  double* stl_relgated;
+  size_t stl_relgated_size;
+  double stl_power, stl_integrated;
+  /* High and low percentile energy */
+  double h_en, l_en;
+  size_t i;
+
+  qsort(stl_vector, stl_size, sizeof(double), ebur128_double_cmp);
+  stl_power = 0.0;
+  for (i = 0; i < stl_size; ++i) {
+    stl_power += stl_vector[i];
+  }
+  stl_power /= (double) stl_size;
+  stl_integrated = minus_twenty_decibels * stl_power;
+
+  stl_relgated = stl_vector;
+  stl_relgated_size = stl_size;
+  while (stl_relgated_size > 0 && *stl_relgated < stl_integrated) {
+    ++stl_relgated;
+    --stl_relgated_size;
+  }
+
+  if (stl_relgated_size) {
+    h_en = stl_relgated[(size_t) ((stl_relgated_size - 1) * 0.95 + 0.5)];
+    l_en = stl_relgated[(size_t) ((stl_relgated_size - 1) * 0.1 + 0.5)];
+    *low_out = ebur128_energy_to_loudness(l_en);
+    *high_out = ebur128_energy_to_loudness(h_en);
+    *out = *high_out - *low_out;
+  } else {
+    *out = 0.0;
+    *low_out = *high_out = -HUGE_VAL;
+  }
+}
+
+static int ebur128_calc_loudness_range(ebur128_state** sts,
+                                       size_t size,
+                                       double* out,
+                                       double* low_out,
+                                       double* high_out) {
+  size_t i, j;
+  struct ebur128_dq_entry* it;
+  double* stl_vector;
+  size_t stl_size;
+  int use_histogram = 0;
+  int use_sketch = 0;
+
+  for (i = 0; i < size; ++i) {
+    if (sts[i]) {
+      int sketch = sts[i]->d->st_sketch_epochs > 0;
+      int histogram = !sketch && sts[i]->mode & EBUR128_MODE_HISTOGRAM;
+      if ((sts[i]->mode & EBUR128_MODE_LRA) != EBUR128_MODE_LRA) {
+        return EBUR128_ERROR_INVALID_MODE;
+      }
+      if (i == 0) {
+        use_sketch = sketch;
+        use_histogram = histogram;
+      } else if (use_sketch != sketch || use_histogram != histogram) {
+        return EBUR128_ERROR_INVALID_MODE;
+      }
+    }
+  }
+
+  if (use_sketch) {
+    return ebur128_calc_loudness_range_sketch(sts, size, out, low_out,
+                                              high_out);
+  }
+
+  if (use_histogram) {
+    unsigned long hist[1000] = { 0 };
+
+    for (i = 0; i < size; ++i) {
+      if (!sts[i]) {
+        continue;
+      }
+      for (j = 0; sts[i]->d->short_term_block_energy_histogram && j < 1000;
+           ++j) {
+        hist[j] += sts[i]->d->short_term_block_energy_histogram[j];
+      }
+    }
+    ebur128_histogram_loudness_range(hist, out, low_out, high_out);
+    return EBUR128_SUCCESS;
+  }
+
+  stl_size = 0;
+  for (i = 0; i < size; ++i) {
+    if (!sts[i]) {
+      continue;
+    }
+    if (sts[i]->d->st_block_file) {
+      struct ebur128_block_file* file = sts[i]->d->st_block_file;
+      stl_size += file->blocks -
+                  ebur128_block_file_first(file, sts[i]->d->st_block_list_size,
+                                           sts[i]->d->st_block_list_max);
+    }
+    STAILQ_FOREACH(it, &sts[i]->d->short_term_block_list, entries) {
+      ++stl_size;
+    }
+  }
+  if (!stl_size) {
+    *out = 0.0;
+    *low_out = *high_out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+  stl_vector = (double*) malloc(stl_size * sizeof(double));
+  if (!stl_vector) {
+    return EBUR128_ERROR_NOMEM;
+  }
+
+  j = 0;
+  for (i = 0; i < size; ++i) {
+    if (!sts[i]) {
+      continue;
+    }
+    if (sts[i]->d->st_block_file) {
+      struct ebur128_block_file* file = sts[i]->d->st_block_file;
+      size_t k;
+      if (ebur128_block_file_map(file)) {
+        free(stl_vector);
+        return EBUR128_ERROR_IO;
+      }
+      for (k = ebur128_block_file_first(file, sts[i]->d->st_block_list_size,
+                                        sts[i]->d->st_block_list_max);
+           k < file->blocks; ++k) {
+        stl_vector[j] = file->map[k];
+        ++j;
+      }
+      ebur128_block_file_unmap(file);
+    }
+    STAILQ_FOREACH(it, &sts[i]->d->short_term_block_list, entries) {
+      stl_vector[j] = it->z;
+      ++j;
+    }
+  }
+  ebur128_vector_loudness_range(stl_vector, stl_size, out, low_out, high_out);
+  free(stl_vector);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_loudness_range_multiple(ebur128_state** sts,
+                                    size_t size,
+                                    double* out) {
+  double low, high;
+  return ebur128_calc_loudness_range(sts, size, out, &low, &high);
+}
+
+int ebur128_loudness_range(ebur128_state* st, double* out) {
+  return ebur128_loudness_range_multiple(&st, 1, out);
+}
+
+/* Store the short-term blocks of a state that are not below "gate" in
+ * "items", sketch items and bins with the number of blocks they stand for.
+ * "items" has room for all blocks, sketch items and bins. */
+static int ebur128_gate_short_term_blocks(ebur128_state* st,
+                                          double gate,
+                                          struct ebur128_weighted_energy* items,
+                                          size_t* count) {
+  struct ebur128_block_file* file = st->d->st_block_file;
+  struct ebur128_dq_entry* it;
+  size_t e, h, j;
+
+  for (e = 0; e < st->d->st_sketch_epochs; ++e) {
+    struct ebur128_sketch* s = st->d->st_sketch[e];
+    for (h = 0; h < s->levels; ++h) {
+      for (j = 0; j < s->size[h]; ++j) {
+        if (s->items[h][j] >= gate) {
+          items[*count].energy = s->items[h][j];
+          items[(*count)++].weight = 1ULL << h;
+        }
+      }
+    }
+  }
+  for (j = 0; st->d->short_term_block_energy_histogram && j < 1000; ++j) {
+    if (st->d->short_term_block_energy_histogram[j] &&
+        histogram_energies[j] >= gate) {
+      items[*count].energy = histogram_energies[j];
+      items[(*count)++].weight = st->d->short_term_block_energy_histogram[j];
+    }
+  }
+  for (j = 0; st->d->st_sub_gate_histogram && j < SUB_GATE_BINS; ++j) {
+    if (st->d->st_sub_gate_histogram[j] &&
+        ebur128_sub_gate_energy(j) >= gate) {
+      items[*count].energy = ebur128_sub_gate_energy(j);
+      items[(*count)++].weight = st->d->st_sub_gate_histogram[j];
+    }
+  }
+  if (file) {
+    if (ebur128_block_file_map(file)) {
+      return EBUR128_ERROR_IO;
+    }
+    for (j = ebur128_block_file_first(file, st->d->st_block_list_size,
+                                      st->d->st_block_list_max);
+         j < file->blocks; ++j) {
+      if (file->map[j] >= gate) {
+        items[*count].energy = file->map[j];
+        items[(*count)++].weight = 1;
+      }
+    }
+    ebur128_block_file_unmap(file);
+  }
+  STAILQ_FOREACH(it, &st->d->short_term_block_list, entries) {
+    if (it->z >= gate) {
+      items[*count].energy = it->z;
+      items[(*count)++].weight = 1;
+    }
+  }
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_loudness_range_with_gain(ebur128_state* st,
+                                     double gain,
+                                     double* out) {
+  struct ebur128_weighted_energy* items;
+  double gate = histogram_energy_boundaries[0] / pow(10.0, gain / 10.0);
+  double sum = 0.0, low, high;
+  unsigned long long n = 0;
+  size_t size = 1000 + SUB_GATE_BINS + st->d->st_block_list_size;
+  size_t count = 0, e, h;
+  int errcode;
+
+  if ((st->mode & EBUR128_MODE_LRA) != EBUR128_MODE_LRA) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  for (e = 0; e < st->d->st_sketch_epochs; ++e) {
+    for (h = 0; h < st->d->st_sketch[e]->levels; ++h) {
+      size += st->d->st_sketch[e]->size[h];
+    }
+  }
+  if (st->d->st_block_file) {
+    size += st->d->st_block_file->blocks;
+  }
+  items = (struct ebur128_weighted_energy*) malloc(
+      size * sizeof(struct ebur128_weighted_energy));
+  if (!items) {
+    return EBUR128_ERROR_NOMEM;
+  }
+  /* the gates and percentiles are taken before the gain, only the absolute
+   * gate moves */
+  errcode = ebur128_gate_short_term_blocks(st, gate, items, &count);
+  if (errcode) {
+    free(items);
+    return errcode;
+  }
+  for (e = 0; e < count; ++e) {
+    n += items[e].weight;
+    sum += items[e].energy * (double) items[e].weight;
+  }
+  if (!n) {
+    *out = 0.0;
+  } else {
+    ebur128_weighted_loudness_range(items, count, n, sum, out, &low, &high);
+  }
+  free(items);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_sample_peak(ebur128_state* st,
+                        unsigned int channel_number,
+                        double* out) {
+  if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) != EBUR128_MODE_SAMPLE_PEAK) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if (channel_number >= st->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+
+  *out = st->d->sample_peak[channel_number];
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_prev_sample_peak(ebur128_state* st,
+                             unsigned int channel_number,
+                             double* out) {
+  if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) != EBUR128_MODE_SAMPLE_PEAK) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if (channel_number >= st->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+
+  *out = st->d->prev_sample_peak[channel_number];
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_true_peak(ebur128_state* st,
+                      unsigned int channel_number,
+                      double* out) {
+  if ((st->mode & EBUR128_MODE_TRUE_PEAK) != EBUR128_MODE_TRUE_PEAK) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if (channel_number >= st->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+
+  *out = EBUR128_MAX(st->d->true_peak[channel_number],
+                     st->d->sample_peak[channel_number]);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_prev_true_peak(ebur128_state* st,
+                           unsigned int channel_number,
+                           double* out) {
+  if ((st->mode & EBUR128_MODE_TRUE_PEAK) != EBUR128_MODE_TRUE_PEAK) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if (channel_number >= st->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+
+  *out = EBUR128_MAX(st->d->prev_true_peak[channel_number],
+                     st->d->prev_sample_peak[channel_number]);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_sample_peak_frame(ebur128_state* st,
+                              unsigned int channel_number,
+                              unsigned long long* out) {
+  if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) != EBUR128_MODE_SAMPLE_PEAK) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if (channel_number >= st->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+
+  *out = st->d->sample_peak_frame[channel_number];
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_true_peak_frame(ebur128_state* st,
+                            unsigned int channel_number,
+                            unsigned long long* out) {
+  if ((st->mode & EBUR128_MODE_TRUE_PEAK) != EBUR128_MODE_TRUE_PEAK) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if (channel_number >= st->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+
+  /* same choice as in ebur128_true_peak() */
+  if (st->d->true_peak[channel_number] >=
+      st->d->sample_peak[channel_number]) {
+    *out = st->d->true_peak_frame[channel_number];
+  } else {
+    *out = st->d->sample_peak_frame[channel_number];
+  }
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_sample_peak_window(ebur128_state* st,
+                               unsigned int channel_number,
+                               double* out) {
+  if (!st->d->sample_peak_window) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if (channel_number >= st->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+
+  *out = ebur128_peak_window_max(st->d->sample_peak_window, channel_number,
+                                 st->d->segment_sample_peak[channel_number]);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_true_peak_window(ebur128_state* st,
+                             unsigned int channel_number,
+                             double* out) {
+  if (!st->d->true_peak_window) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+
+  if (channel_number >= st->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+
+  *out = ebur128_peak_window_max(
+      st->d->true_peak_window, channel_number,
+      EBUR128_MAX(st->d->segment_true_peak[channel_number],
+                  st->d->segment_sample_peak[channel_number]));
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_get_summary_multiple(ebur128_state** sts,
+                                 size_t size,
+                                 ebur128_summary* out) {
+  size_t i;
+  unsigned int c;
+  unsigned int max_channels = 0;
+  int mode = 0;
+  int first = 1;
+  int errcode;
+
+  for (i = 0; i < size; ++i) {
+    if (!sts[i]) {
+      continue;
+    }
+    mode = first ? sts[i]->mode : mode & sts[i]->mode;
+    first = 0;
+    max_channels = EBUR128_MAX(max_channels, sts[i]->channels);
+  }
+  if ((mode & EBUR128_MODE_I) != EBUR128_MODE_I) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  out->mode = mode;
+
+  errcode = ebur128_gated_loudness(sts, size, 1.0, &out->loudness_global,
+                                   &out->relative_threshold);
+  if (errcode) {
+    return errcode;
+  }
+
+  if ((mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA) {
+    errcode = ebur128_calc_loudness_range(sts, size, &out->loudness_range,
+                                          &out->loudness_range_low,
+                                          &out->loudness_range_high);
+    if (errcode) {
+      return errcode;
+    }
+  }
+
+  if ((mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK) {
+    int true_peak = (mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK;
+
+    out->sample_peak = 0.0;
+    if (true_peak) {
+      out->true_peak = 0.0;
+    }
+    for (c = 0; c < max_channels; ++c) {
+      if (out->channel_sample_peak) {
+        out->channel_sample_peak[c] = 0.0;
+      }
+      if (true_peak && out->channel_true_peak) {
+        out->channel_true_peak[c] = 0.0;
+      }
+    }
+    for (i = 0; i < size; ++i) {
+      if (!sts[i]) {
+        continue;
+      }
+      for (c = 0; c < sts[i]->channels; ++c) {
+        double sample_peak = sts[i]->d->sample_peak[c];
+        out->sample_peak = EBUR128_MAX(out->sample_peak, sample_peak);
+        if (out->channel_sample_peak) {
+          out->channel_sample_peak[c] =
+              EBUR128_MAX(out->channel_sample_peak[c], sample_peak);
+        }
+        if (true_peak) {
+          double peak = EBUR128_MAX(sts[i]->d->true_peak[c], sample_peak);
+          out->true_peak = EBUR128_MAX(out->true_peak, peak);
+          if (out->channel_true_peak) {
+            out->channel_true_peak[c] =
+                EBUR128_MAX(out->channel_true_peak[c], peak);
+          }
+        }
+      }
+    }
+  }
+
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_get_summary(ebur128_state* st, ebur128_summary* out) {
+  return ebur128_get_summary_multiple(&st, 1, out);
+}
+
+/* Forget the blocks and peaks measured so far. The filters, the audio buffer
+ * and the block grid keep running. */
+static void ebur128_reset_measurement(ebur128_state* st) {
+  struct ebur128_dq_entry* block;
+  struct ebur128_block_file* files[2];
+  size_t i;
+  unsigned int c;
+
+  while (!STAILQ_EMPTY(&st->d->block_list)) {
+    block = STAILQ_FIRST(&st->d->block_list);
+    STAILQ_REMOVE_HEAD(&st->d->block_list, entries);
+    free(block);
+  }
+  st->d->block_list_size = 0;
+  while (!STAILQ_EMPTY(&st->d->short_term_block_list)) {
+    block = STAILQ_FIRST(&st->d->short_term_block_list);
+    STAILQ_REMOVE_HEAD(&st->d->short_term_block_list, entries);
+    free(block);
+  }
+  st->d->st_block_list_size = 0;
+  ++st->d->history_changes;
+  files[0] = st->d->block_file;
+  files[1] = st->d->st_block_file;
+  for (i = 0; i < 2; ++i) {
+    if (files[i]) {
+      /* the file is overwritten from the start */
+      rewind(files[i]->file);
+      files[i]->blocks = 0;
+      files[i]->first_valid = 0;
+    }
+  }
+
+  if (st->d->block_energy_histogram) {
+    memset(st->d->block_energy_histogram, 0, 1000 * sizeof(unsigned long));
+    memset(st->d->block_energy_sums, 0, 3 * 1000 * sizeof(double));
+  }
+  if (st->d->short_term_block_energy_histogram) {
+    memset(st->d->short_term_block_energy_histogram, 0,
+           1000 * sizeof(unsigned long));
+  }
+  if (st->d->sub_gate_histogram) {
+    memset(st->d->sub_gate_histogram, 0,
+           SUB_GATE_BINS * sizeof(unsigned long));
+    memset(st->d->sub_gate_sums, 0, SUB_GATE_BINS * sizeof(double));
+  }
+  if (st->d->st_sub_gate_histogram) {
+    memset(st->d->st_sub_gate_histogram, 0,
+           SUB_GATE_BINS * sizeof(unsigned long));
+  }
+  if (st->d->st_sketch_epochs) {
+    /* keep the newest epoch, it has the largest buffers */
+    for (i = 0; i + 1 < st->d->st_sketch_epochs; ++i) {
+      ebur128_sketch_destroy(st->d->st_sketch[i]);
+    }
+    st->d->st_sketch[0] = st->d->st_sketch[st->d->st_sketch_epochs - 1];
+    st->d->st_sketch_epochs = 1;
+    ebur128_sketch_clear(st->d->st_sketch[0]);
+  }
+
+  for (c = 0; c < st->channels; ++c) {
+    st->d->sample_peak[c] = 0.0;
+    st->d->true_peak[c] = 0.0;
+    st->d->sample_peak_frame[c] = 0;
+    st->d->true_peak_frame[c] = 0;
+  }
+  st->d->max_momentary = 0.0;
+  st->d->max_shortterm = 0.0;
+
+  /* the next short-term block for the loudness range is 3s away, at the end
+   * of a gating block */
+  if (st->d->needed_frames <= st->d->samples_in_100ms) {
+    st->d->short_term_frame_counter =
+        st->d->samples_in_100ms - st->d->needed_frames;
+  }
+}
+
+int ebur128_begin_programme(ebur128_state* st) {
+  ebur128_reset_measurement(st);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_end_programme(ebur128_state* st, ebur128_summary* out) {
+  if (out) {
+    int errcode = ebur128_get_summary(st, out);
+    if (errcode) {
+      return errcode;
+    }
+  }
+  ebur128_reset_measurement(st);
+  return EBUR128_SUCCESS;
+}
+
+struct ebur128_async {
+  ebur128_state* st;
+  /** Normalized frames (used as single-producer/single-consumer ring). */
+  double* ring;
+  /** Size of ring in frames, a power of two. */
+  size_t ring_frames;
+  /** Free-running frame counters, only written by producer or consumer. */
+  volatile size_t write_counter;
+  volatile size_t read_counter;
+  /** Set while the worker waits for frames. */
+  volatile size_t sleeping;
+  /** Set to stop the worker once all frames are processed. */
+  volatile size_t quit;
+  /** Protected by mutex. */
+  int busy;
+  int error;
+  double momentary;
+  double shortterm;
+  ebur128_mutex mutex;
+  ebur128_cond idle_cond;
+  /** Only held by the worker while it goes to sleep, so that waking it does
+   *  not wait for the results or their readers. */
+  ebur128_mutex wake_mutex;
+  ebur128_cond data_cond;
+  ebur128_thread thread;
+};
+
+/* Wake the worker if it waits for frames or for quit. */
+static void ebur128_async_wake(ebur128_async* as) {
+  ebur128_mutex_lock(&as->wake_mutex);
+  ebur128_cond_signal(&as->data_cond);
+  ebur128_mutex_unlock(&as->wake_mutex);
+}
+
+static void ebur128_async_work(ebur128_async* as) {
+  size_t read, available, frames;
+  int errcode;
+  double momentary, shortterm;
+
+  ebur128_mutex_lock(&as->mutex);
+  for (;;) {
+    while (ebur128_atomic_load(&as->write_counter) == as->read_counter) {
+      if (ebur128_atomic_load(&as->quit)) {
+        ebur128_mutex_unlock(&as->mutex);
+        return;
+      }
+      as->busy = 0;
+      ebur128_cond_broadcast(&as->idle_cond);
+      ebur128_mutex_unlock(&as->mutex);
+      /* Re-check after announcing that we sleep, the producer signals only
+       * if it sees the flag. */
+      ebur128_mutex_lock(&as->wake_mutex);
+      ebur128_atomic_store(&as->sleeping, 1);
+      if (ebur128_atomic_load(&as->write_counter) == as->read_counter &&
+          !ebur128_atomic_load(&as->quit)) {
+        ebur128_cond_wait(&as->data_cond, &as->wake_mutex);
+      }
+      ebur128_atomic_store(&as->sleeping, 0);
+      ebur128_mutex_unlock(&as->wake_mutex);
+      ebur128_mutex_lock(&as->mutex);
+    }
+    as->busy = 1;
+    ebur128_mutex_unlock(&as->mutex);
+
+    /* the first error of the frames processed in this round */
+    errcode = EBUR128_SUCCESS;
+    read = as->read_counter;
+    available = ebur128_atomic_load(&as->write_counter) - read;
+    while (available > 0) {
+      int chunk_errcode;
+      size_t index = read & (as->ring_frames - 1);
+      frames = as->ring_frames - index;
+      if (frames > available) {
+        frames = available;
+      }
+      chunk_errcode = ebur128_add_frames_double(
+          as->st, as->ring + index * as->st->channels, frames);
+      if (chunk_errcode && !errcode) {
+        errcode = chunk_errcode;
+      }
+      read += frames;
+      available -= frames;
+      ebur128_atomic_store(&as->read_counter, read);
+    }
+    ebur128_loudness_momentary(as->st, &momentary);
+    if (ebur128_loudness_shortterm(as->st, &shortterm)) {
+      shortterm = -HUGE_VAL;
+    }
+
+    ebur128_mutex_lock(&as->mutex);
+    as->momentary = momentary;
+    as->shortterm = shortterm;
+    if (errcode && !as->error) {
+      as->error = errcode;
+    }
+  }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI ebur128_async_thread(LPVOID as) {
+  ebur128_async_work((ebur128_async*) as);
+  return 0;
+}
+#else
+static void* ebur128_async_thread(void* as) {
+  ebur128_async_work((ebur128_async*) as);
+  return NULL;
+}
+#endif
+
+ebur128_async* ebur128_async_create(ebur128_state* st, size_t ring_frames) {
+  int errcode; /* unused */
+  ebur128_async* as;
+  size_t frames = 1;
+  size_t ring_size;
+
+  while (frames < ring_frames) {
+    CHECK_ERROR(frames > ((size_t) -1) / 2, 0, exit)
+    frames *= 2;
+  }
+  CHECK_ERROR(safe_size_mul(frames, st->channels * sizeof(double), &ring_size),
+              0, exit)
+
+  as = (ebur128_async*) calloc(1, sizeof(ebur128_async));
+  CHECK_ERROR(!as, 0, exit)
+  as->st = st;
+  as->ring_frames = frames;
+  as->ring = (double*) malloc(ring_size);
+  CHECK_ERROR(!as->ring, 0, free_async)
+  as->momentary = -HUGE_VAL;
+  as->shortterm = -HUGE_VAL;
+
+  CHECK_ERROR(ebur128_mutex_init(&as->mutex), 0, free_ring)
+  CHECK_ERROR(ebur128_mutex_init(&as->wake_mutex), 0, destroy_mutex)
+  CHECK_ERROR(ebur128_cond_init(&as->data_cond), 0, destroy_wake_mutex)
+  CHECK_ERROR(ebur128_cond_init(&as->idle_cond), 0, destroy_data_cond)
+#if defined(_WIN32)
+  as->thread = CreateThread(NULL, 0, ebur128_async_thread, as, 0, NULL);
+  CHECK_ERROR(!as->thread, 0, destroy_idle_cond)
+#else
+  CHECK_ERROR(pthread_create(&as->thread, NULL, ebur128_async_thread, as), 0,
+              destroy_idle_cond)
+#endif
+  return as;
+
+destroy_idle_cond:
+  ebur128_cond_destroy(&as->idle_cond);
+destroy_data_cond:
+  ebur128_cond_destroy(&as->data_cond);
+destroy_wake_mutex:
+  ebur128_mutex_destroy(&as->wake_mutex);
+destroy_mutex:
+  ebur128_mutex_destroy(&as->mutex);
+free_ring:
+  free(as->ring);
+free_async:
+  free(as);
+exit:
+  return NULL;
+}
+
+void ebur128_async_destroy(ebur128_async** as) {
+  ebur128_atomic_store(&(*as)->quit, 1);
+  ebur128_async_wake(*as);
+#if defined(_WIN32)
+  WaitForSingleObject((*as)->thread, INFINITE);
+  CloseHandle((*as)->thread);
+#else
+  pthread_join((*as)->thread, NULL);
+#endif
+  ebur128_cond_destroy(&(*as)->idle_cond);
+  ebur128_cond_destroy(&(*as)->data_cond);
+  ebur128_mutex_destroy(&(*as)->wake_mutex);
+  ebur128_mutex_destroy(&(*as)->mutex);
+  free((*as)->ring);
+  free(*as);
+  *as = NULL;
+}
+
+int ebur128_async_flush(ebur128_async* as) {
+  int errcode;
+
+  ebur128_mutex_lock(&as->mutex);
+  while (as->busy ||
+         ebur128_atomic_load(&as->write_counter) != as->read_counter) {
+    ebur128_async_wake(as);
+    ebur128_cond_wait(&as->idle_cond, &as->mutex);
+  }
+  errcode = as->error;
+  as->error = EBUR128_SUCCESS;
+  ebur128_mutex_unlock(&as->mutex);
+  return errcode;
+}
+
+#define EBUR128_ASYNC_ADD_FRAMES(type, min_scale, max_scale)                   \
+  int ebur128_async_add_frames_##type(ebur128_async* as, const type* src,      \
+                                      size_t frames) {                         \
+    static double scaling_factor =                                             \
+        EBUR128_MAX(-((double) (min_scale)), (double) (max_scale));            \
+    size_t write = as->write_counter;                                          \
+    size_t free_frames =                                                       \
+        as->ring_frames - (write - ebur128_atomic_load(&as->read_counter));    \
+    size_t i, samples;                                                         \
+    double* dest;                                                              \
+                                                                               \
+    if (frames > free_frames) {                                                \
+      return EBUR128_ERROR_NOMEM;                                              \
+    }                                                                          \
+    while (frames > 0) {                                                       \
+      size_t index = write & (as->ring_frames - 1);                            \
+      size_t chunk = as->ring_frames - index;                                  \
+      if (chunk > frames) {                                                    \
+        chunk = frames;                                                        \
+      }                                                                        \
+      dest = as->ring + index * as->st->channels;                              \
+      samples = chunk * as->st->channels;                                      \
+      for (i = 0; i < samples; ++i) {                                          \
+        dest[i] = (double) src[i] / scaling_factor;                            \
+      }                                                                        \
+      src += samples;                                                          \
+      write += chunk;                                                          \
+      frames -= chunk;                                                         \
+    }                                                                          \
+    ebur128_atomic_store(&as->write_counter, write);                           \
+    if (ebur128_atomic_load(&as->sleeping)) {                                  \
+      ebur128_async_wake(as);                                                  \
+    }                                                                          \
+    return EBUR128_SUCCESS;                                                    \
+  }
+
+EBUR128_ASYNC_ADD_FRAMES(short, SHRT_MIN, SHRT_MAX)
+EBUR128_ASYNC_ADD_FRAMES(int, INT_MIN, INT_MAX)
+EBUR128_ASYNC_ADD_FRAMES(float, -1.0f, 1.0f)
+EBUR128_ASYNC_ADD_FRAMES(double, -1.0, 1.0)
+
+int ebur128_async_loudness_momentary(ebur128_async* as, double* out) {
+  ebur128_mutex_lock(&as->mutex);
+  *out = as->momentary;
+  ebur128_mutex_unlock(&as->mutex);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_async_loudness_shortterm(ebur128_async* as, double* out) {
+  if ((as->st->mode & EBUR128_MODE_S) != EBUR128_MODE_S) {
+    return EBUR128_ERROR_INVALID_MODE;
+  }
+  ebur128_mutex_lock(&as->mutex);
+  *out = as->shortterm;
+  ebur128_mutex_unlock(&as->mutex);
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_normalization_gain(ebur128_state* st,
+                               double target,
+                               double ceiling,
+                               double* out) {
+  double loudness;
+  double peak = 0.0;
+  unsigned int c;
+  int errcode;
+
+  errcode = ebur128_loudness_global(st, &loudness);
+  if (errcode) {
+    return errcode;
+  }
+  if (loudness == -HUGE_VAL) {
+    *out = 0.0;
+    return EBUR128_SUCCESS;
+  }
+  *out = target - loudness;
+
+  for (c = 0; c < st->channels; ++c) {
+    double channel_peak;
+    if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
+      ebur128_true_peak(st, c, &channel_peak);
+    } else if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) ==
+               EBUR128_MODE_SAMPLE_PEAK) {
+      ebur128_sample_peak(st, c, &channel_peak);
+    } else {
+      break;
+    }
+    peak = EBUR128_MAX(peak, channel_peak);
+  }
+  if (peak > 0.0 && 20.0 * log10(peak) + *out > ceiling) {
+    *out = ceiling - 20.0 * log10(peak);
+  }
+  return EBUR128_SUCCESS;
+}
+
+struct ebur128_normalizer {
+  unsigned int channels;
+  /** Linear gain. */
+  double gain;
+  interpolator* interp;
+  /** One tile of normalized frames after the gain, and its interpolation. */
+  float* tile_input;
+  float* tile_output;
+  size_t tile_frames;
+  /** Peaks after the gain, one per channel. */
+  double* sample_peak;
+  double* true_peak;
+};
+
+ebur128_normalizer* ebur128_normalizer_create(unsigned int channels,
+                                              unsigned long samplerate,
+                                              double gain) {
+  int errcode; /* unused */
+  ebur128_normalizer* n;
+
+  VALIDATE_CHANNELS_AND_SAMPLERATE(NULL);
+
+  n = (ebur128_normalizer*) calloc(1, sizeof(ebur128_normalizer));
+  CHECK_ERROR(!n, 0, exit)
+  n->channels = channels;
+  n->gain = pow(10.0, gain / 20.0);
+  n->tile_frames = EBUR128_MAX(TILE_SAMPLES / channels, 1);
+
+  n->sample_peak = (double*) calloc(channels, sizeof(double));
+  n->true_peak = (double*) calloc(channels, sizeof(double));
+  n->tile_input = (float*) malloc(n->tile_frames * channels * sizeof(float));
+  CHECK_ERROR(!n->sample_peak || !n->true_peak || !n->tile_input, 0,
+              free_normalizer)
+
+  if (samplerate < 96000) {
+    n->interp = interp_create(49, 4, channels, 0);
+  } else if (samplerate < 192000) {
+    n->interp = interp_create(49, 2, channels, 0);
+  }
+  if (samplerate < 192000) {
+    CHECK_ERROR(!n->interp, 0, free_normalizer)
+    n->tile_output = (float*) malloc(n->tile_frames * n->interp->factor *
+                                     channels * sizeof(float));
+    CHECK_ERROR(!n->tile_output, 0, free_normalizer)
+  }
+  return n;
+
+free_normalizer:
+  ebur128_normalizer_destroy(&n);
+exit:
+  return NULL;
+}
+
+void ebur128_normalizer_destroy(ebur128_normalizer** n) {
+  if (!*n) {
+    return;
+  }
+  interp_destroy((*n)->interp);
+  free((*n)->tile_input);
+  free((*n)->tile_output);
+  free((*n)->sample_peak);
+  free((*n)->true_peak);
+  free(*n);
+  *n = NULL;
+}
+
+/* Applies the gain to one tile of frames, with rounding and clipping for
+ * integer types, and takes the peaks of the result. The interpolator works
+ * on the tile while it is still in cache. */
+#define EBUR128_NORMALIZER_APPLY(type, min_scale, max_scale, integer)          \
+  int ebur128_normalizer_apply_##type(ebur128_normalizer* n, type* frames,     \
+                                      size_t frames_count) {                   \
+    static double scaling_factor =                                             \
+        EBUR128_MAX(-((double) (min_scale)), (double) (max_scale));            \
+                                                                               \
+    size_t t, i, c;                                                            \
+                                                                               \
+    for (t = 0; t < frames_count; t += n->tile_frames) {                       \
+      type* buf = frames + t * n->channels;                                    \
+      size_t tile_frames = EBUR128_MIN(n->tile_frames, frames_count - t);      \
+                                                                               \
+      for (i = 0; i < tile_frames; ++i) {                                      \
+        for (c = 0; c < n->channels; ++c) {                                    \
+          double cur = (double) buf[i * n->channels + c] * n->gain;            \
+          if (integer) {                                                       \
+            cur = floor(cur + 0.5);                                            \
+            cur = EBUR128_MIN(EBUR128_MAX(cur, (double) (min_scale)),          \
+                              (double) (max_scale));                           \
+          }                                                                    \
+          buf[i * n->channels + c] = (type) cur;                               \
+          cur = (double) buf[i * n->channels + c] / scaling_factor;            \
+          n->tile_input[i * n->channels + c] = (float) cur;                    \
+          if (EBUR128_MAX(cur, -cur) > n->sample_peak[c]) {                    \
+            n->sample_peak[c] = EBUR128_MAX(cur, -cur);                        \
+          }                                                                    \
+        }                                                                      \
+      }                                                                        \
+      if (n->interp) {                                                         \
+        size_t frames_out =                                                    \
+            interp_process(n->interp, tile_frames, 0, n->tile_input,           \
+                           n->tile_output, 0, n->channels);                    \
+        interp_advance(n->interp, tile_frames);                                \
+        for (i = 0; i < frames_out; ++i) {                                     \
+          for (c = 0; c < n->channels; ++c) {                                  \
+            double cur = (double) n->tile_output[i * n->channels + c];         \
+            if (EBUR128_MAX(cur, -cur) > n->true_peak[c]) {                    \
+              n->true_peak[c] = EBUR128_MAX(cur, -cur);                        \
+            }                                                                  \
+          }                                                                    \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+    return EBUR128_SUCCESS;                                                    \
+  }
+
+EBUR128_NORMALIZER_APPLY(short, SHRT_MIN, SHRT_MAX, 1)
+EBUR128_NORMALIZER_APPLY(int, INT_MIN, INT_MAX, 1)
+EBUR128_NORMALIZER_APPLY(float, -1.0f, 1.0f, 0)
+EBUR128_NORMALIZER_APPLY(double, -1.0, 1.0, 0)
+
+int ebur128_normalizer_sample_peak(ebur128_normalizer* n,
+                                   unsigned int channel_number,
+                                   double* out) {
+  if (channel_number >= n->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+  *out = n->sample_peak[channel_number];
+  return EBUR128_SUCCESS;
+}
+
+int ebur128_normalizer_true_peak(ebur128_normalizer* n,
+                                 unsigned int channel_number,
+                                 double* out) {
+  if (channel_number >= n->channels) {
+    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  }
+  *out = EBUR128_MAX(n->true_peak[channel_number],
+                     n->sample_peak[channel_number]);
+  return EBUR128_SUCCESS;
+}
+
+/** Histograms of the block and short-term block energies of a measurement,
+ *  with its peaks. */
+struct ebur128_digest {
+  /** Block energy histogram with the sum, minimum and maximum of each bin,
+   *  as in ebur128_state_internal. */
+  unsigned long block_energy_histogram[1000];
+  double block_energy_sums[3 * 1000];
+  unsigned long short_term_block_energy_histogram[1000];
+  double sample_peak;
+  double true_peak;
+};
+
+/* Magic and version at the start of a serialized digest. */
+#define DIGEST_MAGIC "EBUD"
+#define DIGEST_VERSION 1
+/* Size of the serialized header and of a block and short-term bin. */
+#define DIGEST_HEADER_SIZE (4 + 4 + 8 + 8)
+#define DIGEST_BLOCK_BIN_SIZE (2 + 8 + 3 * 8)
+#define DIGEST_ST_BIN_SIZE (2 + 8)
+
+static void ebur128_digest_add_block(ebur128_digest* d, double energy) {
+  size_t index = find_histogram_index(energy);
+  double* bin = d->block_energy_sums + 3 * index;
+
+  if (!d->block_energy_histogram[index]++) {
+    bin[1] = bin[2] = energy;
+  }
+  bin[0] += energy;
+  bin[1] = EBUR128_MIN(bin[1], energy);
+  bin[2] = EBUR128_MAX(bin[2], energy);
+}
+
+/* Adds a block to the block energy histogram of the digest, or to the
+ * short-term histogram. */
+static void
+ebur128_digest_add(ebur128_digest* d, double energy, int short_term) {
+  if (short_term) {
+    ++d->short_term_block_energy_histogram[find_histogram_index(energy)];
+  } else {
+    ebur128_digest_add_block(d, energy);
+  }
+}
+
+/* Adds the newest "blocks" blocks of a block list and its optional file to
+ * the digest, and to "total" if it is not NULL. Without a file, the list is
+ * continued after "*last" if it is set. "*last" is set to the newest block
+ * of the list. */
+static int ebur128_digest_add_list(ebur128_digest* d,
+                                   ebur128_digest* total,
+                                   struct ebur128_double_queue* list,
+                                   struct ebur128_block_file* file,
+                                   unsigned long list_size,
+                                   size_t blocks,
+                                   struct ebur128_dq_entry** last,
+                                   int short_term) {
+  struct ebur128_dq_entry* it;
+  size_t i, skip = 0;
+
+  if (blocks > list_size) {
+    /* the older ones are in the file */
+    if (ebur128_block_file_map(file)) {
+      return EBUR128_ERROR_IO;
+    }
+    for (i = file->blocks - (blocks - list_size); i < file->blocks; ++i) {
+      ebur128_digest_add(d, file->map[i], short_term);
+      if (total) {
+        ebur128_digest_add(total, file->map[i], short_term);
+      }
+    }
+    ebur128_block_file_unmap(file);
+  } else {
+    skip = list_size - blocks;
+  }
+  if (!file && *last) {
+    it = STAILQ_NEXT(*last, entries);
+  } else {
+    for (it = STAILQ_FIRST(list); skip; --skip) {
+      it = STAILQ_NEXT(it, entries);
+    }
+  }
+  for (; it; it = STAILQ_NEXT(it, entries)) {
+    ebur128_digest_add(d, it->z, short_term);
+    if (total) {
+      ebur128_digest_add(total, it->z, short_term);
+    }
+    *last = it;
+  }
+  return EBUR128_SUCCESS;
+}
+
+/* Adds the block energies of a state to the digest, or its short-term block
+ * energies. "*last" is set to the newest block of the list, if the state
+ * keeps one. */
+static int ebur128_digest_fill(ebur128_digest* d,
+                               ebur128_state* st,
+                               int short_term,
+                               struct ebur128_dq_entry** last) {
+  size_t e, h, k;
+
+  *last = NULL;
+  if (!short_term) {
+    if (st->d->use_histogram) {
+      if (st->d->block_energy_histogram) {
+        memcpy(d->block_energy_histogram, st->d->block_energy_histogram,
+               sizeof(d->block_energy_histogram));
+        memcpy(d->block_energy_sums, st->d->block_energy_sums,
+               sizeof(d->block_energy_sums));
+      }
+      return EBUR128_SUCCESS;
+    }
+    return ebur128_digest_add_list(
+        d, NULL, &st->d->block_list, st->d->block_file,
+        st->d->block_list_size,
+        ebur128_history_blocks(st->d->block_file, st->d->block_list_size,
+                               st->d->block_list_max),
+        last, 0);
+  }
+
+  if (st->d->st_sketch_epochs) {
+    for (e = 0; e < st->d->st_sketch_epochs; ++e) {
+      struct ebur128_sketch* s = st->d->st_sketch[e];
+      for (h = 0; h < s->levels; ++h) {
+        for (k = 0; k < s->size[h]; ++k) {
+          d->short_term_block_energy_histogram[find_histogram_index(
+              s->items[h][k])] += 1UL << h;
+        }
+      }
+    }
+    return EBUR128_SUCCESS;
+  }
+  if (st->d->use_histogram) {
+    if (st->d->short_term_block_energy_histogram) {
+      memcpy(d->short_term_block_energy_histogram,
+             st->d->short_term_block_energy_histogram,
+             sizeof(d->short_term_block_energy_histogram));
+    }
+    return EBUR128_SUCCESS;
+  }
+  return ebur128_digest_add_list(
+      d, NULL, &st->d->short_term_block_list, st->d->st_block_file,
+      st->d->st_block_list_size,
+      ebur128_history_blocks(st->d->st_block_file, st->d->st_block_list_size,
+                             st->d->st_block_list_max),
+      last, 1);
+}
+
+ebur128_digest* ebur128_digest_create(ebur128_state* st) {
+  ebur128_digest* d;
+  struct ebur128_dq_entry* last = NULL;
+  unsigned int c;
+
+  ebur128_init_constants(1);
+  d = (ebur128_digest*) calloc(1, sizeof(ebur128_digest));
+  if (!d) {
+    return NULL;
+  }
+
+  if ((st->mode & EBUR128_MODE_I) == EBUR128_MODE_I &&
+      ebur128_digest_fill(d, st, 0, &last)) {
+    goto free_digest;
+  }
+  if ((st->mode & EBUR128_MODE_LRA) == EBUR128_MODE_LRA &&
+      ebur128_digest_fill(d, st, 1, &last)) {
+    goto free_digest;
+  }
+
+  for (c = 0; c < st->channels; ++c) {
+    if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) == EBUR128_MODE_SAMPLE_PEAK) {
+      d->sample_peak = EBUR128_MAX(d->sample_peak, st->d->sample_peak[c]);
+    }
+    if ((st->mode & EBUR128_MODE_TRUE_PEAK) == EBUR128_MODE_TRUE_PEAK) {
+      d->true_peak = EBUR128_MAX(d->true_peak, st->d->true_peak[c]);
+      d->true_peak = EBUR128_MAX(d->true_peak, st->d->sample_peak[c]);
+    }
+  }
+  return d;
+
+free_digest:
+  free(d);
+  return NULL;
+}
+
+void ebur128_digest_destroy(ebur128_digest** digest) {
+  free(*digest);
+  *digest = NULL;
+}
+
+int ebur128_digest_merge(ebur128_digest* digest, const ebur128_digest* other) {
+  size_t i;
+
+  for (i = 0; i < 1000; ++i) {
+    double* bin = digest->block_energy_sums + 3 * i;
+    const double* other_bin = other->block_energy_sums + 3 * i;
+    if (other->block_energy_histogram[i]) {
+      if (!digest->block_energy_histogram[i]) {
+        bin[1] = other_bin[1];
+        bin[2] = other_bin[2];
+      }
+      bin[0] += other_bin[0];
+      bin[1] = EBUR128_MIN(bin[1], other_bin[1]);
+      bin[2] = EBUR128_MAX(bin[2], other_bin[2]);
+      digest->block_energy_histogram[i] += other->block_energy_histogram[i];
+    }
+    digest->short_term_block_energy_histogram[i] +=
+        other->short_term_block_energy_histogram[i];
+  }
+  digest->sample_peak = EBUR128_MAX(digest->sample_peak, other->sample_peak);
+  digest->true_peak = EBUR128_MAX(digest->true_peak, other->true_peak);
+  return EBUR128_SUCCESS;
+}
+
+/* Little endian integers of "bytes" bytes, and doubles as 8 byte integers. */
+static unsigned char*
+ebur128_put_uint(unsigned char* p, uint64_t value, size_t bytes) {
+  size_t i;
+  for (i = 0; i < bytes; ++i) {
+    p[i] = (unsigned char) (value >> (8 * i));
+  }
+  return p + bytes;
+}
+
+static unsigned char* ebur128_put_double(unsigned char* p, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return ebur128_put_uint(p, bits, 8);
+}
+
+static uint64_t ebur128_get_uint(const unsigned char* p, size_t bytes) {
+  uint64_t value = 0;
+  size_t i;
+  for (i = 0; i < bytes; ++i) {
+    value |= (uint64_t) p[i] << (8 * i);
+  }
+  return value;
+}
+
+static double ebur128_get_double(const unsigned char* p) {
+  uint64_t bits = ebur128_get_uint(p, 8);
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+size_t ebur128_digest_serialized_size(const ebur128_digest* digest) {
+  size_t size = DIGEST_HEADER_SIZE + 2 * 4;
+  size_t i;
+
+  for (i = 0; i < 1000; ++i) {
+    if (digest->block_energy_histogram[i]) {
+      size += DIGEST_BLOCK_BIN_SIZE;
+    }
+    if (digest->short_term_block_energy_histogram[i]) {
+      size += DIGEST_ST_BIN_SIZE;
+    }
+  }
+  return size;
+}
+
+/* The layout is little endian: magic, version (4 bytes), sample and true
+ * peak, then the number of used block bins (4 bytes) and for each its index
+ * (2 bytes), count, sum, minimum and maximum, and finally the number of used
+ * short-term bins and for each its index and count. */
+size_t ebur128_digest_serialize(const ebur128_digest* digest,
+                                unsigned char* buffer) {
+  unsigned char* p = buffer;
+  unsigned char* count;
+  size_t i, bins;
+
+  memcpy(p, DIGEST_MAGIC, 4);
+  p = ebur128_put_uint(p + 4, DIGEST_VERSION, 4);
+  p = ebur128_put_double(p, digest->sample_peak);
+  p = ebur128_put_double(p, digest->true_peak);
+
+  count = p;
+  p += 4;
+  for (i = 0, bins = 0; i < 1000; ++i) {
+    if (digest->block_energy_histogram[i]) {
+      p = ebur128_put_uint(p, i, 2);
+      p = ebur128_put_uint(p, digest->block_energy_histogram[i], 8);
+      p = ebur128_put_double(p, digest->block_energy_sums[3 * i]);
+      p = ebur128_put_double(p, digest->block_energy_sums[3 * i + 1]);
+      p = ebur128_put_double(p, digest->block_energy_sums[3 * i + 2]);
+      ++bins;
+    }
+  }
+  ebur128_put_uint(count, bins, 4);
+
+  count = p;
+  p += 4;
+  for (i = 0, bins = 0; i < 1000; ++i) {
+    if (digest->short_term_block_energy_histogram[i]) {
+      p = ebur128_put_uint(p, i, 2);
+      p = ebur128_put_uint(p, digest->short_term_block_energy_histogram[i], 8);
+      ++bins;
+    }
+  }
+  ebur128_put_uint(count, bins, 4);
+  return (size_t) (p - buffer);
+}
+
+ebur128_digest* ebur128_digest_deserialize(const unsigned char* buffer,
+                                           size_t size) {
+  const unsigned char* p = buffer;
+  const unsigned char* end = buffer + size;
+  ebur128_digest* d;
+  uint64_t bins, count;
+  size_t i, index;
+
+  if (size < DIGEST_HEADER_SIZE + 4 || memcmp(p, DIGEST_MAGIC, 4) != 0 ||
+      ebur128_get_uint(p + 4, 4) != DIGEST_VERSION) {
+    return NULL;
+  }
+  ebur128_init_constants(1);
+  d = (ebur128_digest*) calloc(1, sizeof(ebur128_digest));
+  if (!d) {
+    return NULL;
+  }
+  d->sample_peak = ebur128_get_double(p + 8);
+  d->true_peak = ebur128_get_double(p + 16);
+  p += DIGEST_HEADER_SIZE;
+
+  bins = ebur128_get_uint(p, 4);
+  p += 4;
+  if (bins > (uint64_t) (end - p) / DIGEST_BLOCK_BIN_SIZE) {
+    goto free_digest;
+  }
+  for (i = 0; i < bins; ++i) {
+    index = (size_t) ebur128_get_uint(p, 2);
+    count = ebur128_get_uint(p + 2, 8);
+    if (index >= 1000 || !count || count > ULONG_MAX ||
+        d->block_energy_histogram[index]) {
+      goto free_digest;
+    }
+    d->block_energy_histogram[index] = (unsigned long) count;
+    d->block_energy_sums[3 * index] = ebur128_get_double(p + 10);
+    d->block_energy_sums[3 * index + 1] = ebur128_get_double(p + 18);
+    d->block_energy_sums[3 * index + 2] = ebur128_get_double(p + 26);
+    p += DIGEST_BLOCK_BIN_SIZE;
+  }
+
+  if (end - p < 4) {
+    goto free_digest;
+  }
+  bins = ebur128_get_uint(p, 4);
+  p += 4;
+  if (bins > (uint64_t) (end - p) / DIGEST_ST_BIN_SIZE) {
+    goto free_digest;
+  }
+  for (i = 0; i < bins; ++i) {
+    index = (size_t) ebur128_get_uint(p, 2);
+    count = ebur128_get_uint(p + 2, 8);
+    if (index >= 1000 || !count || count > ULONG_MAX ||
+        d->short_term_block_energy_histogram[index]) {
+      goto free_digest;
+    }
+    d->short_term_block_energy_histogram[index] = (unsigned long) count;
+    p += DIGEST_ST_BIN_SIZE;
+  }
+  return d;
+
+free_digest:
+  free(d);
+  return NULL;
+}
+
+int ebur128_digest_loudness_global_multiple(ebur128_digest** digests,
+                                            size_t size,
+                                            double* out) {
+  double gated_loudness = 0.0;
+  double relative_threshold = 0.0;
+  size_t above_thresh_counter = 0;
+  size_t i, j;
+
+  for (i = 0; i < size; ++i) {
+    for (j = 0; digests[i] && j < 1000; ++j) {
+      relative_threshold += digests[i]->block_energy_sums[3 * j];
+      above_thresh_counter += digests[i]->block_energy_histogram[j];
+    }
+  }
+  if (!above_thresh_counter) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+
+  relative_threshold /= (double) above_thresh_counter;
+  relative_threshold *= relative_gate_factor;
+
+  above_thresh_counter = 0;
+  for (i = 0; i < size; ++i) {
+    if (digests[i]) {
+      ebur128_gate_histogram(digests[i]->block_energy_histogram,
+                             digests[i]->block_energy_sums, relative_threshold,
+                             &gated_loudness, &above_thresh_counter);
+    }
+  }
+  if (!above_thresh_counter) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
+  }
+  gated_loudness /= (double) above_thresh_counter;
+  *out = ebur128_energy_to_loudness(gated_loudness);
   return EBUR128_SUCCESS;
 }
 
-int ebur128_loudness_shortterm(ebur128_state* st, double* out) {
-  double energy;
-  int error;
+int ebur128_digest_loudness_range_multiple(ebur128_digest** digests,
+                                           size_t size,
+                                           double* out) {
+  unsigned long hist[1000] = { 0 };
+  double low, high;
+  size_t i, j;
 
-  error = ebur128_energy_shortterm(st, &energy);
-  if (error) {
-    return error;
+  for (i = 0; i < size; ++i) {
+    for (j = 0; digests[i] && j < 1000; ++j) {
+      hist[j] += digests[i]->short_term_block_energy_histogram[j];
+    }
   }
+  ebur128_histogram_loudness_range(hist, out, &low, &high);
+  return EBUR128_SUCCESS;
+}
 
-  if (energy <= 0.0) {
-    *out = -HUGE_VAL;
-    return EBUR128_SUCCESS;
-  }
+int ebur128_digest_sample_peak(const ebur128_digest* digest, double* out) {
+  *out = digest->sample_peak;
+  return EBUR128_SUCCESS;
+}
 
-  *out = ebur128_energy_to_loudness(energy);
+int ebur128_digest_true_peak(const ebur128_digest* digest, double* out) {
+  *out = digest->true_peak;
   return EBUR128_SUCCESS;
 }
 
-int ebur128_loudness_window(ebur128_state* st,
-                            unsigned long window,
-                            double* out) {
-  double energy;
-  size_t interval_frames;
-  int error;
+/** What an aggregator has read of one history of a state. */
+struct ebur128_aggregator_history {
+  /** Set once the digest of the state holds the history. */
+  int valid;
+  /** blocks_added (or st_blocks_added) and history_changes of the state
+   *  when it was read. */
+  unsigned long long blocks;
+  unsigned long long changes;
+  /** Newest block read from the list. */
+  struct ebur128_dq_entry* last;
+};
 
-  if (window > st->d->window) {
-    return EBUR128_ERROR_INVALID_MODE;
-  }
+struct ebur128_aggregator {
+  ebur128_state** states;
+  size_t size;
+  /** Digest of each state, and of all of them. */
+  ebur128_digest* digests;
+  ebur128_digest total;
+  /** Set if "total" has to be merged again from the digests. */
+  int stale;
+  /** Two per state, for the blocks and the short-term blocks. */
+  struct ebur128_aggregator_history* histories;
+};
 
-  interval_frames = st->samplerate * window / 1000;
-  error = ebur128_energy_in_interval(st, interval_frames, &energy);
-  if (error) {
-    return error;
-  }
+ebur128_aggregator* ebur128_aggregator_create(ebur128_state** sts,
+                                              size_t size) {
+  ebur128_aggregator* agg;
 
-  if (energy <= 0.0) {
-    *out = -HUGE_VAL;
-    return EBUR128_SUCCESS;
+  ebur128_init_constants(1);
+  agg = (ebur128_aggregator*) calloc(1, sizeof(ebur128_aggregator));
+  if (!agg) {
+    return NULL;
   }
-
-  *out = ebur128_energy_to_loudness(energy);
-  return EBUR128_SUCCESS;
+  agg->size = size;
+  agg->stale = 1;
+  /* one element more, so that nothing is allocated with size 0 */
+  agg->states = (ebur128_state**) malloc((size + 1) * sizeof(ebur128_state*));
+  agg->digests = (ebur128_digest*) calloc(size + 1, sizeof(ebur128_digest));
+  agg->histories = (struct ebur128_aggregator_history*) calloc(
+      2 * size + 1, sizeof(struct ebur128_aggregator_history));
+  if (!agg->states || !agg->digests || !agg->histories) {
+    ebur128_aggregator_destroy(&agg);
+    return NULL;
+  }
+  if (size) {
+    memcpy(agg->states, sts, size * sizeof(ebur128_state*));
+  }
+  return agg;
 }
 
-static int ebur128_double_cmp(const void* p1, const void* p2) {
-  const double* d1 = (const double*) p1;
-  const double* d2 = (const double*) p2;
-  return (*d1 > *d2) - (*d1 < *d2);
+void ebur128_aggregator_destroy(ebur128_aggregator** agg) {
+  if (!*agg) {
+    return;
+  }
+  free((*agg)->states);
+  free((*agg)->digests);
+  free((*agg)->histories);
+  free(*agg);
+  *agg = NULL;
 }
 
-/* EBU - TECH 3342 */
-int ebur128_loudness_range_multiple(ebur128_state** sts,
-                                    size_t size,
-                                    double* out) {
-  size_t i, j;
-  struct ebur128_dq_entry* it;
-  double* stl_vector;
-  size_t stl_size;
-  double* stl_relgated;
-  size_t stl_relgated_size;
-  double stl_power, stl_integrated;
-  /* High and low percentile energy */
-  double h_en, l_en;
-  int use_histogram = 0;
+/* Bring the digest of state "i" up to date with its blocks, or with its
+ * short-term blocks. New blocks in a list or block file are added to the
+ * digest and to the total. Otherwise the digest is filled again, and
+ * "*rebuilt" is set as the total has to be merged again. */
+static int ebur128_aggregator_update(ebur128_aggregator* agg,
+                                     size_t i,
+                                     int short_term,
+                                     int* rebuilt) {
+  ebur128_state* st = agg->states[i];
+  ebur128_digest* d = agg->digests + i;
+  struct ebur128_aggregator_history* h = agg->histories + 2 * i + short_term;
+  unsigned long long added =
+      short_term ? st->d->st_blocks_added : st->d->blocks_added;
+  int errcode;
 
-  for (i = 0; i < size; ++i) {
-    if (sts[i]) {
-      if ((sts[i]->mode & EBUR128_MODE_LRA) != EBUR128_MODE_LRA) {
-        return EBUR128_ERROR_INVALID_MODE;
-      }
-      if (i == 0 && sts[i]->mode & EBUR128_MODE_HISTOGRAM) {
-        use_histogram = 1;
-      } else if (use_histogram != !!(sts[i]->mode & EBUR128_MODE_HISTOGRAM)) {
-        return EBUR128_ERROR_INVALID_MODE;
-      }
+  if (h->valid && h->changes == st->d->history_changes && h->blocks == added) {
+    return EBUR128_SUCCESS;
+  }
+  if (h->valid && h->changes == st->d->history_changes &&
+      !st->d->use_histogram && !(short_term && st->d->st_sketch_epochs)) {
+    /* the history only grew since it was read */
+    if (short_term) {
+      errcode = ebur128_digest_add_list(
+          d, &agg->total, &st->d->short_term_block_list, st->d->st_block_file,
+          st->d->st_block_list_size, (size_t) (added - h->blocks), &h->last,
+          1);
+    } else {
+      errcode = ebur128_digest_add_list(
+          d, &agg->total, &st->d->block_list, st->d->block_file,
+          st->d->block_list_size, (size_t) (added - h->blocks), &h->last, 0);
+    }
+  } else {
+    if (short_term) {
+      memset(d->short_term_block_energy_histogram, 0,
+             sizeof(d->short_term_block_energy_histogram));
+    } else {
+      memset(d->block_energy_histogram, 0, sizeof(d->block_energy_histogram));
+      memset(d->block_energy_sums, 0, sizeof(d->block_energy_sums));
     }
+    errcode = ebur128_digest_fill(d, st, short_term, &h->last);
+    *rebuilt = 1;
   }
+  /* a failed update may have added some of the blocks */
+  h->valid = !errcode;
+  h->blocks = added;
+  h->changes = st->d->history_changes;
+  return errcode;
+}
 
-  if (use_histogram) {
-    unsigned long hist[1000] = { 0 };
-    size_t percentile_low, percentile_high;
-    size_t index;
+/* Bring the digests of all states and their total up to date with the
+ * blocks, or with the short-term blocks. */
+static int ebur128_aggregator_refresh(ebur128_aggregator* agg,
+                                      int short_term) {
+  int rebuilt = agg->stale;
+  int errcode = EBUR128_SUCCESS;
+  size_t i;
 
-    stl_size = 0;
-    stl_power = 0.0;
-    for (i = 0; i < size; ++i) {
-      if (!sts[i]) {
-        continue;
-      }
-      for (j = 0; j < 1000; ++j) {
-        hist[j] += sts[i]->d->short_term_block_energy_histogram[j];
-        stl_size += sts[i]->d->short_term_block_energy_histogram[j];
-        stl_power += sts[i]->d->short_term_block_energy_histogram[j] *
-                     histogram_energies[j];
-      }
+  for (i = 0; i < agg->size && !errcode; ++i) {
+    if (agg->states[i]) {
+      errcode = ebur128_aggregator_update(agg, i, short_term, &rebuilt);
     }
-    if (!stl_size) {
-      *out = 0.0;
-      return EBUR128_SUCCESS;
+  }
+  if (errcode) {
+    agg->stale = 1;
+    return errcode;
+  }
+  if (rebuilt) {
+    memset(&agg->total, 0, sizeof(agg->total));
+    for (i = 0; i < agg->size; ++i) {
+      ebur128_digest_merge(&agg->total, agg->digests + i);
     }
+    agg->stale = 0;
+  }
+  return EBUR128_SUCCESS;
+}
 
-    stl_power /= stl_size;
-    stl_integrated = minus_twenty_decibels * stl_power;
+int ebur128_aggregator_loudness_global(ebur128_aggregator* agg, double* out) {
+  ebur128_digest* total = &agg->total;
+  size_t i;
+  int errcode;
 
-    if (stl_integrated < histogram_energy_boundaries[0]) {
-      index = 0;
-    } else {
-      index = find_histogram_index(stl_integrated);
-      if (stl_integrated > histogram_energies[index]) {
-        ++index;
-      }
-    }
-    stl_size = 0;
-    for (j = index; j < 1000; ++j) {
-      stl_size += hist[j];
-    }
-    if (!stl_size) {
-      *out = 0.0;
-      return EBUR128_SUCCESS;
+  for (i = 0; i < agg->size; ++i) {
+    if (agg->states[i] &&
+        (agg->states[i]->mode & EBUR128_MODE_I) != EBUR128_MODE_I) {
+      return EBUR128_ERROR_INVALID_MODE;
     }
+  }
+  errcode = ebur128_aggregator_refresh(agg, 0);
+  if (errcode) {
+    return errcode;
+  }
+  return ebur128_digest_loudness_global_multiple(&total, 1, out);
+}
 
-    percentile_low = (size_t) ((stl_size - 1) * 0.1 + 0.5);
-    percentile_high = (size_t) ((stl_size - 1) * 0.95 + 0.5);
+int ebur128_aggregator_loudness_range(ebur128_aggregator* agg, double* out) {
+  ebur128_digest* total = &agg->total;
+  size_t i;
+  int errcode;
 
-    stl_size = 0;
-    j = index;
-    while (stl_size <= percentile_low) {
-      stl_size += hist[j++];
-    }
-    l_en = histogram_energies[j - 1];
-    while (stl_size <= percentile_high) {
-      stl_size += hist[j++];
+  for (i = 0; i < agg->size; ++i) {
+    if (agg->states[i] &&
+        (agg->states[i]->mode & EBUR128_MODE_LRA) != EBUR128_MODE_LRA) {
+      return EBUR128_ERROR_INVALID_MODE;
     }
-    h_en = histogram_energies[j - 1];
-
-    *out = ebur128_energy_to_loudness(h_en) - ebur128_energy_to_loudness(l_en);
-    return EBUR128_SUCCESS;
   }
+  errcode = ebur128_aggregator_refresh(agg, 1);
+  if (errcode) {
+    return errcode;
+  }
+  return ebur128_digest_loudness_range_multiple(&total, 1, out);
+}
 
-  stl_size = 0;
-  for (i = 0; i < size; ++i) {
-    if (!sts[i]) {
-      continue;
-    }
-    STAILQ_FOREACH(it, &sts[i]->d->short_term_block_list, entries) {
-      ++stl_size;
-    }
+/** Decoded block log. The loudness fields hold block energies, the peak
+ *  fields amplitudes, "blocks" values each. Fields that were not recorded
+ *  are NULL. */
+struct ebur128_block_log {
+  size_t blocks;
+  double* values[BLOCK_LOG_FIELDS];
+};
+
+static unsigned char* ebur128_read_file(const char* path, size_t* size) {
+  FILE* file;
+  unsigned char* data = NULL;
+  long length;
+
+  file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
   }
-  if (!stl_size) {
-    *out = 0.0;
-    return EBUR128_SUCCESS;
+  if (fseek(file, 0, SEEK_END) || (length = ftell(file)) < 0 ||
+      fseek(file, 0, SEEK_SET)) {
+    goto close_file;
   }
-  stl_vector = (double*) malloc(stl_size * sizeof(double));
-  if (!stl_vector) {
-    return EBUR128_ERROR_NOMEM;
+  data = (unsigned char*) malloc((size_t) length + 1);
+  if (data && fread(data, 1, (size_t) length, file) != (size_t) length) {
+    free(data);
+    data = NULL;
   }
+  *size = (size_t) length;
 
-  j = 0;
-  for (i = 0; i < size; ++i) {
-    if (!sts[i]) {
-      continue;
-    }
-    STAILQ_FOREACH(it, &sts[i]->d->short_term_block_list, entries) {
-      stl_vector[j] = it->z;
-      ++j;
-    }
+close_file:
+  fclose(file);
+  return data;
+}
+
+ebur128_block_log* ebur128_block_log_open(const char* path) {
+  ebur128_block_log* log = NULL;
+  unsigned char* data;
+  const unsigned char* p;
+  const unsigned char* end;
+  long steps[BLOCK_LOG_FIELDS] = { 0 };
+  long next[BLOCK_LOG_FIELDS];
+  unsigned long value;
+  unsigned int fields, shift;
+  size_t size, fields_count = 0, max_blocks;
+  int i;
+
+  data = ebur128_read_file(path, &size);
+  if (!data) {
+    return NULL;
   }
-  qsort(stl_vector, stl_size, sizeof(double), ebur128_double_cmp);
-  stl_power = 0.0;
-  for (i = 0; i < stl_size; ++i) {
-    stl_power += stl_vector[i];
+  if (size < BLOCK_LOG_HEADER_SIZE ||
+      memcmp(data, BLOCK_LOG_MAGIC, 4) != 0 ||
+      data[4] != BLOCK_LOG_VERSION) {
+    goto free_data;
   }
-  stl_power /= (double) stl_size;
-  stl_integrated = minus_twenty_decibels * stl_power;
+  fields = data[5];
+  if (!(fields & (1U << BLOCK_LOG_MOMENTARY)) || fields >> BLOCK_LOG_FIELDS) {
+    goto free_data;
+  }
+  ebur128_init_constants(0);
 
-  stl_relgated = stl_vector;
-  stl_relgated_size = stl_size;
-  while (stl_relgated_size > 0 && *stl_relgated < stl_integrated) {
-    ++stl_relgated;
-    --stl_relgated_size;
+  log = (ebur128_block_log*) calloc(1, sizeof(ebur128_block_log));
+  if (!log) {
+    goto free_data;
+  }
+  for (i = 0; i < BLOCK_LOG_FIELDS; ++i) {
+    fields_count += (fields >> i) & 1U;
+  }
+  /* every field takes at least one byte */
+  max_blocks = (size - BLOCK_LOG_HEADER_SIZE) / fields_count;
+  for (i = 0; i < BLOCK_LOG_FIELDS; ++i) {
+    if (fields & (1U << i)) {
+      log->values[i] = (double*) malloc((max_blocks + 1) * sizeof(double));
+      if (!log->values[i]) {
+        goto free_log;
+      }
+    }
   }
 
-  if (stl_relgated_size) {
-    h_en = stl_relgated[(size_t) ((stl_relgated_size - 1) * 0.95 + 0.5)];
-    l_en = stl_relgated[(size_t) ((stl_relgated_size - 1) * 0.1 + 0.5)];
-    free(stl_vector);
-    *out = ebur128_energy_to_loudness(h_en) - ebur128_energy_to_loudness(l_en);
-  } else {
-    free(stl_vector);
-    *out = 0.0;
+  /* a record cut off at the end of the file is ignored */
+  p = data + BLOCK_LOG_HEADER_SIZE;
+  end = data + size;
+  while (p < end) {
+    for (i = 0; i < BLOCK_LOG_FIELDS; ++i) {
+      if (!(fields & (1U << i))) {
+        continue;
+      }
+      value = 0;
+      shift = 0;
+      do {
+        if (p == end || shift > 21) {
+          goto done;
+        }
+        value |= (unsigned long) (*p & 0x7f) << shift;
+        shift += 7;
+      } while (*p++ & 0x80);
+      next[i] = steps[i] + ((value & 1) ? -(long) (value >> 1) - 1
+                                        : (long) (value >> 1));
+    }
+    for (i = 0; i < BLOCK_LOG_FIELDS; ++i) {
+      double level;
+      if (!(fields & (1U << i))) {
+        continue;
+      }
+      steps[i] = next[i];
+      level = (double) steps[i] / BLOCK_LOG_STEPS_PER_DB;
+      if (steps[i] <= BLOCK_LOG_SILENCE) {
+        log->values[i][log->blocks] = 0.0;
+      } else if (i == BLOCK_LOG_MOMENTARY || i == BLOCK_LOG_SHORTTERM) {
+        log->values[i][log->blocks] = pow(10.0, (level + 0.691) / 10.0);
+      } else {
+        log->values[i][log->blocks] = pow(10.0, level / 20.0);
+      }
+    }
+    ++log->blocks;
   }
 
-  return EBUR128_SUCCESS;
-}
+done:
+  free(data);
+  return log;
 
-int ebur128_loudness_range(ebur128_state* st, double* out) {
-  return ebur128_loudness_range_multiple(&st, 1, out);
+free_log:
+  ebur128_block_log_close(&log);
+free_data:
+  free(data);
+  return NULL;
 }
 
-int ebur128_sample_peak(ebur128_state* st,
-                        unsigned int channel_number,
-                        double* out) {
-  if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) != EBUR128_MODE_SAMPLE_PEAK) {
-    return EBUR128_ERROR_INVALID_MODE;
-  }
+void ebur128_block_log_close(ebur128_block_log** log) {
+  int i;
 
-  if (channel_number >= st->channels) {
-    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  if (!*log) {
+    return;
+  }
+  for (i = 0; i < BLOCK_LOG_FIELDS; ++i) {
+    free((*log)->values[i]);
   }
+  free(*log);
+  *log = NULL;
+}
 
-  *out = st->d->sample_peak[channel_number];
-  return EBUR128_SUCCESS;
+size_t ebur128_block_log_blocks(const ebur128_block_log* log) {
+  return log->blocks;
 }
 
-int ebur128_prev_sample_peak(ebur128_state* st,
-                             unsigned int channel_number,
-                             double* out) {
-  if ((st->mode & EBUR128_MODE_SAMPLE_PEAK) != EBUR128_MODE_SAMPLE_PEAK) {
+static int ebur128_block_log_value(const ebur128_block_log* log,
+                                   int field,
+                                   size_t index,
+                                   double* out) {
+  if (!log->values[field] || index >= log->blocks) {
     return EBUR128_ERROR_INVALID_MODE;
   }
+  *out = log->values[field][index];
+  return EBUR128_SUCCESS;
+}
 
-  if (channel_number >= st->channels) {
-    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+int ebur128_block_log_loudness_momentary(const ebur128_block_log* log,
+                                         size_t index,
+                                         double* out) {
+  double energy;
+  int errcode =
+      ebur128_block_log_value(log, BLOCK_LOG_MOMENTARY, index, &energy);
+  if (!errcode) {
+    *out = energy > 0.0 ? ebur128_energy_to_loudness(energy) : -HUGE_VAL;
   }
+  return errcode;
+}
 
-  *out = st->d->prev_sample_peak[channel_number];
-  return EBUR128_SUCCESS;
+int ebur128_block_log_loudness_shortterm(const ebur128_block_log* log,
+                                         size_t index,
+                                         double* out) {
+  double energy;
+  int errcode =
+      ebur128_block_log_value(log, BLOCK_LOG_SHORTTERM, index, &energy);
+  if (!errcode) {
+    *out = energy > 0.0 ? ebur128_energy_to_loudness(energy) : -HUGE_VAL;
+  }
+  return errcode;
 }
 
-int ebur128_true_peak(ebur128_state* st,
-                      unsigned int channel_number,
-                      double* out) {
-  if ((st->mode & EBUR128_MODE_TRUE_PEAK) != EBUR128_MODE_TRUE_PEAK) {
-    return EBUR128_ERROR_INVALID_MODE;
+int ebur128_block_log_sample_peak(const ebur128_block_log* log,
+                                  size_t index,
+                                  double* out) {
+  return ebur128_block_log_value(log, BLOCK_LOG_SAMPLE_PEAK, index, out);
+}
+
+int ebur128_block_log_true_peak(const ebur128_block_log* log,
+                                size_t index,
+                                double* out) {
+  return ebur128_block_log_value(log, BLOCK_LOG_TRUE_PEAK, index, out);
+}
+
+/* Number of blocks of the segment of "count" blocks from "first" that are in
+ * the log. */
+static size_t ebur128_block_log_segment(const ebur128_block_log* log,
+                                        size_t first,
+                                        size_t count) {
+  if (first >= log->blocks) {
+    return 0;
   }
+  return EBUR128_MIN(count, log->blocks - first);
+}
 
-  if (channel_number >= st->channels) {
-    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+int ebur128_block_log_loudness_global(const ebur128_block_log* log,
+                                      size_t first,
+                                      size_t count,
+                                      double* out) {
+  const double* z = log->values[BLOCK_LOG_MOMENTARY];
+  double gated_loudness = 0.0;
+  double relative_threshold = 0.0;
+  size_t above_thresh_counter = 0;
+  size_t i;
+
+  count = ebur128_block_log_segment(log, first, count);
+  for (i = first; i < first + count; ++i) {
+    if (z[i] >= histogram_energy_boundaries[0]) {
+      ++above_thresh_counter;
+      relative_threshold += z[i];
+    }
+  }
+  if (!above_thresh_counter) {
+    *out = -HUGE_VAL;
+    return EBUR128_SUCCESS;
   }
 
-  *out = EBUR128_MAX(st->d->true_peak[channel_number],
-                     st->d->sample_peak[channel_number]);
+  relative_threshold /= (double) above_thresh_counter;
+  relative_threshold *= relative_gate_factor;
+
+  above_thresh_counter = 0;
+  for (i = first; i < first + count; ++i) {
+    if (z[i] >= histogram_energy_boundaries[0] && z[i] >= relative_threshold) {
+      ++above_thresh_counter;
+      gated_loudness += z[i];
+    }
+  }
+  gated_loudness /= (double) above_thresh_counter;
+  *out = ebur128_energy_to_loudness(gated_loudness);
   return EBUR128_SUCCESS;
 }
 
-int ebur128_prev_true_peak(ebur128_state* st,
-                           unsigned int channel_number,
-                           double* out) {
-  if ((st->mode & EBUR128_MODE_TRUE_PEAK) != EBUR128_MODE_TRUE_PEAK) {
+int ebur128_block_log_loudness_range(const ebur128_block_log* log,
+                                     size_t first,
+                                     size_t count,
+                                     double* out) {
+  const double* z = log->values[BLOCK_LOG_SHORTTERM];
+  double* stl_vector;
+  size_t stl_size = 0;
+  double low, high;
+  size_t i;
+
+  if (!z) {
     return EBUR128_ERROR_INVALID_MODE;
   }
-
-  if (channel_number >= st->channels) {
-    return EBUR128_ERROR_INVALID_CHANNEL_INDEX;
+  count = ebur128_block_log_segment(log, first, count);
+  stl_vector = (double*) malloc((count / 10 + 1) * sizeof(double));
+  if (!stl_vector) {
+    return EBUR128_ERROR_NOMEM;
   }
-
-  *out = EBUR128_MAX(st->d->prev_true_peak[channel_number],
-                     st->d->prev_sample_peak[channel_number]);
+  /* A state takes a short-term block every second, starting 3s after it
+   * started, which is the 27th gating block. */
+  for (i = first + 26; i < first + count; i += 10) {
+    if (z[i] >= histogram_energy_boundaries[0]) {
+      stl_vector[stl_size++] = z[i];
+    }
+  }
+  ebur128_vector_loudness_range(stl_vector, stl_size, out, &low, &high);
+  free(stl_vector);
   return EBUR128_SUCCESS;
 }
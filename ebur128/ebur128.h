@@ -70,7 +70,8 @@ enum error {
   EBUR128_ERROR_NOMEM,
   EBUR128_ERROR_INVALID_MODE,
   EBUR128_ERROR_INVALID_CHANNEL_INDEX,
-  EBUR128_ERROR_NO_CHANGE
+  EBUR128_ERROR_NO_CHANGE,
+  EBUR128_ERROR_IO
 };
 
 /** \enum mode
@@ -90,8 +91,23 @@ enum mode {
   EBUR128_MODE_SAMPLE_PEAK = (1 << 4) | EBUR128_MODE_M,
   /** can call ebur128_true_peak */
   EBUR128_MODE_TRUE_PEAK = (1 << 5) | EBUR128_MODE_M | EBUR128_MODE_SAMPLE_PEAK,
-  /** uses histogram algorithm to calculate loudness */
-  EBUR128_MODE_HISTOGRAM = (1 << 6)
+  /** uses histogram algorithm to calculate loudness. The energies of the
+   *  blocks are summed per bin, so the integrated loudness equals the one
+   *  without histogram unless blocks within the 0.1 LU bin of the relative
+   *  gate lie on both sides of it. The loudness range uses the bin
+   *  centres. */
+  EBUR128_MODE_HISTOGRAM = (1 << 6),
+  /** uses integer arithmetic for filtering, true peak and block energies,
+   *  for targets with slow floating point math. Loudness values stay within
+   *  0.01 LU and peaks within 0.01 dB of the default engine. Input above
+   *  +12 dBFS is clipped. ebur128_filtered_frames() and
+   *  ebur128_set_filtered_callback() are not available. */
+  EBUR128_MODE_FIXED_POINT = (1 << 7),
+  /** keeps the short-term blocks for ebur128_loudness_range in a quantile
+   *  sketch of a few kilobytes instead of a list, see
+   *  ebur128_set_lra_sketch_epsilon(). Takes precedence over
+   *  EBUR128_MODE_HISTOGRAM for the loudness range. */
+  EBUR128_MODE_LRA_SKETCH = (1 << 8) | EBUR128_MODE_LRA
 };
 
 /** forward declaration of ebur128_state_internal */
@@ -108,6 +124,41 @@ typedef struct {
   struct ebur128_state_internal* d; /**< Internal state. */
 } ebur128_state;
 
+/** \brief Results of a measurement, filled in by ebur128_get_summary().
+ *
+ *  Members that are not covered by "mode" are not written.
+ */
+typedef struct {
+  int mode;                   /**< Modes set in all summarized states. */
+  double loudness_global;     /**< Integrated loudness in LUFS. */
+  double relative_threshold;  /**< Relative threshold in LUFS. */
+  double loudness_range;      /**< Loudness range (LRA) in LU. */
+  double loudness_range_low;  /**< Low percentile of the LRA in LUFS. */
+  double loudness_range_high; /**< High percentile of the LRA in LUFS. */
+  double sample_peak;         /**< Maximum sample peak of all channels. */
+  double true_peak;           /**< Maximum true peak of all channels. */
+  /** Optional array set by the caller, receives the maximum sample peak of
+   *  each channel. Must hold as many elements as the widest state has
+   *  channels. May be NULL. */
+  double* channel_sample_peak;
+  /** Optional array set by the caller, receives the maximum true peak of
+   *  each channel. Must hold as many elements as the widest state has
+   *  channels. May be NULL. */
+  double* channel_true_peak;
+} ebur128_summary;
+
+/** \brief Receives K-weighted audio, see ebur128_set_filtered_callback().
+ *
+ *  @param user_data pointer passed to ebur128_set_filtered_callback().
+ *  @param frames interleaved K-weighted frames. Only valid during the call.
+ *  @param frames_count number of frames.
+ *  @param channels number of channels.
+ */
+typedef void (*ebur128_filtered_callback)(void* user_data,
+                                          const double* frames,
+                                          size_t frames_count,
+                                          unsigned int channels);
+
 /** \brief Get library version number. Do not pass null pointers here.
  *
  *  @param major major version number of library
@@ -117,6 +168,9 @@ typedef struct {
 void ebur128_get_version(int* major, int* minor, int* patch);
 
 /** \brief Initialize library state.
+ *
+ *  The audio buffers and the histograms are allocated when the first frames
+ *  and gating blocks arrive, so a state that never sees audio stays small.
  *
  *  @param channels the number of channels.
  *  @param samplerate the sample rate.
@@ -174,7 +228,14 @@ int ebur128_change_parameters(ebur128_state* st,
 /** \brief Set the maximum window duration.
  *
  *  Set the maximum duration that will be used for ebur128_loudness_window().
- *  Note that this destroys the current content of the audio buffer.
+ *  Note that this destroys the current content of the audio buffer. If the
+ *  buffer is not allocated yet (see ebur128_hibernate()), the next
+ *  ebur128_add_frames_* call allocates it with the new size.
+ *
+ *  Where the mirror of the audio buffer (see ebur128_filtered_frames()) is a
+ *  second mapping of its memory, as on Linux, the buffer is rounded up to
+ *  whole pages rather than to a multiple of 100ms, so it may hold somewhat
+ *  more than the window.
  *
  *  @param st library state.
  *  @param window duration of the window in ms.
@@ -186,6 +247,28 @@ int ebur128_change_parameters(ebur128_state* st,
  */
 int ebur128_set_max_window(ebur128_state* st, unsigned long window);
 
+/** \brief Release the DSP buffers of an idle state.
+ *
+ *  Frees the buffers that can be recreated: the audio buffer, the filter
+ *  input of EBUR128_MODE_FIXED_POINT and the true peak interpolator. The
+ *  measurement results (gating blocks, histograms, peaks, the overview and
+ *  the block files or log) are kept, and so are the settings of the state.
+ *
+ *  The buffers are reallocated by the next ebur128_add_frames_* call, which
+ *  continues the measurement after a gap: as with
+ *  ebur128_change_parameters(), the current unfinished block is lost and
+ *  the filters restart from silence. Until then, the momentary and
+ *  short-term loudness and ebur128_loudness_window() are those of silence.
+ *
+ *  @param st library state.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NO_CHANGE if the state is already hibernating. A new
+ *      state allocates its DSP buffers with its first frames, so it starts
+ *      out hibernating.
+ */
+int ebur128_hibernate(ebur128_state* st);
+
 /** \brief Set the maximum history.
  *
  *  Set the maximum history that will be stored for loudness integration.
@@ -205,6 +288,211 @@ int ebur128_set_max_window(ebur128_state* st, unsigned long window);
  */
 int ebur128_set_max_history(ebur128_state* st, unsigned long history);
 
+/** \brief Set the rank error of the loudness range sketch.
+ *
+ *  With EBUR128_MODE_LRA_SKETCH, the percentiles of ebur128_loudness_range()
+ *  are off by at most about "epsilon" times the number of short-term blocks
+ *  in rank, while the memory stays at about 3 * 2 / epsilon energies per
+ *  history epoch. The relative gate is exact. Sketches of several states are
+ *  merged by ebur128_loudness_range_multiple().
+ *
+ *  The history of ebur128_set_max_history() is kept in 8 epochs and moves in
+ *  steps of one epoch, an eighth of the history.
+ *
+ *  Default is 0.005. A new epsilon applies to blocks compacted from then on.
+ *
+ *  @param st library state.
+ *  @param epsilon rank error, between 0 and 1.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_LRA_SKETCH" has not
+ *      been set or epsilon is out of range.
+ *    - EBUR128_ERROR_NO_CHANGE if epsilon not changed.
+ */
+int ebur128_set_lra_sketch_epsilon(ebur128_state* st, double epsilon);
+
+/** \brief Keep the block history in files instead of memory.
+ *
+ *  Without EBUR128_MODE_HISTOGRAM, every 100ms block and every short-term
+ *  block is kept in memory for ebur128_loudness_global() and
+ *  ebur128_loudness_range(). With block files, only the newest blocks stay in
+ *  memory and older ones are appended to the given files. The files are
+ *  mapped into memory while calculating results, so memory usage stays
+ *  constant for long measurements while the results remain exact. Blocks
+ *  that have already left the history set by ebur128_set_max_history() are
+ *  not written.
+ *
+ *  ebur128_loudness_range() still copies the short-term blocks above the
+ *  absolute gate into a temporary array to sort them, 16 bytes per second of
+ *  audio, so only ebur128_loudness_global() runs in constant memory.
+ *
+ *  The files are created or truncated. They are closed, but not removed, by
+ *  ebur128_destroy(). Block files can only be set once per state.
+ *
+ *  @param st library state.
+ *  @param block_file path of the file for the 100ms blocks, or NULL.
+ *  @param short_term_block_file path of the file for the short-term blocks,
+ *         or NULL.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_IO if a file could not be opened or written.
+ *    - EBUR128_ERROR_INVALID_MODE if "EBUR128_MODE_HISTOGRAM" has been set,
+ *      block files have already been set, or a short-term block file is
+ *      requested with "EBUR128_MODE_LRA_SKETCH".
+ *    - EBUR128_ERROR_NO_CHANGE if both paths are NULL.
+ */
+int ebur128_set_block_files(ebur128_state* st,
+                            const char* block_file,
+                            const char* short_term_block_file);
+
+/** \brief Set the step of the maximum momentary and short-term loudness.
+ *
+ *  Enables tracking of the maximum momentary and short-term loudness while
+ *  frames are added, see ebur128_loudness_momentary_max() and
+ *  ebur128_loudness_shortterm_max(). Both are evaluated every "step" ms,
+ *  independent of the size of the buffers passed to add_frames().
+ *
+ *  The step has to divide 100ms evenly and the number of samples in 100ms
+ *  evenly, for example 100ms or 10ms for 48000 Hz. If a later call to
+ *  ebur128_change_parameters() sets a sample rate that does not allow the
+ *  step, it falls back to 100ms.
+ *
+ *  Default is 0 (disabled).
+ *
+ *  @param st library state.
+ *  @param step step in ms, or 0 to disable tracking.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ *    - EBUR128_ERROR_INVALID_MODE if the step is not supported.
+ *    - EBUR128_ERROR_NO_CHANGE if step not changed.
+ */
+int ebur128_set_max_loudness_step(ebur128_state* st, unsigned long step);
+
+/** \brief Set the length of the sliding sample peak window.
+ *
+ *  Enables tracking of the maximum sample peak of each channel over the most
+ *  recent "window" ms, see ebur128_sample_peak_window(). Peaks are recorded
+ *  per 100ms segment, so the window is rounded up to a multiple of 100ms and
+ *  covers the current, partly filled segment and the complete segments
+ *  before it. The window restarts on ebur128_change_parameters().
+ *
+ *  Default is 0 (disabled).
+ *
+ *  @param st library state.
+ *  @param window window length in ms, or 0 to disable tracking.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_SAMPLE_PEAK" has not
+ *      been set.
+ *    - EBUR128_ERROR_NO_CHANGE if window not changed.
+ */
+int ebur128_set_sample_peak_window(ebur128_state* st, unsigned long window);
+
+/** \brief Set the length of the sliding true peak window.
+ *
+ *  Same as ebur128_set_sample_peak_window() for the true peak, see
+ *  ebur128_true_peak_window().
+ *
+ *  @param st library state.
+ *  @param window window length in ms, or 0 to disable tracking.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_TRUE_PEAK" has not
+ *      been set.
+ *    - EBUR128_ERROR_NO_CHANGE if window not changed.
+ */
+int ebur128_set_true_peak_window(ebur128_state* st, unsigned long window);
+
+/** \brief Generate a waveform overview while frames are added.
+ *
+ *  For every "frames_per_bucket" frames, the minimum, maximum and RMS of
+ *  each channel are written to "buffer", in float format (1.0 is 0 dBFS).
+ *  They are computed in the same scan of the input as the sample peak, so a
+ *  waveform display needs no second pass over the audio. The values of
+ *  bucket "b" and channel "c" are at buffer[(b * channels + c) * 3] (min),
+ *  [... + 1] (max) and [... + 2] (RMS). Buckets beyond "buckets" are not
+ *  written.
+ *
+ *  The overview starts with the next frame that is added. The buffer has to
+ *  stay valid until the overview is stopped or the state is destroyed.
+ *  ebur128_change_parameters() stops the overview.
+ *
+ *  @param st library state.
+ *  @param frames_per_bucket number of frames summarised in one bucket.
+ *  @param buffer buffer of at least buckets * channels * 3 floats. NULL, or
+ *                a "frames_per_bucket" or "buckets" of 0, stops the overview.
+ *  @param buckets number of buckets that fit in buffer.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ */
+int ebur128_set_overview(ebur128_state* st,
+                         unsigned long frames_per_bucket,
+                         float* buffer,
+                         size_t buckets);
+
+/** \brief Get the number of overview buckets written so far.
+ *
+ *  Also writes the bucket that is currently being filled, summarising the
+ *  frames added to it so far. It is rewritten as more frames are added.
+ *
+ *  @param st library state.
+ *  @param out number of buckets written to the buffer, including a partially
+ *             filled last bucket.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if no overview has been set.
+ */
+int ebur128_overview_buckets(ebur128_state* st, size_t* out);
+
+/** \brief Record every gating block in a binary log.
+ *
+ *  For every 100ms gating block, a record of its momentary loudness, the
+ *  short-term loudness (with "EBUR128_MODE_S") and the sample and true peak
+ *  across all channels of its newest 100ms (with "EBUR128_MODE_SAMPLE_PEAK"
+ *  and "EBUR128_MODE_TRUE_PEAK") is appended to the file. Levels are stored
+ *  with a resolution of 0.001 dB as differences to the previous block, so a
+ *  record takes a few bytes. The log can be read with
+ *  ebur128_block_log_open() to compute the loudness of the whole measurement
+ *  or of any part of it without decoding the audio again.
+ *
+ *  The file is created or truncated, and the log starts with the next gating
+ *  block. It is closed by ebur128_destroy() or by setting another log.
+ *
+ *  @param st library state.
+ *  @param path path of the log file, or NULL to stop logging.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ *    - EBUR128_ERROR_IO if the file could not be opened or written.
+ *    - EBUR128_ERROR_NO_CHANGE if "path" is NULL and no log is set.
+ */
+int ebur128_set_block_log(ebur128_state* st, const char* path);
+
+/** \brief Set the number of threads used to filter the audio.
+ *
+ *  With more than one thread, the channels of each chunk passed to the
+ *  add_frames() functions are split into groups of at least 8 channels.
+ *  The groups are filtered and scanned for peaks in parallel by worker
+ *  threads owned by the state, together with the calling thread. Only worth
+ *  it for streams with many channels. The results are the same as with one
+ *  thread.
+ *
+ *  Default is 1 (no worker threads).
+ *
+ *  @param st library state.
+ *  @param threads number of threads including the calling thread.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM if the threads could not be created.
+ *    - EBUR128_ERROR_NO_CHANGE if the number of threads did not change.
+ */
+int ebur128_set_threads(ebur128_state* st, unsigned int threads);
+
 /** \brief Add frames to be processed.
  *
  *  @param st library state.
@@ -213,6 +501,7 @@ int ebur128_set_max_history(ebur128_state* st, unsigned long history);
  *  @return
  *    - EBUR128_SUCCESS on success.
  *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ *    - EBUR128_ERROR_IO if a block file could not be written.
  */
 int ebur128_add_frames_short(ebur128_state* st,
                              const short* src,
@@ -236,6 +525,7 @@ int ebur128_add_frames_double(ebur128_state* st,
  *  @return
  *    - EBUR128_SUCCESS on success.
  *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_I" has not been set.
+ *    - EBUR128_ERROR_IO if a block file could not be read.
  */
 int ebur128_loudness_global(ebur128_state* st, double* out);
 /** \brief Get global integrated loudness in LUFS across multiple instances.
@@ -247,10 +537,34 @@ int ebur128_loudness_global(ebur128_state* st, double* out);
  *  @return
  *    - EBUR128_SUCCESS on success.
  *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_I" has not been set.
+ *    - EBUR128_ERROR_IO if a block file could not be read.
  */
 int ebur128_loudness_global_multiple(ebur128_state** sts,
                                      size_t size,
                                      double* out);
+/** \brief Get global integrated loudness in LUFS after a gain.
+ *
+ *  Gives the integrated loudness of the audio with a gain applied, without
+ *  processing it again. The block energies scale with the gain, but the
+ *  absolute gate at -70 LUFS does not, so the result is not simply the
+ *  loudness plus the gain. Blocks below the absolute gate are kept in bins of
+ *  0.1 LU down to -130 LUFS and counted like in EBUR128_MODE_HISTOGRAM, so
+ *  positive gains of up to 60 dB take the blocks they lift above the gate
+ *  into account. These blocks are kept since the start of the measurement,
+ *  regardless of ebur128_set_max_history().
+ *
+ *  @param st library state.
+ *  @param gain gain in dB.
+ *  @param out integrated loudness in LUFS. -HUGE_VAL if result is negative
+ *             infinity.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_I" has not been set.
+ *    - EBUR128_ERROR_IO if a block file could not be read.
+ */
+int ebur128_loudness_global_with_gain(ebur128_state* st,
+                                      double gain,
+                                      double* out);
 
 /** \brief Get momentary loudness (last 400ms) in LUFS.
  *
@@ -272,6 +586,34 @@ int ebur128_loudness_momentary(ebur128_state* st, double* out);
  */
 int ebur128_loudness_shortterm(ebur128_state* st, double* out);
 
+/** \brief Get maximum momentary loudness in LUFS.
+ *
+ *  Tracking has to be enabled with ebur128_set_max_loudness_step(). Only
+ *  windows completely filled with audio are considered.
+ *
+ *  @param st library state.
+ *  @param out maximum momentary loudness in LUFS. -HUGE_VAL if result is
+ *             negative infinity.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if tracking has not been enabled.
+ */
+int ebur128_loudness_momentary_max(ebur128_state* st, double* out);
+/** \brief Get maximum short-term loudness in LUFS.
+ *
+ *  Tracking has to be enabled with ebur128_set_max_loudness_step(). Only
+ *  windows completely filled with audio are considered.
+ *
+ *  @param st library state.
+ *  @param out maximum short-term loudness in LUFS. -HUGE_VAL if result is
+ *             negative infinity.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_S" has not been set
+ *      or tracking has not been enabled.
+ */
+int ebur128_loudness_shortterm_max(ebur128_state* st, double* out);
+
 /** \brief Get loudness of the specified window in LUFS.
  *
  *  window must not be larger than the current window set in st.
@@ -288,6 +630,54 @@ int ebur128_loudness_window(ebur128_state* st,
                             unsigned long window,
                             double* out);
 
+/** \brief Get the most recent K-weighted frames.
+ *
+ *  Gives read-only access to the BS.1770 filtered audio in the internal ring
+ *  buffer, without copying. The ring buffer is followed by a mirror of
+ *  itself, so the frames are always returned as one span of interleaved
+ *  frames in "first", even if the ring wraps around. "second" is only kept
+ *  for compatibility and is always set to NULL and 0 frames.
+ *  Channels set to EBUR128_UNUSED are not filtered and read as zero. The
+ *  span is only valid until the next call that adds frames or changes the
+ *  state.
+ *
+ *  @param st library state.
+ *  @param frames number of frames, at most the frames added since the buffer
+ *         was last reset, and at most the size of the buffer, which is at
+ *         least the current window (see ebur128_set_max_window()).
+ *  @param first the frames.
+ *  @param first_frames number of frames in first.
+ *  @param second set to NULL.
+ *  @param second_frames set to 0.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if not enough frames are available, or if
+ *      EBUR128_MODE_FIXED_POINT has been set.
+ */
+int ebur128_filtered_frames(ebur128_state* st,
+                            size_t frames,
+                            const double** first,
+                            size_t* first_frames,
+                            const double** second,
+                            size_t* second_frames);
+
+/** \brief Set a callback that receives all K-weighted audio.
+ *
+ *  The callback is called from the add_frames() functions with each chunk of
+ *  filtered audio, see ebur128_filtered_callback. Chunks are at most 400ms
+ *  long.
+ *
+ *  @param st library state.
+ *  @param callback callback, or NULL to remove it.
+ *  @param user_data passed to the callback.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if EBUR128_MODE_FIXED_POINT has been set.
+ */
+int ebur128_set_filtered_callback(ebur128_state* st,
+                                  ebur128_filtered_callback callback,
+                                  void* user_data);
+
 /** \brief Get loudness range (LRA) of programme in LU.
  *
  *  Calculates loudness range according to EBU 3342.
@@ -300,6 +690,7 @@ int ebur128_loudness_window(ebur128_state* st,
  *    - EBUR128_SUCCESS on success.
  *    - EBUR128_ERROR_NOMEM in case of memory allocation error.
  *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_LRA" has not been set.
+ *    - EBUR128_ERROR_IO if a block file could not be read.
  */
 int ebur128_loudness_range(ebur128_state* st, double* out);
 /** \brief Get loudness range (LRA) in LU across multiple instances.
@@ -314,11 +705,33 @@ int ebur128_loudness_range(ebur128_state* st, double* out);
  *  @return
  *    - EBUR128_SUCCESS on success.
  *    - EBUR128_ERROR_NOMEM in case of memory allocation error.
- *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_LRA" has not been set.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_LRA" has not been
+ *      set, or if "EBUR128_MODE_HISTOGRAM" or "EBUR128_MODE_LRA_SKETCH" is
+ *      set only in some of the states.
+ *    - EBUR128_ERROR_IO if a block file could not be read.
  */
 int ebur128_loudness_range_multiple(ebur128_state** sts,
                                     size_t size,
                                     double* out);
+/** \brief Get loudness range (LRA) of programme in LU after a gain.
+ *
+ *  Like ebur128_loudness_global_with_gain(), the short-term blocks are gated
+ *  again with the absolute gate, blocks below it count with the centre of
+ *  their 0.1 LU bin. Equal to ebur128_loudness_range() for a gain of 0 dB,
+ *  up to rounding.
+ *
+ *  @param st library state.
+ *  @param gain gain in dB.
+ *  @param out loudness range (LRA) in LU.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM in case of memory allocation error.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_LRA" has not been set.
+ *    - EBUR128_ERROR_IO if a block file could not be read.
+ */
+int ebur128_loudness_range_with_gain(ebur128_state* st,
+                                     double gain,
+                                     double* out);
 
 /** \brief Get maximum sample peak from all frames that have been processed.
  *
@@ -404,6 +817,79 @@ int ebur128_prev_true_peak(ebur128_state* st,
                            unsigned int channel_number,
                            double* out);
 
+/** \brief Get the position of the maximum sample peak.
+ *
+ *  Frames are counted from the initialization of the state, over all calls
+ *  that add frames. Returns the first frame reaching the maximum.
+ *
+ *  @param st library state.
+ *  @param channel_number channel to analyse.
+ *  @param out absolute frame index of the maximum sample peak, see
+ *             ebur128_sample_peak(). 0 if the channel was silent.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_SAMPLE_PEAK" has not
+ *      been set.
+ *    - EBUR128_ERROR_INVALID_CHANNEL_INDEX if invalid channel index.
+ */
+int ebur128_sample_peak_frame(ebur128_state* st,
+                              unsigned int channel_number,
+                              unsigned long long* out);
+
+/** \brief Get the position of the maximum true peak.
+ *
+ *  The delay of the interpolation filter is compensated, so the frame is the
+ *  one at or just before the interpolated peak.
+ *
+ *  @param st library state.
+ *  @param channel_number channel to analyse.
+ *  @param out absolute frame index of the maximum true peak, see
+ *             ebur128_true_peak(). 0 if the channel was silent.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_TRUE_PEAK" has not
+ *      been set.
+ *    - EBUR128_ERROR_INVALID_CHANNEL_INDEX if invalid channel index.
+ */
+int ebur128_true_peak_frame(ebur128_state* st,
+                            unsigned int channel_number,
+                            unsigned long long* out);
+
+/** \brief Get maximum sample peak of the sliding window.
+ *
+ *  The window has to be enabled with ebur128_set_sample_peak_window().
+ *
+ *  @param st library state.
+ *  @param channel_number channel to analyse.
+ *  @param out maximum sample peak over the window in float format (1.0 is
+ *             0 dBFS).
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if the window has not been enabled.
+ *    - EBUR128_ERROR_INVALID_CHANNEL_INDEX if invalid channel index.
+ */
+int ebur128_sample_peak_window(ebur128_state* st,
+                               unsigned int channel_number,
+                               double* out);
+
+/** \brief Get maximum true peak of the sliding window.
+ *
+ *  The window has to be enabled with ebur128_set_true_peak_window(). As with
+ *  ebur128_true_peak(), the result is at least the sample peak.
+ *
+ *  @param st library state.
+ *  @param channel_number channel to analyse.
+ *  @param out maximum true peak over the window in float format (1.0 is
+ *             0 dBFS).
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if the window has not been enabled.
+ *    - EBUR128_ERROR_INVALID_CHANNEL_INDEX if invalid channel index.
+ */
+int ebur128_true_peak_window(ebur128_state* st,
+                             unsigned int channel_number,
+                             double* out);
+
 /** \brief Get relative threshold in LUFS.
  *
  *  @param st library state
@@ -412,9 +898,776 @@ int ebur128_prev_true_peak(ebur128_state* st,
  *    - EBUR128_SUCCESS on success.
  *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_I" has not
  *      been set.
+ *    - EBUR128_ERROR_IO if a block file could not be read.
  */
 int ebur128_relative_threshold(ebur128_state* st, double* out);
 
+/** \brief Get all results of a measurement at once.
+ *
+ *  Equivalent to calling ebur128_loudness_global(),
+ *  ebur128_relative_threshold(), ebur128_loudness_range(),
+ *  ebur128_sample_peak() and ebur128_true_peak() for every channel, but
+ *  shares the work between them. The percentiles of the LRA are -HUGE_VAL if
+ *  there are no short-term blocks above the gates.
+ *
+ *  @param st library state.
+ *  @param out summary, see ebur128_summary.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM in case of memory allocation error.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_I" has not been set.
+ *    - EBUR128_ERROR_IO if a block file could not be read.
+ */
+int ebur128_get_summary(ebur128_state* st, ebur128_summary* out);
+/** \brief Get all results of a measurement across multiple instances.
+ *
+ *  Peaks are the maxima across all states, channel peaks are the maxima of
+ *  the channels with the same index.
+ *
+ *  @param sts array of library states.
+ *  @param size length of sts
+ *  @param out summary, see ebur128_summary.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM in case of memory allocation error.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_I" has not been set
+ *      in all states, or if "EBUR128_MODE_HISTOGRAM" or
+ *      "EBUR128_MODE_LRA_SKETCH" is set only in some of the states with mode
+ *      "EBUR128_MODE_LRA".
+ *    - EBUR128_ERROR_IO if a block file could not be read.
+ */
+int ebur128_get_summary_multiple(ebur128_state** sts,
+                                 size_t size,
+                                 ebur128_summary* out);
+
+/** \brief Start a new programme within a continuous measurement.
+ *
+ *  Discards the blocks and peaks measured so far, so the results only cover
+ *  the audio added from now on. Unlike destroying and initializing a new
+ *  state, the filters and the audio buffer keep running and nothing is
+ *  reallocated, so the first blocks of the programme are not measured with
+ *  cold filters. Gating blocks ending after the boundary belong to the new
+ *  programme, even if they started before it.
+ *
+ *  The block grid is not restarted, and neither are the peak windows, the
+ *  waveform overview and the block log.
+ *
+ *  The blocks overlapping the boundary still contain some audio from before
+ *  it, so the results differ slightly from those of a new state fed only the
+ *  programme. For programmes longer than a minute, the difference is
+ *  typically below 0.1 LU in the integrated loudness and 0.5 LU in the
+ *  loudness range.
+ *
+ *  @param st library state.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_begin_programme(ebur128_state* st);
+
+/** \brief End a programme within a continuous measurement.
+ *
+ *  Fills in the summary of the programme like ebur128_get_summary(), then
+ *  starts a new one like ebur128_begin_programme().
+ *
+ *  @param st library state.
+ *  @param out summary, see ebur128_summary. May be NULL to discard the
+ *             programme.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if "out" is set and mode "EBUR128_MODE_I"
+ *      has not been set. The programme is not ended then.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error, or EBUR128_ERROR_IO
+ *      if a block file could not be read. The programme is not ended then.
+ */
+int ebur128_end_programme(ebur128_state* st, ebur128_summary* out);
+
+/** \brief Asynchronous wrapper around a library state.
+ *
+ *  Frames added to an ebur128_async are only copied into a lock-free ring
+ *  buffer, and processed by a worker thread owned by the wrapper. This moves
+ *  the cost of filtering and peak scanning off real-time threads.
+ */
+typedef struct ebur128_async ebur128_async;
+
+/** \brief Create an asynchronous wrapper and start its worker thread.
+ *
+ *  The state is not owned by the wrapper. While frames may be pending, the
+ *  state must not be used directly. After ebur128_async_flush() returns and
+ *  until frames are added again, all functions may be called on the state,
+ *  for example to get the integrated loudness.
+ *
+ *  @param st library state.
+ *  @param ring_frames minimum capacity of the ring buffer in frames. Will be
+ *         rounded up to a power of two.
+ *  @return the wrapper, or NULL on error.
+ */
+ebur128_async* ebur128_async_create(ebur128_state* st, size_t ring_frames);
+
+/** \brief Process all pending frames, stop the worker and free the wrapper.
+ *
+ *  @param as pointer to a wrapper.
+ */
+void ebur128_async_destroy(ebur128_async** as);
+
+/** \brief Queue frames to be processed by the worker thread.
+ *
+ *  Does not wait for the worker to process frames, nor for readers of the
+ *  results. If the worker is idle, it is woken through a lock that the
+ *  worker only holds while it goes to sleep. Only one thread may add frames
+ *  at a time.
+ *
+ *  @param as wrapper.
+ *  @param src array of source frames. Channels must be interleaved.
+ *  @param frames number of frames. Not number of samples!
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM if the ring buffer has not enough free space. No
+ *      frames are added in this case.
+ */
+int ebur128_async_add_frames_short(ebur128_async* as,
+                                   const short* src,
+                                   size_t frames);
+/** \brief See \ref ebur128_async_add_frames_short */
+int ebur128_async_add_frames_int(ebur128_async* as,
+                                 const int* src,
+                                 size_t frames);
+/** \brief See \ref ebur128_async_add_frames_short */
+int ebur128_async_add_frames_float(ebur128_async* as,
+                                   const float* src,
+                                   size_t frames);
+/** \brief See \ref ebur128_async_add_frames_short */
+int ebur128_async_add_frames_double(ebur128_async* as,
+                                    const double* src,
+                                    size_t frames);
+
+/** \brief Wait until all queued frames have been processed.
+ *
+ *  @param as wrapper.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - the first error returned by ebur128_add_frames_double() in the worker
+ *      since the last flush otherwise. Frames after a failed call are still
+ *      processed.
+ */
+int ebur128_async_flush(ebur128_async* as);
+
+/** \brief Get the momentary loudness after the latest processed frames.
+ *
+ *  @param as wrapper.
+ *  @param out momentary loudness in LUFS. -HUGE_VAL if result is negative
+ *             infinity or no frames have been processed yet.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_async_loudness_momentary(ebur128_async* as, double* out);
+/** \brief Get the short-term loudness after the latest processed frames.
+ *
+ *  @param as wrapper.
+ *  @param out short-term loudness in LUFS. -HUGE_VAL if result is negative
+ *             infinity or no frames have been processed yet.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_S" has not been set.
+ */
+int ebur128_async_loudness_shortterm(ebur128_async* as, double* out);
+
+/** \brief Measurement of several programmes in one wide interleaved input.
+ *
+ *  Each programme is a group of consecutive channels of the input with its
+ *  own state. The states read their channels straight from the input, so the
+ *  input is read once and not split into separate buffers.
+ */
+typedef struct ebur128_mux ebur128_mux;
+
+/** \brief Create a mux.
+ *
+ *  Programme "p" takes the "programme_channels[p]" channels starting with
+ *  channel "first_channels[p]" of the input. Programmes may overlap. The
+ *  states of the programmes are initialized with "mode" and the default
+ *  channel map.
+ *
+ *  @param channels number of channels of the input.
+ *  @param samplerate sample rate of the input.
+ *  @param mode mode of the states, see ebur128_init().
+ *  @param first_channels first input channel of each programme.
+ *  @param programme_channels number of channels of each programme.
+ *  @param programmes number of programmes.
+ *  @return the mux, or NULL on memory allocation error, if a programme
+ *          exceeds the channels of the input or if a state could not be
+ *          initialized.
+ */
+ebur128_mux* ebur128_mux_create(unsigned int channels,
+                                unsigned long samplerate,
+                                int mode,
+                                const unsigned int* first_channels,
+                                const unsigned int* programme_channels,
+                                size_t programmes);
+
+/** \brief Destroy a mux and the states of its programmes.
+ *
+ *  @param mux pointer to a mux. Nothing happens if the mux is NULL.
+ */
+void ebur128_mux_destroy(ebur128_mux** mux);
+
+/** \brief Get the state of a programme of a mux.
+ *
+ *  The state can be configured (e.g. with ebur128_set_channel()) and
+ *  queried like any other state. It must not be changed with
+ *  ebur128_change_parameters(). Frames added directly to it have to be
+ *  given as a pointer to the first channel of the programme in a frame of
+ *  the wide input.
+ *
+ *  @param mux mux.
+ *  @param programme index of the programme.
+ *  @return the state, or NULL if "programme" is out of range.
+ */
+ebur128_state* ebur128_mux_state(ebur128_mux* mux, size_t programme);
+
+/** \brief Add frames of the wide input to all programmes of a mux.
+ *
+ *  @param mux mux.
+ *  @param src array of source frames with the channels of the input
+ *             interleaved.
+ *  @param frames number of frames. Not number of samples!
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ *    - EBUR128_ERROR_IO if a block file could not be written.
+ */
+int ebur128_mux_add_frames_short(ebur128_mux* mux,
+                                 const short* src,
+                                 size_t frames);
+/** \brief See \ref ebur128_mux_add_frames_short */
+int ebur128_mux_add_frames_int(ebur128_mux* mux, const int* src, size_t frames);
+/** \brief See \ref ebur128_mux_add_frames_short */
+int ebur128_mux_add_frames_float(ebur128_mux* mux,
+                                 const float* src,
+                                 size_t frames);
+/** \brief See \ref ebur128_mux_add_frames_short */
+int ebur128_mux_add_frames_double(ebur128_mux* mux,
+                                  const double* src,
+                                  size_t frames);
+
+/** \brief Loudness of mixes of several stems with any gains.
+ *
+ *  The K-weighting filter is linear, so the filtered mix of stems is the sum
+ *  of the filtered stems. For every 100ms segment the stems keep the sums of
+ *  the products of each pair of filtered stems, and the energy of a mix is a
+ *  quadratic form of these sums in the gains of the stems. Integrated loudness
+ *  for new gains is computed from the sums without filtering audio again, in
+ *  time proportional to the number of segments and of pairs of stems.
+ *
+ *  The stems are groups of consecutive channels of one wide interleaved
+ *  input, all with the same number of channels and channel map.
+ */
+typedef struct ebur128_stems ebur128_stems;
+
+/** \brief Create stems.
+ *
+ *  Stem "s" takes the "channels" channels starting with channel
+ *  "s * channels" of the input, which has "stems * channels" channels.
+ *
+ *  @param channels number of channels of each stem.
+ *  @param samplerate sample rate of the input.
+ *  @param stems number of stems.
+ *  @return the stems, or NULL on memory allocation error or if there are no
+ *          stems or channels.
+ */
+ebur128_stems* ebur128_stems_create(unsigned int channels,
+                                    unsigned long samplerate,
+                                    size_t stems);
+
+/** \brief Destroy stems.
+ *
+ *  @param stems pointer to stems. Nothing happens if the stems are NULL.
+ */
+void ebur128_stems_destroy(ebur128_stems** stems);
+
+/** \brief Set channel type of a channel of all stems.
+ *
+ *  Works like ebur128_set_channel(). Set the channel map before adding
+ *  frames, the sums of the segments already added are kept.
+ *
+ *  @param stems stems.
+ *  @param channel_number zero based channel index of a stem.
+ *  @param value channel type from the "channel" enum.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_CHANNEL_INDEX if invalid channel index.
+ */
+int ebur128_stems_set_channel(ebur128_stems* stems,
+                              unsigned int channel_number,
+                              int value);
+
+/** \brief Add frames of the wide input to all stems.
+ *
+ *  @param stems stems.
+ *  @param src array of source frames with the channels of all stems
+ *             interleaved.
+ *  @param frames number of frames. Not number of samples!
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ */
+int ebur128_stems_add_frames_short(ebur128_stems* stems,
+                                   const short* src,
+                                   size_t frames);
+/** \brief See \ref ebur128_stems_add_frames_short */
+int ebur128_stems_add_frames_int(ebur128_stems* stems,
+                                 const int* src,
+                                 size_t frames);
+/** \brief See \ref ebur128_stems_add_frames_short */
+int ebur128_stems_add_frames_float(ebur128_stems* stems,
+                                   const float* src,
+                                   size_t frames);
+/** \brief See \ref ebur128_stems_add_frames_short */
+int ebur128_stems_add_frames_double(ebur128_stems* stems,
+                                    const double* src,
+                                    size_t frames);
+
+/** \brief Get global integrated loudness of a mix of the stems in LUFS.
+ *
+ *  The result equals that of a state with EBUR128_MODE_I fed with the mix,
+ *  up to rounding.
+ *
+ *  @param stems stems.
+ *  @param gains linear gain of each stem in the mix.
+ *  @param out integrated loudness in LUFS. -HUGE_VAL if result is negative
+ *             infinity.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_stems_loudness_global(ebur128_stems* stems,
+                                  const double* gains,
+                                  double* out);
+
+/** \brief Get momentary loudness (last 400ms) of a mix of the stems in LUFS.
+ *
+ *  @param stems stems.
+ *  @param gains linear gain of each stem in the mix.
+ *  @param out momentary loudness in LUFS. -HUGE_VAL if result is negative
+ *             infinity.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_stems_loudness_momentary(ebur128_stems* stems,
+                                     const double* gains,
+                                     double* out);
+
+/** \brief Get short-term loudness (last 3s) of a mix of the stems in LUFS.
+ *
+ *  @param stems stems.
+ *  @param gains linear gain of each stem in the mix.
+ *  @param out short-term loudness in LUFS. -HUGE_VAL if result is negative
+ *             infinity.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_stems_loudness_shortterm(ebur128_stems* stems,
+                                     const double* gains,
+                                     double* out);
+
+/** \brief Get the gain that normalizes the programme to a target loudness.
+ *
+ *  The gain brings the integrated loudness to "target", but is lowered so
+ *  that the maximum true peak (or sample peak without EBUR128_MODE_TRUE_PEAK)
+ *  stays at or below "ceiling". Use it with ebur128_normalizer_create().
+ *
+ *  @param st library state.
+ *  @param target target loudness in LUFS.
+ *  @param ceiling maximum peak after the gain in dBTP (or dBFS). Only used
+ *         with EBUR128_MODE_TRUE_PEAK or EBUR128_MODE_SAMPLE_PEAK.
+ *  @param out gain in dB, 0 if the programme is silent.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_I" has not been set.
+ */
+int ebur128_normalization_gain(ebur128_state* st,
+                               double target,
+                               double ceiling,
+                               double* out);
+
+/** \brief Applies a gain and measures the peaks of the result.
+ *
+ *  An ebur128_normalizer applies a fixed gain to audio in place and tracks
+ *  the sample and true peaks after the gain in the same pass over the
+ *  frames, so the normalized audio does not have to be read again to verify
+ *  it.
+ */
+typedef struct ebur128_normalizer ebur128_normalizer;
+
+/** \brief Create a normalizer.
+ *
+ *  @param channels the number of channels.
+ *  @param samplerate the sample rate.
+ *  @param gain gain in dB, see ebur128_normalization_gain().
+ *  @return the normalizer, or NULL on error.
+ */
+ebur128_normalizer* ebur128_normalizer_create(unsigned int channels,
+                                              unsigned long samplerate,
+                                              double gain);
+
+/** \brief Destroy a normalizer.
+ *
+ *  @param n pointer to a normalizer. Nothing happens if the normalizer is
+ *           NULL.
+ */
+void ebur128_normalizer_destroy(ebur128_normalizer** n);
+
+/** \brief Apply the gain to frames in place.
+ *
+ *  Integer samples are rounded and clipped to their range, floating point
+ *  samples are not clipped. The peaks are taken after rounding and clipping,
+ *  so they describe exactly the frames written.
+ *
+ *  @param n normalizer.
+ *  @param frames array of frames. Channels must be interleaved.
+ *  @param frames_count number of frames. Not number of samples!
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_normalizer_apply_short(ebur128_normalizer* n,
+                                   short* frames,
+                                   size_t frames_count);
+/** \brief See \ref ebur128_normalizer_apply_short */
+int ebur128_normalizer_apply_int(ebur128_normalizer* n,
+                                 int* frames,
+                                 size_t frames_count);
+/** \brief See \ref ebur128_normalizer_apply_short */
+int ebur128_normalizer_apply_float(ebur128_normalizer* n,
+                                   float* frames,
+                                   size_t frames_count);
+/** \brief See \ref ebur128_normalizer_apply_short */
+int ebur128_normalizer_apply_double(ebur128_normalizer* n,
+                                    double* frames,
+                                    size_t frames_count);
+
+/** \brief Get maximum sample peak of a channel after the gain.
+ *
+ *  @param n normalizer.
+ *  @param channel_number channel to analyse.
+ *  @param out maximum sample peak in float format (1.0 is 0 dBFS).
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_CHANNEL_INDEX if invalid channel index.
+ */
+int ebur128_normalizer_sample_peak(ebur128_normalizer* n,
+                                   unsigned int channel_number,
+                                   double* out);
+
+/** \brief Get maximum true peak of a channel after the gain.
+ *
+ *  Uses the same interpolation as ebur128_true_peak().
+ *
+ *  @param n normalizer.
+ *  @param channel_number channel to analyse.
+ *  @param out maximum true peak in float format (1.0 is 0 dBTP).
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_CHANNEL_INDEX if invalid channel index.
+ */
+int ebur128_normalizer_true_peak(ebur128_normalizer* n,
+                                 unsigned int channel_number,
+                                 double* out);
+
+/** \brief Compact summary of a measurement for later aggregation.
+ *
+ *  A digest holds the histograms of the block and short-term block energies
+ *  of a state and its peaks, so album or playlist loudness can be computed
+ *  from stored digests without keeping the states. Integrated loudness from
+ *  digests is as exact as with EBUR128_MODE_HISTOGRAM, the loudness range
+ *  has its 0.1 LU resolution. Serialized digests take a few kilobytes.
+ */
+typedef struct ebur128_digest ebur128_digest;
+
+/** \brief Create a digest of the measurement of a state.
+ *
+ *  Works with and without EBUR128_MODE_HISTOGRAM. The histograms are taken
+ *  if mode "EBUR128_MODE_I" or "EBUR128_MODE_LRA" has been set, the peaks
+ *  are the maxima across all channels.
+ *
+ *  @param st library state.
+ *  @return the digest, or NULL on memory allocation error or if a block file
+ *          could not be read.
+ */
+ebur128_digest* ebur128_digest_create(ebur128_state* st);
+
+/** \brief Destroy a digest.
+ *
+ *  @param digest pointer to a digest.
+ */
+void ebur128_digest_destroy(ebur128_digest** digest);
+
+/** \brief Add the measurement of another digest to a digest.
+ *
+ *  @param digest digest to update.
+ *  @param other digest to add.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_digest_merge(ebur128_digest* digest, const ebur128_digest* other);
+
+/** \brief Get the size of a serialized digest in bytes.
+ *
+ *  @param digest digest.
+ *  @return size for ebur128_digest_serialize().
+ */
+size_t ebur128_digest_serialized_size(const ebur128_digest* digest);
+
+/** \brief Serialize a digest.
+ *
+ *  The format is portable between platforms.
+ *
+ *  @param digest digest.
+ *  @param buffer buffer of at least ebur128_digest_serialized_size() bytes.
+ *  @return number of bytes written.
+ */
+size_t ebur128_digest_serialize(const ebur128_digest* digest,
+                                unsigned char* buffer);
+
+/** \brief Create a digest from its serialized form.
+ *
+ *  @param buffer serialized digest.
+ *  @param size size of buffer in bytes.
+ *  @return the digest, or NULL on memory allocation error or if buffer does
+ *          not hold a valid digest.
+ */
+ebur128_digest* ebur128_digest_deserialize(const unsigned char* buffer,
+                                           size_t size);
+
+/** \brief Get global integrated loudness in LUFS across multiple digests.
+ *
+ *  @param digests array of digests.
+ *  @param size length of digests.
+ *  @param out integrated loudness in LUFS. -HUGE_VAL if result is negative
+ *             infinity.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_digest_loudness_global_multiple(ebur128_digest** digests,
+                                            size_t size,
+                                            double* out);
+
+/** \brief Get loudness range (LRA) in LU across multiple digests.
+ *
+ *  @param digests array of digests.
+ *  @param size length of digests.
+ *  @param out loudness range (LRA) in LU.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_digest_loudness_range_multiple(ebur128_digest** digests,
+                                           size_t size,
+                                           double* out);
+
+/** \brief Get the maximum sample peak of a digest.
+ *
+ *  @param digest digest.
+ *  @param out maximum sample peak in float format (1.0 is 0 dBFS), 0.0 if
+ *             the state had no peak mode.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_digest_sample_peak(const ebur128_digest* digest, double* out);
+
+/** \brief Get the maximum true peak of a digest.
+ *
+ *  @param digest digest.
+ *  @param out maximum true peak in float format (1.0 is 0 dBTP), 0.0 if
+ *             the state had no true peak mode.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_digest_true_peak(const ebur128_digest* digest, double* out);
+
+/** \brief Loudness of a set of states that are queried again and again.
+ *
+ *  An aggregator keeps a digest of each state, see ebur128_digest_create(),
+ *  and of all of them. On each query, only the blocks that a state added
+ *  since the last query are read, so repeated queries over many live states
+ *  do not walk and sort all blocks again. States that are in mode
+ *  "EBUR128_MODE_HISTOGRAM" or "EBUR128_MODE_LRA_SKETCH", or that dropped
+ *  blocks from their history since the last query, are read completely.
+ *
+ *  The results are those of the digests of the states merged into one, see
+ *  ebur128_digest_merge().
+ */
+typedef struct ebur128_aggregator ebur128_aggregator;
+
+/** \brief Create an aggregator over a set of states.
+ *
+ *  The states are not copied, and have to outlive the aggregator.
+ *
+ *  @param sts array of library states. Elements may be NULL.
+ *  @param size length of sts.
+ *  @return the aggregator, or NULL on memory allocation error.
+ */
+ebur128_aggregator* ebur128_aggregator_create(ebur128_state** sts,
+                                              size_t size);
+
+/** \brief Destroy an aggregator.
+ *
+ *  @param agg pointer to an aggregator.
+ */
+void ebur128_aggregator_destroy(ebur128_aggregator** agg);
+
+/** \brief Get the global integrated loudness of the states of an aggregator.
+ *
+ *  @param agg aggregator.
+ *  @param out integrated loudness in LUFS. -HUGE_VAL if result is negative
+ *             infinity.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_I" has not been set
+ *      in all states.
+ *    - EBUR128_ERROR_IO if a block file could not be read.
+ */
+int ebur128_aggregator_loudness_global(ebur128_aggregator* agg, double* out);
+
+/** \brief Get the loudness range (LRA) of the states of an aggregator.
+ *
+ *  Unlike ebur128_loudness_range_multiple(), the states may differ in the
+ *  modes "EBUR128_MODE_HISTOGRAM" and "EBUR128_MODE_LRA_SKETCH".
+ *
+ *  @param agg aggregator.
+ *  @param out loudness range (LRA) in LU.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if mode "EBUR128_MODE_LRA" has not been
+ *      set in all states.
+ *    - EBUR128_ERROR_IO if a block file could not be read.
+ */
+int ebur128_aggregator_loudness_range(ebur128_aggregator* agg, double* out);
+
+/** \brief Blocks read from a log written by ebur128_set_block_log().
+ *
+ *  Block "i" is the i-th gating block completed after the log was set. If it
+ *  was set before the first block, block "i" ended (i + 4) * 100ms after the
+ *  start of the measurement. Loudness is computed from the logged levels, so
+ *  it may differ from a state by the 0.001 dB resolution of the log.
+ */
+typedef struct ebur128_block_log ebur128_block_log;
+
+/** \brief Read a block log.
+ *
+ *  A record cut off at the end of the file (e.g. while it is still being
+ *  written) is ignored.
+ *
+ *  @param path path of the log file.
+ *  @return the log, or NULL on memory allocation error or if the file could
+ *          not be read or is not a block log.
+ */
+ebur128_block_log* ebur128_block_log_open(const char* path);
+
+/** \brief Close a block log.
+ *
+ *  @param log pointer to a block log.
+ */
+void ebur128_block_log_close(ebur128_block_log** log);
+
+/** \brief Get the number of blocks in a block log.
+ *
+ *  @param log block log.
+ *  @return number of blocks.
+ */
+size_t ebur128_block_log_blocks(const ebur128_block_log* log);
+
+/** \brief Get the momentary loudness of a block in a block log.
+ *
+ *  @param log block log.
+ *  @param index index of the block.
+ *  @param out momentary loudness in LUFS.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if "index" is not below the number of
+ *      blocks.
+ */
+int ebur128_block_log_loudness_momentary(const ebur128_block_log* log,
+                                         size_t index,
+                                         double* out);
+
+/** \brief Get the short-term loudness of a block in a block log.
+ *
+ *  @param log block log.
+ *  @param index index of the block.
+ *  @param out short-term loudness in LUFS.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if the state had no "EBUR128_MODE_S" or
+ *      "index" is not below the number of blocks.
+ */
+int ebur128_block_log_loudness_shortterm(const ebur128_block_log* log,
+                                         size_t index,
+                                         double* out);
+
+/** \brief Get the sample peak of the newest 100ms of a block.
+ *
+ *  @param log block log.
+ *  @param index index of the block.
+ *  @param out maximum sample peak across all channels in float format (1.0
+ *             is 0 dBFS).
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if the state had no
+ *      "EBUR128_MODE_SAMPLE_PEAK" or "index" is not below the number of
+ *      blocks.
+ */
+int ebur128_block_log_sample_peak(const ebur128_block_log* log,
+                                  size_t index,
+                                  double* out);
+
+/** \brief Get the true peak of the newest 100ms of a block.
+ *
+ *  @param log block log.
+ *  @param index index of the block.
+ *  @param out maximum true peak across all channels in float format (1.0 is
+ *             0 dBTP).
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_INVALID_MODE if the state had no
+ *      "EBUR128_MODE_TRUE_PEAK" or "index" is not below the number of
+ *      blocks.
+ */
+int ebur128_block_log_true_peak(const ebur128_block_log* log,
+                                size_t index,
+                                double* out);
+
+/** \brief Get the global integrated loudness of blocks of a block log.
+ *
+ *  @param log block log.
+ *  @param first index of the first block.
+ *  @param count number of blocks, blocks beyond the end of the log are
+ *               ignored. Use ebur128_block_log_blocks() for the whole log.
+ *  @param out integrated loudness in LUFS. -HUGE_VAL if result is negative
+ *             infinity.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ */
+int ebur128_block_log_loudness_global(const ebur128_block_log* log,
+                                      size_t first,
+                                      size_t count,
+                                      double* out);
+
+/** \brief Get the loudness range (LRA) of blocks of a block log.
+ *
+ *  The short-term blocks are taken every second from 3s after the first
+ *  block, like a state started with the first block does.
+ *
+ *  @param log block log.
+ *  @param first index of the first block.
+ *  @param count number of blocks, blocks beyond the end of the log are
+ *               ignored.
+ *  @param out loudness range (LRA) in LU.
+ *  @return
+ *    - EBUR128_SUCCESS on success.
+ *    - EBUR128_ERROR_NOMEM on memory allocation error.
+ *    - EBUR128_ERROR_INVALID_MODE if the state had no "EBUR128_MODE_S".
+ */
+int ebur128_block_log_loudness_range(const ebur128_block_log* log,
+                                     size_t first,
+                                     size_t count,
+                                     double* out);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,271 @@
+/* See COPYING file for copyright and license details. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ebur128.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static double seconds(void) {
+  return (double) clock() / CLOCKS_PER_SEC;
+}
+
+static float* generate(unsigned int channels, size_t frames) {
+  float* buffer;
+  size_t i;
+  unsigned int c;
+
+  buffer = (float*) malloc(frames * channels * sizeof(float));
+  if (!buffer) {
+    return NULL;
+  }
+  for (i = 0; i < frames; ++i) {
+    for (c = 0; c < channels; ++c) {
+      buffer[i * channels + c] =
+          (float) (0.5 * sin(2.0 * M_PI * (100.0 + 10.0 * c) * (double) i /
+                             48000.0));
+    }
+  }
+  return buffer;
+}
+
+/* Process 10 s of audio per channel count and print the throughput. */
+static void bench_add_frames(const char* name, int mode) {
+  static const unsigned int channel_counts[] = { 1, 2, 6, 16, 32, 64 };
+  size_t frames = 48000 * 10;
+  size_t i, j;
+  unsigned int c;
+
+  for (i = 0; i < sizeof(channel_counts) / sizeof(channel_counts[0]); ++i) {
+    unsigned int channels = channel_counts[i];
+    float* buffer = generate(channels, frames);
+    ebur128_state* st = ebur128_init(channels, 48000, mode);
+    double start, elapsed;
+
+    if (!buffer || !st) {
+      fprintf(stderr, "allocation failed\n");
+      exit(1);
+    }
+    for (c = 0; c < channels; ++c) {
+      ebur128_set_channel(st, c, EBUR128_LEFT);
+    }
+
+    start = seconds();
+    /* one second per call */
+    for (j = 0; j < frames; j += 48000) {
+      ebur128_add_frames_float(st, buffer + j * channels, 48000);
+    }
+    elapsed = seconds() - start;
+
+    printf("%-10s %2u channels: %8.2f ns/sample, %7.1fx realtime\n", name,
+           channels, elapsed * 1e9 / (double) (frames * channels),
+           10.0 / elapsed);
+
+    ebur128_destroy(&st);
+    free(buffer);
+  }
+}
+
+/* Apply a gain and verify the peaks, once with a separate gain loop and
+ * analysis pass and once with the fused normalizer. */
+static void bench_normalizer(void) {
+  unsigned int channels = 2;
+  size_t frames = 48000 * 10;
+  size_t i;
+  float* buffer = generate(channels, frames);
+  ebur128_state* st = ebur128_init(channels, 48000, EBUR128_MODE_TRUE_PEAK);
+  ebur128_normalizer* n = ebur128_normalizer_create(channels, 48000, -3.0);
+  float gain = (float) pow(10.0, -3.0 / 20.0);
+  double start, separate, fused;
+
+  if (!buffer || !st || !n) {
+    fprintf(stderr, "allocation failed\n");
+    exit(1);
+  }
+
+  start = seconds();
+  for (i = 0; i < frames * channels; ++i) {
+    buffer[i] *= gain;
+  }
+  ebur128_add_frames_float(st, buffer, frames);
+  separate = seconds() - start;
+
+  start = seconds();
+  ebur128_normalizer_apply_float(n, buffer, frames);
+  fused = seconds() - start;
+
+  printf("gain + peaks, separate: %8.2f ns/sample\n",
+         separate * 1e9 / (double) (frames * channels));
+  printf("gain + peaks, fused:    %8.2f ns/sample\n",
+         fused * 1e9 / (double) (frames * channels));
+
+  ebur128_normalizer_destroy(&n);
+  ebur128_destroy(&st);
+  free(buffer);
+}
+
+static void bench_overview(void) {
+  unsigned int channels = 2;
+  size_t frames = 48000 * 10;
+  unsigned long frames_per_bucket = 256;
+  size_t buckets = (frames + frames_per_bucket - 1) / frames_per_bucket;
+  size_t i, b;
+  unsigned int c;
+  float* buffer = generate(channels, frames);
+  float* overview = (float*) malloc(buckets * channels * 3 * sizeof(float));
+  ebur128_state* st = ebur128_init(channels, 48000, EBUR128_MODE_SAMPLE_PEAK);
+  double start, separate, fused;
+
+  if (!buffer || !overview || !st) {
+    fprintf(stderr, "allocation failed\n");
+    exit(1);
+  }
+
+  start = seconds();
+  ebur128_add_frames_float(st, buffer, frames);
+  for (b = 0; b < buckets; ++b) {
+    for (c = 0; c < channels; ++c) {
+      float min = 1.0f, max = -1.0f;
+      double sum = 0.0;
+      for (i = b * frames_per_bucket;
+           i < (b + 1) * frames_per_bucket && i < frames; ++i) {
+        float cur = buffer[i * channels + c];
+        min = cur < min ? cur : min;
+        max = cur > max ? cur : max;
+        sum += (double) cur * cur;
+      }
+      overview[(b * channels + c) * 3] = min;
+      overview[(b * channels + c) * 3 + 1] = max;
+      overview[(b * channels + c) * 3 + 2] =
+          (float) sqrt(sum / (double) frames_per_bucket);
+    }
+  }
+  separate = seconds() - start;
+
+  ebur128_set_overview(st, frames_per_bucket, overview, buckets);
+  start = seconds();
+  ebur128_add_frames_float(st, buffer, frames);
+  fused = seconds() - start;
+
+  printf("peaks + overview, separate: %8.2f ns/sample\n",
+         separate * 1e9 / (double) (frames * channels));
+  printf("peaks + overview, fused:    %8.2f ns/sample\n",
+         fused * 1e9 / (double) (frames * channels));
+
+  ebur128_destroy(&st);
+  free(overview);
+  free(buffer);
+}
+
+/* Switch the samplerate back and forth after each second of audio, as a
+ * player does between tracks, and compare against setting up a new state
+ * each time. Only the reconfiguration is timed. */
+static void bench_change_parameters(void) {
+  static const unsigned long samplerates[] = { 44100, 48000 };
+  int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK;
+  unsigned int channels = 6;
+  size_t frames = 48000;
+  size_t rounds = 200;
+  size_t i;
+  float* buffer = generate(channels, frames);
+  ebur128_state* st = ebur128_init(channels, 48000, mode);
+  double start, init = 0.0, change = 0.0;
+
+  if (!buffer || !st) {
+    fprintf(stderr, "allocation failed\n");
+    exit(1);
+  }
+
+  for (i = 0; i < rounds; ++i) {
+    ebur128_add_frames_float(st, buffer, frames);
+    start = seconds();
+    ebur128_destroy(&st);
+    st = ebur128_init(channels, samplerates[i % 2], mode);
+    init += seconds() - start;
+    if (!st) {
+      fprintf(stderr, "allocation failed\n");
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < rounds; ++i) {
+    ebur128_add_frames_float(st, buffer, frames);
+    start = seconds();
+    if (ebur128_change_parameters(st, channels, samplerates[i % 2]) !=
+        EBUR128_SUCCESS) {
+      fprintf(stderr, "change_parameters failed\n");
+      exit(1);
+    }
+    change += seconds() - start;
+  }
+
+  printf("reconfigure, init:              %8.2f us\n",
+         init * 1e6 / (double) rounds);
+  printf("reconfigure, change_parameters: %8.2f us\n",
+         change * 1e6 / (double) rounds);
+
+  ebur128_destroy(&st);
+  free(buffer);
+}
+
+/* Set up as many states as a monitoring server does at startup, in the
+ * default mode and with histograms, and tear them down again. */
+static void bench_init(void) {
+  static const int modes[] = {
+    EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK,
+    EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_TRUE_PEAK |
+        EBUR128_MODE_HISTOGRAM,
+  };
+  size_t count = 5000;
+  size_t i, m;
+  ebur128_state** states =
+      (ebur128_state**) malloc(count * sizeof(ebur128_state*));
+  double start, init, destroy;
+
+  if (!states) {
+    fprintf(stderr, "allocation failed\n");
+    exit(1);
+  }
+
+  for (m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+    start = seconds();
+    for (i = 0; i < count; ++i) {
+      states[i] = ebur128_init(2, 48000, modes[m]);
+      if (!states[i]) {
+        fprintf(stderr, "allocation failed\n");
+        exit(1);
+      }
+    }
+    init = seconds() - start;
+
+    start = seconds();
+    for (i = 0; i < count; ++i) {
+      ebur128_destroy(&states[i]);
+    }
+    destroy = seconds() - start;
+
+    printf("startup%s, init:    %8.2f us\n", m ? " (histogram)" : "",
+           init * 1e6 / (double) count);
+    printf("startup%s, destroy: %8.2f us\n", m ? " (histogram)" : "",
+           destroy * 1e6 / (double) count);
+  }
+  free(states);
+}
+
+int main(void) {
+  bench_add_frames("I", EBUR128_MODE_I);
+  bench_add_frames("I+TP", EBUR128_MODE_I | EBUR128_MODE_TRUE_PEAK);
+  bench_add_frames("I fixed", EBUR128_MODE_I | EBUR128_MODE_FIXED_POINT);
+  bench_add_frames("I+TP fixed", EBUR128_MODE_I | EBUR128_MODE_TRUE_PEAK |
+                                     EBUR128_MODE_FIXED_POINT);
+  bench_normalizer();
+  bench_overview();
+  bench_change_parameters();
+  bench_init();
+  return 0;
+}
@@ -7,92 +7,1503 @@
 
 #include "ebur128.h"
 
-double test_global_loudness(const char* filename, ebur128_state** out_state) {
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Read all frames of a file into a new buffer. */
+double* read_file(const char* filename, SF_INFO* file_info) {
+  SNDFILE* file;
+  double* buffer;
+
+  memset(file_info, '\0', sizeof(*file_info));
+  file = sf_open(filename, SFM_READ, file_info);
+  if (!file) {
+    fprintf(stderr, "Could not open file %s!\n", filename);
+    return NULL;
+  }
+  buffer = (double*) malloc((size_t) file_info->frames *
+                            (size_t) file_info->channels * sizeof(double));
+  if (buffer &&
+      sf_readf_double(file, buffer, file_info->frames) != file_info->frames) {
+    free(buffer);
+    buffer = NULL;
+  }
+  if (sf_close(file)) {
+    fprintf(stderr, "Could not close input file!\n");
+  }
+  return buffer;
+}
+
+double test_global_loudness(const char* filename,
+                            int mode,
+                            ebur128_state** out_state) {
+  SF_INFO file_info;
+  SNDFILE* file;
+  sf_count_t nr_frames_read;
+
+  ebur128_state* st = NULL;
+  double gated_loudness;
+  double* buffer;
+
+  memset(&file_info, '\0', sizeof(file_info));
+  file = sf_open(filename, SFM_READ, &file_info);
+  if (!file) {
+    fprintf(stderr, "Could not open file %s!\n", filename);
+    return 0.0;
+  }
+  st = ebur128_init((unsigned) file_info.channels,
+                    (unsigned) file_info.samplerate, mode);
+  if (file_info.channels == 5) {
+    ebur128_set_channel(st, 0, EBUR128_LEFT);
+    ebur128_set_channel(st, 1, EBUR128_RIGHT);
+    ebur128_set_channel(st, 2, EBUR128_CENTER);
+    ebur128_set_channel(st, 3, EBUR128_LEFT_SURROUND);
+    ebur128_set_channel(st, 4, EBUR128_RIGHT_SURROUND);
+  }
+  buffer = (double*) malloc(st->samplerate * st->channels * sizeof(double));
+  while ((nr_frames_read =
+              sf_readf_double(file, buffer, (sf_count_t) st->samplerate))) {
+    ebur128_add_frames_double(st, buffer, (size_t) nr_frames_read);
+  }
+
+  ebur128_loudness_global(st, &gated_loudness);
+
+  *out_state = st;
+
+  free(buffer);
+  buffer = NULL;
+  if (sf_close(file)) {
+    fprintf(stderr, "Could not close input file!\n");
+  }
+  return gated_loudness;
+}
+
+double test_loudness_range(const char* filename, int mode) {
+  SF_INFO file_info;
+  SNDFILE* file;
+  sf_count_t nr_frames_read;
+
+  ebur128_state* st = NULL;
+  double loudness_range;
+  double* buffer;
+
+  memset(&file_info, '\0', sizeof(file_info));
+  file = sf_open(filename, SFM_READ, &file_info);
+  if (!file) {
+    fprintf(stderr, "Could not open file %s!\n", filename);
+    return 0.0;
+  }
+  st = ebur128_init((unsigned) file_info.channels,
+                    (unsigned) file_info.samplerate, mode);
+  if (file_info.channels == 5) {
+    ebur128_set_channel(st, 0, EBUR128_LEFT);
+    ebur128_set_channel(st, 1, EBUR128_RIGHT);
+    ebur128_set_channel(st, 2, EBUR128_CENTER);
+    ebur128_set_channel(st, 3, EBUR128_LEFT_SURROUND);
+    ebur128_set_channel(st, 4, EBUR128_RIGHT_SURROUND);
+  }
+  buffer = (double*) malloc(st->samplerate * st->channels * sizeof(double));
+  while ((nr_frames_read =
+              sf_readf_double(file, buffer, (sf_count_t) st->samplerate))) {
+    ebur128_add_frames_double(st, buffer, (size_t) nr_frames_read);
+  }
+
+  ebur128_loudness_range(st, &loudness_range);
+
+  /* clean up */
+  ebur128_destroy(&st);
+
+  free(buffer);
+  buffer = NULL;
+  if (sf_close(file)) {
+    fprintf(stderr, "Could not close input file!\n");
+  }
+  return loudness_range;
+}
+
+double test_block_log_loudness_range(const char* filename) {
+  SF_INFO file_info;
+  SNDFILE* file;
+  sf_count_t nr_frames_read;
+
+  ebur128_state* st = NULL;
+  ebur128_block_log* log;
+  double loudness_range = 0.0;
+  double* buffer;
+
+  memset(&file_info, '\0', sizeof(file_info));
+  file = sf_open(filename, SFM_READ, &file_info);
+  if (!file) {
+    fprintf(stderr, "Could not open file %s!\n", filename);
+    return 0.0;
+  }
+  st = ebur128_init((unsigned) file_info.channels,
+                    (unsigned) file_info.samplerate, EBUR128_MODE_LRA);
+  if (ebur128_set_block_log(st, "block_log.bin")) {
+    fprintf(stderr, "Could not create block log!\n");
+  }
+  buffer = (double*) malloc(st->samplerate * st->channels * sizeof(double));
+  while ((nr_frames_read =
+              sf_readf_double(file, buffer, (sf_count_t) st->samplerate))) {
+    ebur128_add_frames_double(st, buffer, (size_t) nr_frames_read);
+  }
+
+  /* closes the log */
+  ebur128_destroy(&st);
+
+  log = ebur128_block_log_open("block_log.bin");
+  if (log) {
+    ebur128_block_log_loudness_range(log, 0, ebur128_block_log_blocks(log),
+                                     &loudness_range);
+    ebur128_block_log_close(&log);
+  }
+  remove("block_log.bin");
+
+  free(buffer);
+  buffer = NULL;
+  if (sf_close(file)) {
+    fprintf(stderr, "Could not close input file!\n");
+  }
+  return loudness_range;
+}
+
+/* Difference of the global loudness from a block log and from its state, for
+ * a sine at -66 LUFS followed by one at -75 LUFS. The relative gate is below
+ * -70 LUFS then, so blocks below the absolute gate must not count. */
+double test_block_log_loudness_global(void) {
+  ebur128_state* st;
+  ebur128_block_log* log;
+  double buffer[2 * 48000];
+  double amplitude;
+  double gated_loudness = 0.0;
+  double log_loudness = HUGE_VAL;
+  int i, s;
+
+  st = ebur128_init(2, 48000, EBUR128_MODE_I);
+  if (ebur128_set_block_log(st, "block_log.bin")) {
+    fprintf(stderr, "Could not create block log!\n");
+  }
+  for (s = 0; s < 20; ++s) {
+    amplitude = pow(10.0, (s < 10 ? -66.0 : -75.0) / 20.0);
+    for (i = 0; i < 48000; ++i) {
+      buffer[2 * i] = buffer[2 * i + 1] =
+          amplitude * sin(2.0 * M_PI * i / 48.0);
+    }
+    ebur128_add_frames_double(st, buffer, 48000);
+  }
+  ebur128_loudness_global(st, &gated_loudness);
+
+  /* closes the log */
+  ebur128_destroy(&st);
+
+  log = ebur128_block_log_open("block_log.bin");
+  if (log) {
+    ebur128_block_log_loudness_global(log, 0, ebur128_block_log_blocks(log),
+                                      &log_loudness);
+    ebur128_block_log_close(&log);
+  }
+  remove("block_log.bin");
+
+  return fabs(gated_loudness - log_loudness);
+}
+
+double test_stems_global_loudness(const char* filename) {
+  SF_INFO file_info;
+  SNDFILE* file;
+  sf_count_t nr_frames_read;
+  sf_count_t i;
+  int c;
+
+  ebur128_stems* stems = NULL;
+  /* the file is split into two stems that add up to it */
+  double gains[2] = { 0.25, 0.75 };
+  double gated_loudness = 0.0;
+  double* buffer;
+  double* wide;
+
+  memset(&file_info, '\0', sizeof(file_info));
+  file = sf_open(filename, SFM_READ, &file_info);
+  if (!file) {
+    fprintf(stderr, "Could not open file %s!\n", filename);
+    return 0.0;
+  }
+  stems = ebur128_stems_create((unsigned) file_info.channels,
+                               (unsigned) file_info.samplerate, 2);
+  buffer = (double*) malloc((size_t) file_info.samplerate *
+                            (size_t) file_info.channels * sizeof(double));
+  wide = (double*) malloc(2 * (size_t) file_info.samplerate *
+                          (size_t) file_info.channels * sizeof(double));
+  while ((nr_frames_read = sf_readf_double(
+              file, buffer, (sf_count_t) file_info.samplerate))) {
+    for (i = 0; i < nr_frames_read; ++i) {
+      for (c = 0; c < file_info.channels; ++c) {
+        wide[(2 * i) * file_info.channels + c] =
+            buffer[i * file_info.channels + c];
+        wide[(2 * i + 1) * file_info.channels + c] =
+            buffer[i * file_info.channels + c];
+      }
+    }
+    ebur128_stems_add_frames_double(stems, wide, (size_t) nr_frames_read);
+  }
+
+  ebur128_stems_loudness_global(stems, gains, &gated_loudness);
+  ebur128_stems_destroy(&stems);
+
+  free(buffer);
+  free(wide);
+  if (sf_close(file)) {
+    fprintf(stderr, "Could not close input file!\n");
+  }
+  return gated_loudness;
+}
+
+/* All K-weighted frames passed to a filtered callback. */
+struct filtered_stream {
+  double* frames;
+  size_t frames_count;
+};
+
+void collect_filtered(void* user_data,
+                      const double* frames,
+                      size_t frames_count,
+                      unsigned int channels) {
+  struct filtered_stream* stream = (struct filtered_stream*) user_data;
+  memcpy(stream->frames + stream->frames_count * channels, frames,
+         frames_count * channels * sizeof(double));
+  stream->frames_count += frames_count;
+}
+
+/* Check that ebur128_filtered_frames() returns the last 3 s of the frames
+ * passed to the filtered callback, after adding the file in chunks of odd
+ * sizes so that the ring wraps around at different positions. Returns 1 if
+ * they match. */
+int test_filtered_frames(const char* filename) {
+  SF_INFO file_info;
+  ebur128_state* st;
+  struct filtered_stream stream;
+  const double* first;
+  const double* second;
+  size_t first_frames, second_frames, frames, chunk;
+  size_t offset = 0;
+  double* buffer;
+  int ok = 0;
+
+  buffer = read_file(filename, &file_info);
+  if (!buffer) {
+    return 0;
+  }
+  frames = 3 * (size_t) file_info.samplerate;
+  st = ebur128_init((unsigned) file_info.channels,
+                    (unsigned) file_info.samplerate, EBUR128_MODE_S);
+  stream.frames = (double*) malloc((size_t) file_info.frames *
+                                   (size_t) file_info.channels *
+                                   sizeof(double));
+  stream.frames_count = 0;
+  ebur128_set_filtered_callback(st, collect_filtered, &stream);
+  for (chunk = 1; offset < (size_t) file_info.frames;
+       chunk = chunk * 7 % 9973) {
+    if (chunk > (size_t) file_info.frames - offset) {
+      chunk = (size_t) file_info.frames - offset;
+    }
+    ebur128_add_frames_double(
+        st, buffer + offset * (size_t) file_info.channels, chunk);
+    offset += chunk;
+  }
+
+  if (ebur128_filtered_frames(st, frames, &first, &first_frames, &second,
+                              &second_frames) == EBUR128_SUCCESS &&
+      first_frames == frames && !second && !second_frames &&
+      !memcmp(first,
+              stream.frames + (stream.frames_count - frames) *
+                                  (size_t) file_info.channels,
+              frames * (size_t) file_info.channels * sizeof(double))) {
+    ok = 1;
+  }
+  ebur128_destroy(&st);
+
+  free(stream.frames);
+  free(buffer);
+  return ok;
+}
+
+double test_hibernate(const char* filename) {
+  SF_INFO file_info;
+  SNDFILE* file;
+  sf_count_t nr_frames_read;
+  sf_count_t frames = 0;
+  int half = 0;
+
+  ebur128_state* st = NULL;
+  /* the halves of the file before and after hibernating */
+  ebur128_state* halves[2] = { NULL, NULL };
+  double gated_loudness = 0.0;
+  double halves_loudness = 0.0;
+  double* buffer;
+
+  memset(&file_info, '\0', sizeof(file_info));
+  file = sf_open(filename, SFM_READ, &file_info);
+  if (!file) {
+    fprintf(stderr, "Could not open file %s!\n", filename);
+    return HUGE_VAL;
+  }
+  st = ebur128_init((unsigned) file_info.channels,
+                    (unsigned) file_info.samplerate,
+                    EBUR128_MODE_I | EBUR128_MODE_TRUE_PEAK);
+  halves[0] = ebur128_init((unsigned) file_info.channels,
+                           (unsigned) file_info.samplerate,
+                           EBUR128_MODE_I | EBUR128_MODE_TRUE_PEAK);
+  halves[1] = ebur128_init((unsigned) file_info.channels,
+                           (unsigned) file_info.samplerate,
+                           EBUR128_MODE_I | EBUR128_MODE_TRUE_PEAK);
+  buffer = (double*) malloc((size_t) file_info.samplerate *
+                            (size_t) file_info.channels * sizeof(double));
+  while ((nr_frames_read = sf_readf_double(
+              file, buffer, (sf_count_t) file_info.samplerate))) {
+    if (!half && frames >= file_info.frames / 2) {
+      ebur128_hibernate(st);
+      half = 1;
+    }
+    ebur128_add_frames_double(st, buffer, (size_t) nr_frames_read);
+    ebur128_add_frames_double(halves[half], buffer, (size_t) nr_frames_read);
+    frames += nr_frames_read;
+  }
+
+  ebur128_loudness_global(st, &gated_loudness);
+  ebur128_loudness_global_multiple(halves, 2, &halves_loudness);
+  ebur128_destroy(&st);
+  ebur128_destroy(&halves[0]);
+  ebur128_destroy(&halves[1]);
+
+  free(buffer);
+  if (sf_close(file)) {
+    fprintf(stderr, "Could not close input file!\n");
+  }
+  return fabs(gated_loudness - halves_loudness);
+}
+
+/* Largest difference of the global loudness and the loudness range with and
+ * without block files. The file is repeated for more than 1024 short-term
+ * blocks, so that blocks of both kinds move to the files. */
+double test_block_files(const char* filename) {
+  SF_INFO file_info;
+  ebur128_state* st[2] = { NULL, NULL };
+  double loudness[2] = { 0.0, 0.0 };
+  double range[2] = { 0.0, 0.0 };
+  double* buffer;
+  size_t repeats, r;
+  int i;
+
+  buffer = read_file(filename, &file_info);
+  if (!buffer) {
+    return HUGE_VAL;
+  }
+  repeats = (size_t) (1100 * file_info.samplerate / file_info.frames) + 1;
+  for (i = 0; i < 2; ++i) {
+    st[i] = ebur128_init((unsigned) file_info.channels,
+                         (unsigned) file_info.samplerate,
+                         EBUR128_MODE_I | EBUR128_MODE_LRA);
+  }
+  if (ebur128_set_block_files(st[1], "blocks.bin", "short_term_blocks.bin")) {
+    fprintf(stderr, "Could not create block files!\n");
+  }
+  for (r = 0; r < repeats; ++r) {
+    for (i = 0; i < 2; ++i) {
+      ebur128_add_frames_double(st[i], buffer, (size_t) file_info.frames);
+    }
+  }
+  for (i = 0; i < 2; ++i) {
+    ebur128_loudness_global(st[i], &loudness[i]);
+    ebur128_loudness_range(st[i], &range[i]);
+    ebur128_destroy(&st[i]);
+  }
+  remove("blocks.bin");
+  remove("short_term_blocks.bin");
+
+  free(buffer);
+  return fmax(fabs(loudness[0] - loudness[1]), fabs(range[0] - range[1]));
+}
+
+#if defined(__linux__)
+/* First error while 300 s of a sine go to a block file on a full device. */
+int test_block_files_error(void) {
+  ebur128_state* st;
+  double buffer[2 * 48000];
+  double loudness;
+  int errcode = EBUR128_SUCCESS;
+  int i;
+
+  for (i = 0; i < 48000; ++i) {
+    buffer[2 * i] = buffer[2 * i + 1] = 0.5 * sin(2.0 * M_PI * i / 48.0);
+  }
+  st = ebur128_init(2, 48000, EBUR128_MODE_I);
+  if (ebur128_set_block_files(st, "/dev/full", NULL)) {
+    ebur128_destroy(&st);
+    return EBUR128_SUCCESS;
+  }
+  for (i = 0; i < 300 && !errcode; ++i) {
+    errcode = ebur128_add_frames_double(st, buffer, 48000);
+  }
+  if (!errcode) {
+    errcode = ebur128_loudness_global(st, &loudness);
+  }
+  ebur128_destroy(&st);
+  return errcode;
+}
+#endif
+
+/* Largest difference of the global loudness and the loudness range of a state
+ * fed through an ebur128_async and of one fed directly. */
+double test_async(const char* filename) {
+  SF_INFO file_info;
+  ebur128_state* st[2] = { NULL, NULL };
+  ebur128_async* as;
+  double loudness[2] = { 0.0, 0.0 };
+  double range[2] = { 0.0, 0.0 };
+  double* buffer;
+  size_t frames, chunk;
+  int errcode = EBUR128_SUCCESS;
+  int i;
+
+  buffer = read_file(filename, &file_info);
+  if (!buffer) {
+    return HUGE_VAL;
+  }
+  for (i = 0; i < 2; ++i) {
+    st[i] = ebur128_init((unsigned) file_info.channels,
+                         (unsigned) file_info.samplerate,
+                         EBUR128_MODE_I | EBUR128_MODE_LRA);
+  }
+  as = ebur128_async_create(st[1], (size_t) file_info.samplerate);
+  if (!as) {
+    fprintf(stderr, "Could not create async wrapper!\n");
+    return HUGE_VAL;
+  }
+  /* Odd chunk sizes, so that chunks wrap around the end of the ring. */
+  for (frames = 0, chunk = 1; frames < (size_t) file_info.frames;
+       frames += chunk, chunk = chunk * 7 % 9973) {
+    if (chunk > (size_t) file_info.frames - frames) {
+      chunk = (size_t) file_info.frames - frames;
+    }
+    ebur128_add_frames_double(
+        st[0], buffer + frames * (size_t) file_info.channels, chunk);
+    while (ebur128_async_add_frames_double(
+               as, buffer + frames * (size_t) file_info.channels, chunk) ==
+           EBUR128_ERROR_NOMEM) {
+      errcode |= ebur128_async_flush(as);
+    }
+  }
+  errcode |= ebur128_async_flush(as);
+  ebur128_async_destroy(&as);
+  for (i = 0; i < 2; ++i) {
+    ebur128_loudness_global(st[i], &loudness[i]);
+    ebur128_loudness_range(st[i], &range[i]);
+    ebur128_destroy(&st[i]);
+  }
+
+  free(buffer);
+  if (errcode) {
+    return HUGE_VAL;
+  }
+  return fmax(fabs(loudness[0] - loudness[1]), fabs(range[0] - range[1]));
+}
+
+#if defined(__linux__)
+/* An ebur128_async reports the error of a block file on a full device, and
+ * keeps processing the frames that follow. */
+int test_async_error(void) {
+  ebur128_state* st;
+  ebur128_async* as;
+  double buffer[2 * 48000];
+  double momentary = 0.0;
+  int errcode = EBUR128_SUCCESS;
+  int ok = 0;
+  int i;
+
+  for (i = 0; i < 48000; ++i) {
+    buffer[2 * i] = buffer[2 * i + 1] = 0.5 * sin(2.0 * M_PI * i / 48.0);
+  }
+  st = ebur128_init(2, 48000, EBUR128_MODE_I);
+  if (ebur128_set_block_files(st, "/dev/full", NULL)) {
+    ebur128_destroy(&st);
+    return 0;
+  }
+  as = ebur128_async_create(st, 48000);
+  if (!as) {
+    ebur128_destroy(&st);
+    return 0;
+  }
+  for (i = 0; i < 300; ++i) {
+    ebur128_async_add_frames_double(as, buffer, 48000);
+    if (!errcode) {
+      errcode = ebur128_async_flush(as);
+    }
+  }
+  /* Silence after the error must still reach the state. */
+  memset(buffer, '\0', sizeof(buffer));
+  for (i = 0; i < 3; ++i) {
+    ebur128_async_add_frames_double(as, buffer, 48000);
+    ebur128_async_flush(as);
+  }
+  ebur128_async_loudness_momentary(as, &momentary);
+  if (errcode == EBUR128_ERROR_IO && momentary == -HUGE_VAL) {
+    ok = 1;
+  }
+  ebur128_async_destroy(&as);
+  ebur128_destroy(&st);
+  return ok;
+}
+#endif
+
+int compare_double(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return (x > y) - (x < y);
+}
+
+/* Seconds of audio in test_lra_sketch_epsilon(). */
+#define SKETCH_TEST_SECONDS 600
+
+/* Measure the loudness range of a sine with a varying level with a list and
+ * with sketches of a coarse and a fine epsilon. The short-term loudness is
+ * read after every second, as the states take their short-term blocks. The
+ * percentiles of the sketches may be off by the documented rank error of
+ * epsilon times the number of blocks. Invalid epsilons have to be rejected.
+ * Returns 1 if all checks pass. */
+int test_lra_sketch_epsilon(void) {
+  static const double epsilons[2] = { 0.1, 0.001 };
+  ebur128_state* list;
+  ebur128_state* sketch[2];
+  double buffer[2 * 8000];
+  double shortterm[SKETCH_TEST_SECONDS];
+  double range, sketch_range, mean, level;
+  size_t blocks = 0, gated = 0;
+  size_t low, high, error;
+  size_t low_ranks[2], high_ranks[2];
+  int ok = 1;
+  int s, i, k;
+
+  list = ebur128_init(2, 8000, EBUR128_MODE_LRA);
+  for (k = 0; k < 2; ++k) {
+    sketch[k] = ebur128_init(2, 8000, EBUR128_MODE_LRA_SKETCH);
+    if (ebur128_set_lra_sketch_epsilon(sketch[k], epsilons[k])) {
+      ok = 0;
+    }
+  }
+  if (ebur128_set_lra_sketch_epsilon(sketch[0], epsilons[0]) !=
+          EBUR128_ERROR_NO_CHANGE ||
+      ebur128_set_lra_sketch_epsilon(sketch[0], 0.0) !=
+          EBUR128_ERROR_INVALID_MODE ||
+      ebur128_set_lra_sketch_epsilon(sketch[0], 1.0) !=
+          EBUR128_ERROR_INVALID_MODE ||
+      ebur128_set_lra_sketch_epsilon(sketch[0], -0.5) !=
+          EBUR128_ERROR_INVALID_MODE ||
+      ebur128_set_lra_sketch_epsilon(sketch[0], sqrt(-1.0)) !=
+          EBUR128_ERROR_INVALID_MODE ||
+      ebur128_set_lra_sketch_epsilon(list, 0.01) !=
+          EBUR128_ERROR_INVALID_MODE) {
+    ok = 0;
+  }
+
+  for (s = 0; s < SKETCH_TEST_SECONDS; ++s) {
+    for (i = 0; i < 8000; ++i) {
+      double t = s + i / 8000.0;
+      level = -40.0 + 15.0 * sin(0.37 * t) + 8.0 * sin(1.3 * t);
+      buffer[2 * i] = buffer[2 * i + 1] =
+          pow(10.0, level / 20.0) * sin(2.0 * M_PI * i / 8.0);
+    }
+    ebur128_add_frames_double(list, buffer, 8000);
+    for (k = 0; k < 2; ++k) {
+      ebur128_add_frames_double(sketch[k], buffer, 8000);
+    }
+    if (s >= 2) {
+      ebur128_loudness_shortterm(list, &shortterm[blocks++]);
+    }
+  }
+
+  /* The absolute and relative gates of the loudness range. */
+  mean = 0.0;
+  for (i = 0; i < (int) blocks; ++i) {
+    if (shortterm[i] >= -70.0) {
+      shortterm[gated++] = shortterm[i];
+      mean += pow(10.0, shortterm[i] / 10.0);
+    }
+  }
+  mean = 10.0 * log10(mean / (double) gated) - 20.0;
+  qsort(shortterm, gated, sizeof(double), compare_double);
+  i = 0;
+  while (i < (int) gated && shortterm[i] < mean) {
+    ++i;
+  }
+  memmove(shortterm, shortterm + i, (gated - (size_t) i) * sizeof(double));
+  gated -= (size_t) i;
+  low = (size_t) ((gated - 1) * 0.1 + 0.5);
+  high = (size_t) ((gated - 1) * 0.95 + 0.5);
+
+  ebur128_loudness_range(list, &range);
+  if (fabs(range - (shortterm[high] - shortterm[low])) > 1e-9) {
+    ok = 0;
+  }
+  for (k = 0; k < 2; ++k) {
+    error = (size_t) ceil(epsilons[k] * (double) gated) + 1;
+    ebur128_loudness_range(sketch[k], &sketch_range);
+    /* The ranks the percentiles may be taken from, within the blocks. */
+    low_ranks[0] = low > error ? low - error : 0;
+    low_ranks[1] = low + error < gated ? low + error : gated - 1;
+    high_ranks[0] = high > error ? high - error : 0;
+    high_ranks[1] = high + error < gated ? high + error : gated - 1;
+    if (sketch_range < shortterm[high_ranks[0]] - shortterm[low_ranks[1]] ||
+        sketch_range > shortterm[high_ranks[1]] - shortterm[low_ranks[0]]) {
+      fprintf(stderr, "sketch epsilon %f: %f, list %f\n", epsilons[k],
+              sketch_range, range);
+      ok = 0;
+    }
+    ebur128_destroy(&sketch[k]);
+  }
+  ebur128_destroy(&list);
+  return ok;
+}
+
+/* Segments of 5s of a sine at these levels in LUFS in
+ * test_loudness_range_with_gain(). */
+static const double lra_gain_levels[] = { -85.0, -80.0, -75.0, -72.0,
+                                          -68.0, -65.0, -62.0, -78.0,
+                                          -88.0, -66.0, -71.0, -60.0 };
+#define LRA_GAIN_SEGMENTS (sizeof(lra_gain_levels) / sizeof(double))
+
+/* Compare ebur128_loudness_range_with_gain() with a new analysis of the
+ * audio after the gain, for gains that move blocks across the absolute gate
+ * in both directions. Blocks below the gate count with the centre of their
+ * 0.1 LU bin. Returns the largest difference in LU. */
+double test_loudness_range_with_gain(int mode) {
+  static const double gains[] = { 20.0, -5.0 };
+  ebur128_state* st;
+  ebur128_state* gained;
+  double* buffer;
+  size_t frames = LRA_GAIN_SEGMENTS * 5 * 48000;
+  double range[2];
+  double difference = 0.0;
+  double amplitude;
+  size_t i, g;
+
+  buffer = (double*) malloc(frames * 2 * sizeof(double));
+  for (i = 0; i < frames; ++i) {
+    amplitude = pow(10.0, lra_gain_levels[i / (5 * 48000)] / 20.0);
+    buffer[2 * i] = buffer[2 * i + 1] = amplitude * sin(2.0 * M_PI * i / 48.0);
+  }
+  st = ebur128_init(2, 48000, mode);
+  ebur128_add_frames_double(st, buffer, frames);
+  for (g = 0; g < sizeof(gains) / sizeof(gains[0]); ++g) {
+    double factor = pow(10.0, gains[g] / 20.0);
+    gained = ebur128_init(2, 48000, mode);
+    for (i = 0; i < frames * 2; ++i) {
+      buffer[i] *= factor;
+    }
+    ebur128_add_frames_double(gained, buffer, frames);
+    for (i = 0; i < frames * 2; ++i) {
+      buffer[i] /= factor;
+    }
+    ebur128_loudness_range_with_gain(st, gains[g], &range[0]);
+    ebur128_loudness_range(gained, &range[1]);
+    ebur128_destroy(&gained);
+    difference = fmax(difference, fabs(range[0] - range[1]));
+  }
+  ebur128_destroy(&st);
+
+  free(buffer);
+  return difference;
+}
+
+/* Feed two stems, the file and the file with its channels reversed, and a
+ * state the mix of them, with the second channel as left surround. Returns
+ * the largest difference of the momentary and short-term loudness after
+ * each second, or HUGE_VAL on error. */
+double test_stems_mix(const char* filename) {
+  SF_INFO file_info;
+  ebur128_stems* stems;
+  ebur128_state* st;
+  double gains[2] = { 0.5, 1.5 };
+  double loudness[2];
+  double difference = 0.0;
+  double* buffer;
+  double* wide;
+  double* mix;
+  size_t frames, chunk, f;
+  int channels, c;
+  int k;
+
+  buffer = read_file(filename, &file_info);
+  if (!buffer) {
+    return HUGE_VAL;
+  }
+  channels = file_info.channels;
+  wide = (double*) malloc(2 * (size_t) file_info.frames * (size_t) channels *
+                          sizeof(double));
+  mix = (double*) malloc((size_t) file_info.frames * (size_t) channels *
+                         sizeof(double));
+  for (f = 0; f < (size_t) file_info.frames; ++f) {
+    for (c = 0; c < channels; ++c) {
+      double a = buffer[f * (size_t) channels + (size_t) c];
+      double b = buffer[f * (size_t) channels + (size_t) (channels - 1 - c)];
+      wide[f * 2 * (size_t) channels + (size_t) c] = a;
+      wide[(f * 2 + 1) * (size_t) channels + (size_t) c] = b;
+      mix[f * (size_t) channels + (size_t) c] = gains[0] * a + gains[1] * b;
+    }
+  }
+
+  stems = ebur128_stems_create((unsigned) channels,
+                               (unsigned long) file_info.samplerate, 2);
+  st = ebur128_init((unsigned) channels, (unsigned long) file_info.samplerate,
+                    EBUR128_MODE_M | EBUR128_MODE_S);
+  if (channels > 1) {
+    if (ebur128_stems_set_channel(stems, 1, EBUR128_LEFT_SURROUND) ||
+        ebur128_set_channel(st, 1, EBUR128_LEFT_SURROUND)) {
+      difference = HUGE_VAL;
+    }
+  }
+  if (ebur128_stems_set_channel(stems, (unsigned) channels, EBUR128_LEFT) !=
+      EBUR128_ERROR_INVALID_CHANNEL_INDEX) {
+    difference = HUGE_VAL;
+  }
+  for (frames = 0; frames < (size_t) file_info.frames; frames += chunk) {
+    chunk = (size_t) file_info.samplerate;
+    if (chunk > (size_t) file_info.frames - frames) {
+      chunk = (size_t) file_info.frames - frames;
+    }
+    ebur128_stems_add_frames_double(
+        stems, wide + frames * 2 * (size_t) channels, chunk);
+    ebur128_add_frames_double(st, mix + frames * (size_t) channels, chunk);
+    for (k = 0; k < 2; ++k) {
+      if (k == 0) {
+        ebur128_stems_loudness_momentary(stems, gains, &loudness[0]);
+        ebur128_loudness_momentary(st, &loudness[1]);
+      } else {
+        ebur128_stems_loudness_shortterm(stems, gains, &loudness[0]);
+        ebur128_loudness_shortterm(st, &loudness[1]);
+      }
+      /* Both are -HUGE_VAL in silence. */
+      if (loudness[0] != loudness[1]) {
+        difference = fmax(difference, fabs(loudness[0] - loudness[1]));
+      }
+    }
+  }
+  ebur128_destroy(&st);
+  ebur128_stems_destroy(&stems);
+  /* Destroying them again does nothing. */
+  ebur128_stems_destroy(&stems);
+
+  free(mix);
+  free(wide);
+  free(buffer);
+  return difference;
+}
+
+/* Frames, buckets and guard floats of test_overview(). */
+#define OVERVIEW_TEST_FRAMES 10500
+#define OVERVIEW_TEST_BUCKET 1000
+#define OVERVIEW_TEST_BUCKETS 16
+#define OVERVIEW_TEST_SHORT_BUCKETS 8
+#define OVERVIEW_TEST_GUARD 12345.0f
+
+/* Take overviews of a stereo stream of shorts with the engine of "mode":
+ * one with room for all buckets, including a partial last bucket, and one
+ * with room for fewer buckets, followed by guard values. Min, max and RMS
+ * are compared to a direct computation. Returns 1 if they match. */
+int test_overview(int mode) {
+  ebur128_state* st[2];
+  short frames[OVERVIEW_TEST_FRAMES * 2];
+  float overview[2][(OVERVIEW_TEST_BUCKETS + 1) * 2 * 3];
+  size_t buckets[2] = { OVERVIEW_TEST_BUCKETS, OVERVIEW_TEST_SHORT_BUCKETS };
+  size_t written[2] = { 0, 0 };
+  size_t added, chunk, b, f, i;
+  unsigned int c;
+  int ok = 1;
+  int k;
+
+  for (f = 0; f < OVERVIEW_TEST_FRAMES; ++f) {
+    for (c = 0; c < 2; ++c) {
+      frames[f * 2 + c] = (short) (20000.0 * sin(0.013 * (c + 1) * f) +
+                                   (double) (f * 7919 % 101) - 50.0);
+    }
+  }
+  for (k = 0; k < 2; ++k) {
+    for (i = 0; i < (OVERVIEW_TEST_BUCKETS + 1) * 2 * 3; ++i) {
+      overview[k][i] = OVERVIEW_TEST_GUARD;
+    }
+    st[k] = ebur128_init(2, 48000, mode | EBUR128_MODE_SAMPLE_PEAK);
+    ebur128_set_overview(st[k], OVERVIEW_TEST_BUCKET, overview[k],
+                         buckets[k]);
+    for (added = 0, chunk = 1; added < OVERVIEW_TEST_FRAMES;
+         added += chunk, chunk = chunk * 7 % 997) {
+      if (chunk > OVERVIEW_TEST_FRAMES - added) {
+        chunk = OVERVIEW_TEST_FRAMES - added;
+      }
+      ebur128_add_frames_short(st[k], frames + added * 2, chunk);
+    }
+    ebur128_overview_buckets(st[k], &written[k]);
+    ebur128_destroy(&st[k]);
+  }
+  /* The last bucket holds the 500 frames after 10 full buckets. */
+  if (written[0] != 11 || written[1] != OVERVIEW_TEST_SHORT_BUCKETS) {
+    ok = 0;
+  }
+
+  for (k = 0; k < 2; ++k) {
+    for (b = 0; b < written[k]; ++b) {
+      for (c = 0; c < 2; ++c) {
+        const float* out = overview[k] + (b * 2 + c) * 3;
+        double lo = HUGE_VAL, hi = -HUGE_VAL, sum = 0.0, rms;
+        size_t end = (b + 1) * OVERVIEW_TEST_BUCKET;
+        if (end > OVERVIEW_TEST_FRAMES) {
+          end = OVERVIEW_TEST_FRAMES;
+        }
+        for (f = b * OVERVIEW_TEST_BUCKET; f < end; ++f) {
+          double cur = frames[f * 2 + c] / 32768.0;
+          lo = fmin(lo, cur);
+          hi = fmax(hi, cur);
+          sum += cur * cur;
+        }
+        rms = sqrt(sum / (double) (end - b * OVERVIEW_TEST_BUCKET));
+        if (out[0] != (float) lo || out[1] != (float) hi ||
+            fabs(out[2] - rms) > 1e-6 * rms) {
+          ok = 0;
+        }
+      }
+    }
+    /* Nothing is written past the buckets. */
+    for (i = written[k] * 2 * 3; i < (OVERVIEW_TEST_BUCKETS + 1) * 2 * 3;
+         ++i) {
+      if (overview[k][i] != OVERVIEW_TEST_GUARD) {
+        ok = 0;
+      }
+    }
+  }
+  return ok;
+}
+
+/* Compare the peaks of a normalizer with those of a new state fed the frames
+ * it wrote, as floats or as shorts. Returns 1 if they are the same. */
+int normalizer_peaks_match(ebur128_normalizer* n,
+                           const SF_INFO* file_info,
+                           const void* frames,
+                           int is_float) {
+  ebur128_state* st;
+  double peak[2], true_peak[2];
+  unsigned int c;
+  int ok = 1;
+
+  st = ebur128_init((unsigned) file_info->channels,
+                    (unsigned) file_info->samplerate,
+                    EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_TRUE_PEAK);
+  if (is_float) {
+    ebur128_add_frames_float(st, (const float*) frames,
+                             (size_t) file_info->frames);
+  } else {
+    ebur128_add_frames_short(st, (const short*) frames,
+                             (size_t) file_info->frames);
+  }
+  for (c = 0; c < st->channels; ++c) {
+    ebur128_sample_peak(st, c, &peak[0]);
+    ebur128_true_peak(st, c, &true_peak[0]);
+    ebur128_normalizer_sample_peak(n, c, &peak[1]);
+    ebur128_normalizer_true_peak(n, c, &true_peak[1]);
+    if (peak[0] != peak[1] || true_peak[0] != true_peak[1]) {
+      ok = 0;
+    }
+  }
+  ebur128_destroy(&st);
+  return ok;
+}
+
+/* Normalize a file to -14 LUFS with a ceiling of -1 dBTP, as floats and as
+ * shorts. The peaks tracked by the normalizers must equal those of a new
+ * analysis of the normalized frames. A ceiling of -20 dBTP has to lower the
+ * gain so that the true peak meets it. Returns 1 if all checks pass. */
+int test_normalizer(const char* filename) {
+  SF_INFO file_info;
+  ebur128_state* st;
+  ebur128_normalizer* n;
+  double* buffer;
+  float* float_frames;
+  short* short_frames;
+  double loudness, peak, channel_peak;
+  double gain, clamped_gain;
+  size_t i, samples;
+  unsigned int c;
+  int ok = 1;
+
+  buffer = read_file(filename, &file_info);
+  if (!buffer) {
+    return 0;
+  }
+  samples = (size_t) file_info.frames * (size_t) file_info.channels;
+  float_frames = (float*) malloc(samples * sizeof(float));
+  short_frames = (short*) malloc(samples * sizeof(short));
+  for (i = 0; i < samples; ++i) {
+    float_frames[i] = (float) buffer[i];
+    short_frames[i] = (short) floor(buffer[i] * 32767.0 + 0.5);
+  }
+
+  st = ebur128_init((unsigned) file_info.channels,
+                    (unsigned) file_info.samplerate,
+                    EBUR128_MODE_I | EBUR128_MODE_TRUE_PEAK);
+  ebur128_add_frames_float(st, float_frames, (size_t) file_info.frames);
+  ebur128_loudness_global(st, &loudness);
+  for (c = 0, peak = 0.0; c < st->channels; ++c) {
+    ebur128_true_peak(st, c, &channel_peak);
+    peak = fmax(peak, channel_peak);
+  }
+  ebur128_normalization_gain(st, -14.0, -1.0, &gain);
+  ebur128_normalization_gain(st, -14.0, -20.0, &clamped_gain);
+  ebur128_destroy(&st);
+
+  /* The ceiling lowers the gain only where the true peak would exceed it. */
+  if (gain > -14.0 - loudness + 1e-9 ||
+      20.0 * log10(peak) + gain > -1.0 + 1e-9 ||
+      clamped_gain >= -14.0 - loudness ||
+      fabs(20.0 * log10(peak) + clamped_gain + 20.0) > 1e-9) {
+    ok = 0;
+  }
+
+  n = ebur128_normalizer_create((unsigned) file_info.channels,
+                                (unsigned long) file_info.samplerate, gain);
+  ebur128_normalizer_apply_float(n, float_frames, (size_t) file_info.frames);
+  ok &= normalizer_peaks_match(n, &file_info, float_frames, 1);
+  ebur128_normalizer_destroy(&n);
+
+  n = ebur128_normalizer_create((unsigned) file_info.channels,
+                                (unsigned long) file_info.samplerate, gain);
+  ebur128_normalizer_apply_short(n, short_frames, (size_t) file_info.frames);
+  ok &= normalizer_peaks_match(n, &file_info, short_frames, 0);
+  ebur128_normalizer_destroy(&n);
+  /* Destroying it again does nothing. */
+  ebur128_normalizer_destroy(&n);
+
+  free(short_frames);
+  free(float_frames);
+  free(buffer);
+  return ok;
+}
+
+/* Number of channels of the stream in test_threads(). */
+#define THREADS_TEST_CHANNELS 24
+
+/* Compare a state filtering with several threads to one with a single thread.
+ * The channels of the file are repeated with different gains. Returns 1 if
+ * the results are the same. */
+int test_threads(const char* filename) {
+  SF_INFO file_info;
+  ebur128_state* st[2] = { NULL, NULL };
+  double loudness[2] = { 0.0, 0.0 };
+  double range[2] = { 0.0, 0.0 };
+  double peak[2] = { 0.0, 0.0 };
+  double true_peak[2] = { 0.0, 0.0 };
+  double* input;
+  double* buffer;
+  size_t frames, chunk, f;
+  unsigned int c;
+  int ok = 1;
+  int i;
+
+  input = read_file(filename, &file_info);
+  if (!input) {
+    return 0;
+  }
+  buffer = (double*) malloc((size_t) file_info.frames * THREADS_TEST_CHANNELS *
+                            sizeof(double));
+  for (f = 0; f < (size_t) file_info.frames; ++f) {
+    for (c = 0; c < THREADS_TEST_CHANNELS; ++c) {
+      buffer[f * THREADS_TEST_CHANNELS + c] =
+          input[f * (size_t) file_info.channels +
+                c % (unsigned int) file_info.channels] *
+          (1.0 - c / 48.0);
+    }
+  }
+  for (i = 0; i < 2; ++i) {
+    st[i] = ebur128_init(THREADS_TEST_CHANNELS,
+                         (unsigned) file_info.samplerate,
+                         EBUR128_MODE_I | EBUR128_MODE_LRA |
+                             EBUR128_MODE_SAMPLE_PEAK |
+                             EBUR128_MODE_TRUE_PEAK);
+    for (c = 0; c < THREADS_TEST_CHANNELS; ++c) {
+      ebur128_set_channel(st[i], c, EBUR128_LEFT);
+    }
+  }
+  /* Groups of 8 channels for the calling thread and two workers. */
+  if (ebur128_set_threads(st[1], 3)) {
+    ok = 0;
+  }
+  for (frames = 0, chunk = 1; frames < (size_t) file_info.frames;
+       frames += chunk, chunk = chunk * 7 % 9973) {
+    if (chunk > (size_t) file_info.frames - frames) {
+      chunk = (size_t) file_info.frames - frames;
+    }
+    for (i = 0; i < 2; ++i) {
+      ebur128_add_frames_double(
+          st[i], buffer + frames * THREADS_TEST_CHANNELS, chunk);
+    }
+  }
+  for (c = 0; c < THREADS_TEST_CHANNELS; ++c) {
+    for (i = 0; i < 2; ++i) {
+      ebur128_sample_peak(st[i], c, &peak[i]);
+      ebur128_true_peak(st[i], c, &true_peak[i]);
+    }
+    if (peak[0] != peak[1] || true_peak[0] != true_peak[1]) {
+      ok = 0;
+    }
+  }
+  for (i = 0; i < 2; ++i) {
+    ebur128_loudness_global(st[i], &loudness[i]);
+    ebur128_loudness_range(st[i], &range[i]);
+    ebur128_destroy(&st[i]);
+  }
+  if (loudness[0] != loudness[1] || range[0] != range[1]) {
+    ok = 0;
+  }
+
+  free(buffer);
+  free(input);
+  return ok;
+}
+
+/* Put peaks at known frames of a quiet sine, and check the reported
+ * positions. The stream is added in chunks that do not line up with the
+ * peaks. Returns 1 if the positions are right. */
+int test_peak_frame(void) {
+  ebur128_state* st;
+  double* buffer;
+  size_t frames = 10 * 48000;
+  size_t peaks[2] = { 123457, 301111 };
+  size_t added, chunk, i;
+  unsigned long long position[4] = { 0, 0, 0, 0 };
+  int ok;
+
+  buffer = (double*) malloc(frames * 2 * sizeof(double));
+  for (i = 0; i < frames; ++i) {
+    buffer[2 * i] = buffer[2 * i + 1] = 0.1 * sin(2.0 * M_PI * i / 48.0);
+  }
+  buffer[2 * peaks[0]] = 0.9;
+  buffer[2 * peaks[1] + 1] = -0.8;
+  /* A later peak of the same height does not move the position. */
+  buffer[2 * (peaks[1] + 1000)] = 0.9;
+  st = ebur128_init(2, 48000,
+                    EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_TRUE_PEAK);
+  for (added = 0, chunk = 1; added < frames;
+       added += chunk, chunk = chunk * 7 % 9973) {
+    if (chunk > frames - added) {
+      chunk = frames - added;
+    }
+    ebur128_add_frames_double(st, buffer + 2 * added, chunk);
+  }
+  ebur128_sample_peak_frame(st, 0, &position[0]);
+  ebur128_sample_peak_frame(st, 1, &position[1]);
+  ebur128_true_peak_frame(st, 0, &position[2]);
+  ebur128_true_peak_frame(st, 1, &position[3]);
+  ok = position[0] == peaks[0] && position[1] == peaks[1] &&
+       position[2] == peaks[0] && position[3] == peaks[1];
+  if (!ok) {
+    fprintf(stderr, "peak frames: %llu %llu %llu %llu\n", position[0],
+            position[1], position[2], position[3]);
+  }
+  ebur128_destroy(&st);
+
+  free(buffer);
+  return ok;
+}
+
+/* Check after each chunk that a peak is in the sliding windows while it is
+ * less than the window length old, and gone once it is older than the window
+ * and the partly filled segment. Returns 1 if it is. */
+int test_peak_window(void) {
+  ebur128_state* st;
+  double* buffer;
+  size_t frames = 5 * 48000;
+  size_t peak = 2 * 48000 + 17;
+  size_t added, chunk, i;
+  double window[2] = { 0.0, 0.0 };
+  int ok = 1;
+
+  buffer = (double*) malloc(frames * 2 * sizeof(double));
+  for (i = 0; i < frames; ++i) {
+    buffer[2 * i] = buffer[2 * i + 1] = 0.1 * sin(2.0 * M_PI * i / 48.0);
+  }
+  buffer[2 * peak] = 0.9;
+  st = ebur128_init(2, 48000,
+                    EBUR128_MODE_SAMPLE_PEAK | EBUR128_MODE_TRUE_PEAK);
+  ebur128_set_sample_peak_window(st, 1000);
+  ebur128_set_true_peak_window(st, 1000);
+  for (added = 0, chunk = 1; added < frames;
+       added += chunk, chunk = chunk * 7 % 997) {
+    if (chunk > frames - added) {
+      chunk = frames - added;
+    }
+    ebur128_add_frames_double(st, buffer + 2 * added, chunk);
+    ebur128_sample_peak_window(st, 0, &window[0]);
+    ebur128_true_peak_window(st, 0, &window[1]);
+    if (added + chunk > peak && added + chunk <= peak + 48000) {
+      ok &= window[0] == 0.9 && window[1] >= 0.9;
+    } else if (added + chunk <= peak || added + chunk > peak + 52800) {
+      ok &= window[0] < 0.2 && window[1] < 0.2;
+    }
+  }
+  ebur128_destroy(&st);
+
+  free(buffer);
+  return ok;
+}
+
+/* Number of files in test_digest(). */
+#define DIGEST_TEST_FILES 3
+
+/* Measure files, pass the digests of the states through serialization and
+ * merge them. Returns the largest difference of the integrated loudness and
+ * loudness range of the merged digest from those of the states, or HUGE_VAL
+ * if the peaks differ or a digest could not be made. */
+double test_digest(const char* const* filenames) {
   SF_INFO file_info;
-  SNDFILE* file;
-  sf_count_t nr_frames_read;
+  ebur128_state* st[DIGEST_TEST_FILES] = { NULL };
+  ebur128_digest* digests[DIGEST_TEST_FILES] = { NULL };
+  ebur128_digest* merged = NULL;
+  unsigned char* serialized;
+  double* buffer;
+  double loudness[2] = { 0.0, 0.0 };
+  double range[2] = { 0.0, 0.0 };
+  double peak[2] = { 0.0, 0.0 };
+  double true_peak[2] = { 0.0, 0.0 };
+  double channel_peak;
+  double result = HUGE_VAL;
+  size_t size;
+  unsigned int c;
+  int i;
 
-  ebur128_state* st = NULL;
-  double gated_loudness;
+  for (i = 0; i < DIGEST_TEST_FILES; ++i) {
+    buffer = read_file(filenames[i], &file_info);
+    if (!buffer) {
+      goto destroy;
+    }
+    st[i] = ebur128_init((unsigned) file_info.channels,
+                         (unsigned) file_info.samplerate,
+                         EBUR128_MODE_I | EBUR128_MODE_LRA |
+                             EBUR128_MODE_SAMPLE_PEAK |
+                             EBUR128_MODE_TRUE_PEAK | EBUR128_MODE_HISTOGRAM);
+    ebur128_add_frames_double(st[i], buffer, (size_t) file_info.frames);
+    free(buffer);
+    for (c = 0; c < st[i]->channels; ++c) {
+      ebur128_sample_peak(st[i], c, &channel_peak);
+      peak[0] = fmax(peak[0], channel_peak);
+      ebur128_true_peak(st[i], c, &channel_peak);
+      true_peak[0] = fmax(true_peak[0], channel_peak);
+    }
+
+    merged = ebur128_digest_create(st[i]);
+    if (!merged) {
+      goto destroy;
+    }
+    size = ebur128_digest_serialized_size(merged);
+    serialized = (unsigned char*) malloc(size);
+    if (ebur128_digest_serialize(merged, serialized) == size) {
+      digests[i] = ebur128_digest_deserialize(serialized, size);
+    }
+    free(serialized);
+    ebur128_digest_destroy(&merged);
+    if (!digests[i]) {
+      goto destroy;
+    }
+  }
+
+  for (i = 1; i < DIGEST_TEST_FILES; ++i) {
+    ebur128_digest_merge(digests[0], digests[i]);
+  }
+  ebur128_loudness_global_multiple(st, DIGEST_TEST_FILES, &loudness[0]);
+  ebur128_loudness_range_multiple(st, DIGEST_TEST_FILES, &range[0]);
+  ebur128_digest_loudness_global_multiple(digests, 1, &loudness[1]);
+  ebur128_digest_loudness_range_multiple(digests, 1, &range[1]);
+  ebur128_digest_sample_peak(digests[0], &peak[1]);
+  ebur128_digest_true_peak(digests[0], &true_peak[1]);
+  if (peak[0] == peak[1] && true_peak[0] == true_peak[1]) {
+    result = fmax(fabs(loudness[0] - loudness[1]), fabs(range[0] - range[1]));
+  }
+
+destroy:
+  for (i = 0; i < DIGEST_TEST_FILES; ++i) {
+    if (st[i]) {
+      ebur128_destroy(&st[i]);
+    }
+    if (digests[i]) {
+      ebur128_digest_destroy(&digests[i]);
+    }
+  }
+  return result;
+}
+
+/* A serialized digest with a short-term bin given twice is rejected. After a
+ * header of 24 bytes come the block bins of 34 bytes and the short-term bins
+ * of 10 bytes, each preceded by their count of 4 bytes. Returns 1 if it is. */
+int test_digest_duplicate_bin(const char* filename) {
+  SF_INFO file_info;
+  ebur128_state* st;
+  ebur128_digest* digest;
+  unsigned char* serialized;
+  unsigned char* count;
   double* buffer;
+  size_t size, bins;
+  int ok = 0;
 
-  memset(&file_info, '\0', sizeof(file_info));
-  file = sf_open(filename, SFM_READ, &file_info);
-  if (!file) {
-    fprintf(stderr, "Could not open file %s!\n", filename);
-    return 0.0;
+  buffer = read_file(filename, &file_info);
+  if (!buffer) {
+    return 0;
   }
   st = ebur128_init((unsigned) file_info.channels,
-                    (unsigned) file_info.samplerate, EBUR128_MODE_I);
-  if (file_info.channels == 5) {
-    ebur128_set_channel(st, 0, EBUR128_LEFT);
-    ebur128_set_channel(st, 1, EBUR128_RIGHT);
-    ebur128_set_channel(st, 2, EBUR128_CENTER);
-    ebur128_set_channel(st, 3, EBUR128_LEFT_SURROUND);
-    ebur128_set_channel(st, 4, EBUR128_RIGHT_SURROUND);
+                    (unsigned) file_info.samplerate,
+                    EBUR128_MODE_I | EBUR128_MODE_LRA);
+  ebur128_add_frames_double(st, buffer, (size_t) file_info.frames);
+  free(buffer);
+  digest = ebur128_digest_create(st);
+  ebur128_destroy(&st);
+  if (!digest) {
+    return 0;
   }
-  buffer = (double*) malloc(st->samplerate * st->channels * sizeof(double));
-  while ((nr_frames_read =
-              sf_readf_double(file, buffer, (sf_count_t) st->samplerate))) {
-    ebur128_add_frames_double(st, buffer, (size_t) nr_frames_read);
+  size = ebur128_digest_serialized_size(digest);
+  serialized = (unsigned char*) malloc(size + 10);
+  ebur128_digest_serialize(digest, serialized);
+  ebur128_digest_destroy(&digest);
+
+  /* Repeat the last short-term bin. */
+  bins = (size_t) serialized[24] | (size_t) serialized[25] << 8;
+  count = serialized + 24 + 4 + 34 * bins;
+  bins = (size_t) count[0] | (size_t) count[1] << 8;
+  if (bins) {
+    memcpy(serialized + size, serialized + size - 10, 10);
+    count[0] = (unsigned char) (bins + 1);
+    count[1] = (unsigned char) ((bins + 1) >> 8);
+    digest = ebur128_digest_deserialize(serialized, size + 10);
+    ok = digest == NULL;
+    if (digest) {
+      ebur128_digest_destroy(&digest);
+    }
   }
+  free(serialized);
+  return ok;
+}
 
-  ebur128_loudness_global(st, &gated_loudness);
+/* Measure two files as programmes of one continuous state, and compare the
+ * summaries to those of new states fed only one of the files. The first
+ * programme must match exactly, the second within the tolerance given for
+ * ebur128_begin_programme(). Returns 1 if they do. */
+int test_programmes(const char* filename_a, const char* filename_b) {
+  SF_INFO file_info[2];
+  ebur128_state* st;
+  ebur128_state* fresh;
+  ebur128_summary programme[2];
+  ebur128_summary expected[2];
+  double* buffer[2] = { NULL, NULL };
+  int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK;
+  int ok = 0;
+  int i;
 
-  *out_state = st;
+  buffer[0] = read_file(filename_a, &file_info[0]);
+  buffer[1] = read_file(filename_b, &file_info[1]);
+  if (!buffer[0] || !buffer[1] ||
+      file_info[0].channels != file_info[1].channels ||
+      file_info[0].samplerate != file_info[1].samplerate) {
+    goto free_buffers;
+  }
+  memset(programme, '\0', sizeof(programme));
+  memset(expected, '\0', sizeof(expected));
+  st = ebur128_init((unsigned) file_info[0].channels,
+                    (unsigned) file_info[0].samplerate, mode);
+  for (i = 0; i < 2; ++i) {
+    ebur128_add_frames_double(st, buffer[i], (size_t) file_info[i].frames);
+    ebur128_end_programme(st, &programme[i]);
 
-  free(buffer);
-  buffer = NULL;
-  if (sf_close(file)) {
-    fprintf(stderr, "Could not close input file!\n");
+    fresh = ebur128_init((unsigned) file_info[i].channels,
+                         (unsigned) file_info[i].samplerate, mode);
+    ebur128_add_frames_double(fresh, buffer[i], (size_t) file_info[i].frames);
+    ebur128_get_summary(fresh, &expected[i]);
+    ebur128_destroy(&fresh);
   }
-  return gated_loudness;
+  ebur128_destroy(&st);
+
+  fprintf(stderr, "programme differences: %f LU, %f LU\n",
+          programme[1].loudness_global - expected[1].loudness_global,
+          programme[1].loudness_range - expected[1].loudness_range);
+  ok = programme[0].loudness_global == expected[0].loudness_global &&
+       programme[0].loudness_range == expected[0].loudness_range &&
+       programme[0].sample_peak == expected[0].sample_peak &&
+       fabs(programme[1].loudness_global - expected[1].loudness_global) <=
+           0.1 &&
+       fabs(programme[1].loudness_range - expected[1].loudness_range) <= 0.5 &&
+       programme[1].sample_peak == expected[1].sample_peak;
+
+free_buffers:
+  free(buffer[0]);
+  free(buffer[1]);
+  return ok;
 }
 
-double test_loudness_range(const char* filename) {
-  SF_INFO file_info;
-  SNDFILE* file;
-  sf_count_t nr_frames_read;
+/* Number of programmes in test_mux(). */
+#define MUX_TEST_PROGRAMMES 3
 
-  ebur128_state* st = NULL;
-  double loudness_range;
+/* Measure overlapping programmes of a 6 channel file with a mux, and compare
+ * each to a state fed a copy of the same channels. Returns 1 if the results
+ * are the same. */
+int test_mux(const char* filename) {
+  static const unsigned int first[MUX_TEST_PROGRAMMES] = { 0, 2, 4 };
+  static const unsigned int channels[MUX_TEST_PROGRAMMES] = { 2, 3, 2 };
+  SF_INFO file_info;
+  ebur128_mux* mux;
+  ebur128_state* st;
+  ebur128_summary summary[2];
+  int mode = EBUR128_MODE_I | EBUR128_MODE_LRA | EBUR128_MODE_SAMPLE_PEAK;
   double* buffer;
+  double* programme;
+  size_t frames, chunk, f;
+  unsigned int c;
+  int ok = 1;
+  int p;
 
-  memset(&file_info, '\0', sizeof(file_info));
-  file = sf_open(filename, SFM_READ, &file_info);
-  if (!file) {
-    fprintf(stderr, "Could not open file %s!\n", filename);
-    return 0.0;
+  buffer = read_file(filename, &file_info);
+  if (!buffer || file_info.channels != 6) {
+    free(buffer);
+    return 0;
   }
-  st = ebur128_init((unsigned) file_info.channels,
-                    (unsigned) file_info.samplerate, EBUR128_MODE_LRA);
-  if (file_info.channels == 5) {
-    ebur128_set_channel(st, 0, EBUR128_LEFT);
-    ebur128_set_channel(st, 1, EBUR128_RIGHT);
-    ebur128_set_channel(st, 2, EBUR128_CENTER);
-    ebur128_set_channel(st, 3, EBUR128_LEFT_SURROUND);
-    ebur128_set_channel(st, 4, EBUR128_RIGHT_SURROUND);
+  mux = ebur128_mux_create(6, (unsigned long) file_info.samplerate, mode,
+                           first, channels, MUX_TEST_PROGRAMMES);
+  if (!mux) {
+    free(buffer);
+    return 0;
   }
-  buffer = (double*) malloc(st->samplerate * st->channels * sizeof(double));
-  while ((nr_frames_read =
-              sf_readf_double(file, buffer, (sf_count_t) st->samplerate))) {
-    ebur128_add_frames_double(st, buffer, (size_t) nr_frames_read);
+  for (frames = 0, chunk = 1; frames < (size_t) file_info.frames;
+       frames += chunk, chunk = chunk * 7 % 9973) {
+    if (chunk > (size_t) file_info.frames - frames) {
+      chunk = (size_t) file_info.frames - frames;
+    }
+    ebur128_mux_add_frames_double(mux, buffer + frames * 6, chunk);
   }
 
-  ebur128_loudness_range(st, &loudness_range);
-
-  /* clean up */
-  ebur128_destroy(&st);
+  programme = (double*) malloc((size_t) file_info.frames * 3 * sizeof(double));
+  for (p = 0; p < MUX_TEST_PROGRAMMES; ++p) {
+    for (f = 0; f < (size_t) file_info.frames; ++f) {
+      for (c = 0; c < channels[p]; ++c) {
+        programme[f * channels[p] + c] = buffer[f * 6 + first[p] + c];
+      }
+    }
+    st = ebur128_init(channels[p], (unsigned long) file_info.samplerate,
+                      mode);
+    ebur128_add_frames_double(st, programme, (size_t) file_info.frames);
+    memset(summary, '\0', sizeof(summary));
+    ebur128_get_summary(st, &summary[0]);
+    ebur128_get_summary(ebur128_mux_state(mux, (size_t) p), &summary[1]);
+    ebur128_destroy(&st);
+    if (summary[0].loudness_global != summary[1].loudness_global ||
+        summary[0].loudness_range != summary[1].loudness_range ||
+        summary[0].sample_peak != summary[1].sample_peak) {
+      ok = 0;
+    }
+  }
+  ebur128_mux_destroy(&mux);
+  /* Destroying it again does nothing. */
+  ebur128_mux_destroy(&mux);
 
+  free(programme);
   free(buffer);
-  buffer = NULL;
-  if (sf_close(file)) {
-    fprintf(stderr, "Could not close input file!\n");
+  return ok;
+}
+
+/* Number of files and rounds in test_aggregator(). */
+#define AGGREGATOR_TEST_FILES 3
+#define AGGREGATOR_TEST_ROUNDS 10
+
+/* Query an aggregator between rounds of adding frames to its states, so that
+ * each query only reads the new blocks. Each result has to match that of new
+ * digests of the states, and the integrated loudness has to be within the
+ * 0.1 LU bins of the digests of ebur128_loudness_global_multiple() on the
+ * states. Returns 1 if all results are. */
+int test_aggregator(const char* const* filenames) {
+  SF_INFO file_info[AGGREGATOR_TEST_FILES];
+  ebur128_state* st[AGGREGATOR_TEST_FILES] = { NULL };
+  ebur128_digest* digests[AGGREGATOR_TEST_FILES] = { NULL };
+  ebur128_aggregator* agg = NULL;
+  double* buffers[AGGREGATOR_TEST_FILES] = { NULL };
+  double loudness, range;
+  double digest_loudness, digest_range;
+  double exact_loudness;
+  size_t begin, end;
+  int ok = 0;
+  int i, r;
+
+  for (i = 0; i < AGGREGATOR_TEST_FILES; ++i) {
+    buffers[i] = read_file(filenames[i], &file_info[i]);
+    if (!buffers[i]) {
+      goto destroy;
+    }
+    st[i] = ebur128_init((unsigned) file_info[i].channels,
+                         (unsigned) file_info[i].samplerate,
+                         EBUR128_MODE_I | EBUR128_MODE_LRA);
   }
-  return loudness_range;
+  agg = ebur128_aggregator_create(st, AGGREGATOR_TEST_FILES);
+  if (!agg) {
+    goto destroy;
+  }
+  for (r = 0; r < AGGREGATOR_TEST_ROUNDS; ++r) {
+    for (i = 0; i < AGGREGATOR_TEST_FILES; ++i) {
+      begin = (size_t) file_info[i].frames * (size_t) r /
+              AGGREGATOR_TEST_ROUNDS;
+      end = (size_t) file_info[i].frames * (size_t) (r + 1) /
+            AGGREGATOR_TEST_ROUNDS;
+      ebur128_add_frames_double(
+          st[i], buffers[i] + begin * (size_t) file_info[i].channels,
+          end - begin);
+    }
+    if (ebur128_aggregator_loudness_global(agg, &loudness) ||
+        ebur128_aggregator_loudness_range(agg, &range) ||
+        ebur128_loudness_global_multiple(st, AGGREGATOR_TEST_FILES,
+                                         &exact_loudness)) {
+      goto destroy;
+    }
+    for (i = 0; i < AGGREGATOR_TEST_FILES; ++i) {
+      digests[i] = ebur128_digest_create(st[i]);
+      if (!digests[i]) {
+        goto destroy;
+      }
+    }
+    ebur128_digest_loudness_global_multiple(digests, AGGREGATOR_TEST_FILES,
+                                            &digest_loudness);
+    ebur128_digest_loudness_range_multiple(digests, AGGREGATOR_TEST_FILES,
+                                           &digest_range);
+    for (i = 0; i < AGGREGATOR_TEST_FILES; ++i) {
+      ebur128_digest_destroy(&digests[i]);
+    }
+    /* The aggregator sums the energies in a different order. */
+    if (!(fabs(loudness - digest_loudness) <= 1e-9 ||
+          loudness == digest_loudness) ||
+        range != digest_range ||
+        !(fabs(loudness - exact_loudness) <= 0.1 ||
+          loudness == exact_loudness)) {
+      fprintf(stderr, "aggregator round %d: %f %f %f, %f %f\n", r, loudness,
+              digest_loudness, exact_loudness, range, digest_range);
+      goto destroy;
+    }
+  }
+  ok = 1;
+
+destroy:
+  if (agg) {
+    ebur128_aggregator_destroy(&agg);
+  }
+  for (i = 0; i < AGGREGATOR_TEST_FILES; ++i) {
+    if (digests[i]) {
+      ebur128_digest_destroy(&digests[i]);
+    }
+    if (st[i]) {
+      ebur128_destroy(&st[i]);
+    }
+    free(buffers[i]);
+  }
+  return ok;
 }
 
-double test_true_peak(const char* filename) {
+double test_true_peak(const char* filename, int mode) {
   SF_INFO file_info;
   SNDFILE* file;
   sf_count_t nr_frames_read;
@@ -110,7 +1521,7 @@ double test_true_peak(const char* filename) {
     return 0.0;
   }
   st = ebur128_init((unsigned) file_info.channels,
-                    (unsigned) file_info.samplerate, EBUR128_MODE_TRUE_PEAK);
+                    (unsigned) file_info.samplerate, mode);
   if (file_info.channels == 5) {
     ebur128_set_channel(st, 0, EBUR128_LEFT);
     ebur128_set_channel(st, 1, EBUR128_RIGHT);
@@ -243,6 +1654,54 @@ double test_max_shortterm(const char* filename) {
   return max_shortterm;
 }
 
+double test_max_loudness_tracked(const char* filename, int mode) {
+  SF_INFO file_info;
+  SNDFILE* file;
+  sf_count_t nr_frames_read;
+  ebur128_state* st = NULL;
+  double max_loudness;
+  double* buffer;
+
+  memset(&file_info, '\0', sizeof(file_info));
+  file = sf_open(filename, SFM_READ, &file_info);
+  if (!file) {
+    fprintf(stderr, "Could not open file %s!\n", filename);
+    return 0.0;
+  }
+  st = ebur128_init((unsigned) file_info.channels,
+                    (unsigned) file_info.samplerate, mode);
+  if (file_info.channels == 5) {
+    ebur128_set_channel(st, 0, EBUR128_LEFT);
+    ebur128_set_channel(st, 1, EBUR128_RIGHT);
+    ebur128_set_channel(st, 2, EBUR128_CENTER);
+    ebur128_set_channel(st, 3, EBUR128_LEFT_SURROUND);
+    ebur128_set_channel(st, 4, EBUR128_RIGHT_SURROUND);
+  }
+  /* 10 ms step, but large buffers */
+  ebur128_set_max_loudness_step(st, 10);
+  buffer = (double*) malloc(st->samplerate * st->channels * sizeof(double));
+  while ((nr_frames_read =
+              sf_readf_double(file, buffer, (sf_count_t) st->samplerate))) {
+    ebur128_add_frames_double(st, buffer, (size_t) nr_frames_read);
+  }
+
+  if (mode == EBUR128_MODE_S) {
+    ebur128_loudness_shortterm_max(st, &max_loudness);
+  } else {
+    ebur128_loudness_momentary_max(st, &max_loudness);
+  }
+
+  /* clean up */
+  ebur128_destroy(&st);
+
+  free(buffer);
+  buffer = NULL;
+  if (sf_close(file)) {
+    fprintf(stderr, "Could not close input file!\n");
+  }
+  return max_loudness;
+}
+
 double gr[] = { -23.0, -33.0, -23.0, -23.0, -23.0, -23.0, -23.0, -23.0, -23.0 };
 double gre[] = { -2.2953556442089987e+01, -3.2959860397340044e+01,
                  -2.2995899818255047e+01, -2.3035918615414182e+01,
@@ -257,6 +1716,10 @@ double lrae[] = { 1.0001105488329134e+01, 4.9993734051522178e+00,
 int main() {
   double result;
   ebur128_state* states[9] = { 0 };
+  ebur128_state* fixed_state = NULL;
+  ebur128_state* histogram_state = NULL;
+  ebur128_summary summary;
+  ebur128_aggregator* aggregator;
   int i;
 
   fprintf(stderr, "Note: the tests do not have to pass with EXACT_PASSED.\n"
@@ -264,7 +1727,7 @@ int main() {
                   "100%% EBU R 128 compliant!\n\n");
 
 #define TEST_GLOBAL_LOUDNESS(filename, i, state_array)                         \
-  result = test_global_loudness(filename, &state_array[i]);                    \
+  result = test_global_loudness(filename, EBUR128_MODE_I, &state_array[i]);    \
   if (result == result) {                                                      \
     printf("%s, %s - %s: %1.16e\n",                                            \
            (result <= gr[i] + 0.1 && result >= gr[i] - 0.1) ? "PASSED"         \
@@ -283,6 +1746,109 @@ int main() {
   TEST_GLOBAL_LOUDNESS("seq-3341-7_seq-3342-5-24bit.wav", 7, states)
   TEST_GLOBAL_LOUDNESS("seq-3341-2011-8_seq-3342-6-24bit-v02.wav", 8, states)
 
+  /* seq-3341-2 is seq-3341-1 10 dB lower */
+  if (states[1]) {
+    result = 0.0;
+    ebur128_loudness_global_with_gain(states[1], 10.0, &result);
+    if (result <= gr[0] + 0.1 && result >= gr[0] - 0.1) {
+      printf("PASSED, ebur128_loudness_global_with_gain\n");
+    } else {
+      printf("FAILED, ebur128_loudness_global_with_gain\n");
+    }
+  }
+
+  if (test_lra_sketch_epsilon()) {
+    printf("PASSED, ebur128_set_lra_sketch_epsilon\n");
+  } else {
+    printf("FAILED, ebur128_set_lra_sketch_epsilon\n");
+  }
+
+  result = test_loudness_range_with_gain(EBUR128_MODE_LRA);
+  printf("%s, ebur128_loudness_range_with_gain: %1.16e\n",
+         result <= 0.1 ? "PASSED" : "FAILED", result);
+  result = test_loudness_range_with_gain(EBUR128_MODE_LRA |
+                                         EBUR128_MODE_HISTOGRAM);
+  printf("%s, ebur128_loudness_range_with_gain (histogram): %1.16e\n",
+         result <= 0.1 ? "PASSED" : "FAILED", result);
+
+#define TEST_GLOBAL_LOUDNESS_FIXED(filename, i)                                \
+  result = test_global_loudness(                                               \
+      filename, EBUR128_MODE_I | EBUR128_MODE_FIXED_POINT, &fixed_state);      \
+  if (result == result) {                                                      \
+    printf("%s - %s (fixed point): %1.16e\n",                                  \
+           (result <= gre[i] + 0.01 && result >= gre[i] - 0.01) ? "PASSED"     \
+                                                                : "FAILED",    \
+           filename, result);                                                  \
+  }                                                                            \
+  if (fixed_state) {                                                           \
+    ebur128_destroy(&fixed_state);                                             \
+  }
+
+  TEST_GLOBAL_LOUDNESS_FIXED("seq-3341-1-16bit.wav", 0)
+  TEST_GLOBAL_LOUDNESS_FIXED("seq-3341-2-16bit.wav", 1)
+  TEST_GLOBAL_LOUDNESS_FIXED("seq-3341-3-16bit-v02.wav", 2)
+  TEST_GLOBAL_LOUDNESS_FIXED("seq-3341-4-16bit-v02.wav", 3)
+  TEST_GLOBAL_LOUDNESS_FIXED("seq-3341-5-16bit-v02.wav", 4)
+  TEST_GLOBAL_LOUDNESS_FIXED("seq-3341-6-5channels-16bit.wav", 5)
+  TEST_GLOBAL_LOUDNESS_FIXED("seq-3341-6-6channels-WAVEEX-16bit.wav", 6)
+  TEST_GLOBAL_LOUDNESS_FIXED("seq-3341-7_seq-3342-5-24bit.wav", 7)
+  TEST_GLOBAL_LOUDNESS_FIXED("seq-3341-2011-8_seq-3342-6-24bit-v02.wav", 8)
+
+#define TEST_GLOBAL_LOUDNESS_HISTOGRAM(filename, i)                            \
+  result = test_global_loudness(                                               \
+      filename, EBUR128_MODE_I | EBUR128_MODE_HISTOGRAM, &histogram_state);    \
+  if (result == result) {                                                      \
+    printf("%s - %s (histogram): %1.16e\n",                                    \
+           (result <= gre[i] + 0.01 && result >= gre[i] - 0.01) ? "PASSED"     \
+                                                                : "FAILED",    \
+           filename, result);                                                  \
+  }                                                                            \
+  if (histogram_state) {                                                       \
+    ebur128_destroy(&histogram_state);                                         \
+  }
+
+  TEST_GLOBAL_LOUDNESS_HISTOGRAM("seq-3341-1-16bit.wav", 0)
+  TEST_GLOBAL_LOUDNESS_HISTOGRAM("seq-3341-2-16bit.wav", 1)
+  TEST_GLOBAL_LOUDNESS_HISTOGRAM("seq-3341-3-16bit-v02.wav", 2)
+  TEST_GLOBAL_LOUDNESS_HISTOGRAM("seq-3341-4-16bit-v02.wav", 3)
+  TEST_GLOBAL_LOUDNESS_HISTOGRAM("seq-3341-5-16bit-v02.wav", 4)
+  TEST_GLOBAL_LOUDNESS_HISTOGRAM("seq-3341-6-5channels-16bit.wav", 5)
+  TEST_GLOBAL_LOUDNESS_HISTOGRAM("seq-3341-6-6channels-WAVEEX-16bit.wav", 6)
+  TEST_GLOBAL_LOUDNESS_HISTOGRAM("seq-3341-7_seq-3342-5-24bit.wav", 7)
+  TEST_GLOBAL_LOUDNESS_HISTOGRAM("seq-3341-2011-8_seq-3342-6-24bit-v02.wav", 8)
+
+#define TEST_GLOBAL_LOUDNESS_STEMS(filename, i)                                \
+  result = test_stems_global_loudness(filename);                               \
+  if (result == result) {                                                      \
+    printf("%s - %s (stems): %1.16e\n",                                        \
+           (result <= gre[i] + 0.01 && result >= gre[i] - 0.01) ? "PASSED"     \
+                                                                : "FAILED",    \
+           filename, result);                                                  \
+  }
+
+  TEST_GLOBAL_LOUDNESS_STEMS("seq-3341-1-16bit.wav", 0)
+  TEST_GLOBAL_LOUDNESS_STEMS("seq-3341-2-16bit.wav", 1)
+  TEST_GLOBAL_LOUDNESS_STEMS("seq-3341-3-16bit-v02.wav", 2)
+  TEST_GLOBAL_LOUDNESS_STEMS("seq-3341-4-16bit-v02.wav", 3)
+  TEST_GLOBAL_LOUDNESS_STEMS("seq-3341-5-16bit-v02.wav", 4)
+  TEST_GLOBAL_LOUDNESS_STEMS("seq-3341-6-5channels-16bit.wav", 5)
+  TEST_GLOBAL_LOUDNESS_STEMS("seq-3341-6-6channels-WAVEEX-16bit.wav", 6)
+  TEST_GLOBAL_LOUDNESS_STEMS("seq-3341-7_seq-3342-5-24bit.wav", 7)
+  TEST_GLOBAL_LOUDNESS_STEMS("seq-3341-2011-8_seq-3342-6-24bit-v02.wav", 8)
+
+  if (test_filtered_frames("seq-3341-7_seq-3342-5-24bit.wav")) {
+    printf("PASSED, ebur128_filtered_frames\n");
+  } else {
+    printf("FAILED, ebur128_filtered_frames\n");
+  }
+
+  /* A hibernated state continues like a new one. */
+  if (test_hibernate("seq-3341-7_seq-3342-5-24bit.wav") == 0.0) {
+    printf("PASSED, ebur128_hibernate\n");
+  } else {
+    printf("FAILED, ebur128_hibernate\n");
+  }
+
   /* Move some states around, to make the bug where
    * ebur128_loudness_global_multiple() calculated the relative threshold just
    * from the last state easier to reproduce. Don't care for leaks, etc. */
@@ -307,10 +1873,30 @@ int main() {
     printf("FAILED, ebur128_loudness_global_multiple\n");
   }
 
+  memset(&summary, '\0', sizeof(summary));
+  ebur128_get_summary_multiple(states, 6, &summary);
+  if (summary.loudness_global == result) {
+    printf("PASSED, ebur128_get_summary_multiple\n");
+  } else {
+    printf("FAILED, ebur128_get_summary_multiple\n");
+  }
+
+  aggregator = ebur128_aggregator_create(states, 6);
+  result = 0;
+  if (aggregator) {
+    ebur128_aggregator_loudness_global(aggregator, &result);
+    ebur128_aggregator_destroy(&aggregator);
+  }
+  if (result >= -23.18758 - 0.05 && result <= -23.18758 + 0.05) {
+    printf("PASSED, ebur128_aggregator_loudness_global\n");
+  } else {
+    printf("FAILED, ebur128_aggregator_loudness_global\n");
+  }
+
 after_multiple_test:;
 
 #define TEST_LRA(filename, i)                                                  \
-  result = test_loudness_range(filename);                                      \
+  result = test_loudness_range(filename, EBUR128_MODE_LRA);                    \
   if (result == result) {                                                      \
     printf("%s, %s - %s: %1.16e\n",                                            \
            (result <= lra[i] + 1 && result >= lra[i] - 1) ? "PASSED"           \
@@ -326,13 +1912,176 @@ after_multiple_test:;
   TEST_LRA("seq-3341-7_seq-3342-5-24bit.wav", 4)
   TEST_LRA("seq-3341-2011-8_seq-3342-6-24bit-v02.wav", 5)
 
+#define TEST_LRA_SKETCH(filename, i)                                           \
+  result = test_loudness_range(filename, EBUR128_MODE_LRA_SKETCH);             \
+  if (result == result) {                                                      \
+    printf("%s, %s - %s (sketch): %1.16e\n",                                   \
+           (result <= lra[i] + 1 && result >= lra[i] - 1) ? "PASSED"           \
+                                                          : "FAILED",          \
+           (result == lrae[i]) ? "EXACT_PASSED" : "EXACT_FAILED", filename,    \
+           result);                                                            \
+  }
+
+  TEST_LRA_SKETCH("seq-3342-1-16bit.wav", 0)
+  TEST_LRA_SKETCH("seq-3342-2-16bit.wav", 1)
+  TEST_LRA_SKETCH("seq-3342-3-16bit.wav", 2)
+  TEST_LRA_SKETCH("seq-3342-4-16bit.wav", 3)
+  TEST_LRA_SKETCH("seq-3341-7_seq-3342-5-24bit.wav", 4)
+  TEST_LRA_SKETCH("seq-3341-2011-8_seq-3342-6-24bit-v02.wav", 5)
+
+#define TEST_LRA_BLOCK_LOG(filename, i)                                        \
+  result = test_block_log_loudness_range(filename);                            \
+  if (result == result) {                                                      \
+    printf("%s - %s (block log): %1.16e\n",                                    \
+           (result <= lrae[i] + 0.01 && result >= lrae[i] - 0.01) ? "PASSED"   \
+                                                                  : "FAILED",  \
+           filename, result);                                                  \
+  }
+
+  TEST_LRA_BLOCK_LOG("seq-3342-1-16bit.wav", 0)
+  TEST_LRA_BLOCK_LOG("seq-3342-2-16bit.wav", 1)
+  TEST_LRA_BLOCK_LOG("seq-3342-3-16bit.wav", 2)
+  TEST_LRA_BLOCK_LOG("seq-3342-4-16bit.wav", 3)
+  TEST_LRA_BLOCK_LOG("seq-3341-7_seq-3342-5-24bit.wav", 4)
+  TEST_LRA_BLOCK_LOG("seq-3341-2011-8_seq-3342-6-24bit-v02.wav", 5)
+
+  result = test_block_log_loudness_global();
+  printf("%s - sine below the absolute gate (block log): %1.16e\n",
+         result <= 0.001 ? "PASSED" : "FAILED", result);
+
+  /* Block files keep the results exact. */
+  if (test_block_files("seq-3341-7_seq-3342-5-24bit.wav") == 0.0) {
+    printf("PASSED, ebur128_set_block_files\n");
+  } else {
+    printf("FAILED, ebur128_set_block_files\n");
+  }
+#if defined(__linux__)
+  if (test_block_files_error() == EBUR128_ERROR_IO) {
+    printf("PASSED, ebur128_set_block_files (write error)\n");
+  } else {
+    printf("FAILED, ebur128_set_block_files (write error)\n");
+  }
+#endif
+
+  if (test_peak_frame()) {
+    printf("PASSED, ebur128_sample_peak_frame, ebur128_true_peak_frame\n");
+  } else {
+    printf("FAILED, ebur128_sample_peak_frame, ebur128_true_peak_frame\n");
+  }
+
+  if (test_peak_window()) {
+    printf("PASSED, ebur128_sample_peak_window, ebur128_true_peak_window\n");
+  } else {
+    printf("FAILED, ebur128_sample_peak_window, ebur128_true_peak_window\n");
+  }
+
+  if (test_programmes("seq-3341-7_seq-3342-5-24bit.wav",
+                      "seq-3341-2011-8_seq-3342-6-24bit-v02.wav")) {
+    printf("PASSED, ebur128_end_programme\n");
+  } else {
+    printf("FAILED, ebur128_end_programme\n");
+  }
+
+  if (test_mux("seq-3341-6-6channels-WAVEEX-16bit.wav")) {
+    printf("PASSED, ebur128_mux\n");
+  } else {
+    printf("FAILED, ebur128_mux\n");
+  }
+
+  {
+    const char* const aggregator_files[AGGREGATOR_TEST_FILES] = {
+      "seq-3341-7_seq-3342-5-24bit.wav",
+      "seq-3341-2011-8_seq-3342-6-24bit-v02.wav", "seq-3342-4-16bit.wav"
+    };
+    if (test_aggregator(aggregator_files)) {
+      printf("PASSED, ebur128_aggregator (incremental)\n");
+    } else {
+      printf("FAILED, ebur128_aggregator (incremental)\n");
+    }
+  }
+
+  /* Serialized and merged digests keep the histogram results. */
+  {
+    const char* const digest_files[DIGEST_TEST_FILES] = {
+      "seq-3341-7_seq-3342-5-24bit.wav",
+      "seq-3341-2011-8_seq-3342-6-24bit-v02.wav", "seq-3342-4-16bit.wav"
+    };
+    result = test_digest(digest_files);
+    if (result <= 1e-9) {
+      printf("PASSED, ebur128_digest: %1.16e\n", result);
+    } else {
+      printf("FAILED, ebur128_digest: %1.16e\n", result);
+    }
+  }
+  if (test_digest_duplicate_bin("seq-3342-4-16bit.wav")) {
+    printf("PASSED, ebur128_digest_deserialize (duplicate bin)\n");
+  } else {
+    printf("FAILED, ebur128_digest_deserialize (duplicate bin)\n");
+  }
+
+  result = test_stems_mix("seq-3341-7_seq-3342-5-24bit.wav");
+  if (result <= 1e-10) {
+    printf("PASSED, ebur128_stems_loudness_momentary, "
+           "ebur128_stems_loudness_shortterm: %1.16e\n",
+           result);
+  } else {
+    printf("FAILED, ebur128_stems_loudness_momentary, "
+           "ebur128_stems_loudness_shortterm: %1.16e\n",
+           result);
+  }
+
+  if (test_overview(0)) {
+    printf("PASSED, ebur128_set_overview\n");
+  } else {
+    printf("FAILED, ebur128_set_overview\n");
+  }
+  if (test_overview(EBUR128_MODE_FIXED_POINT)) {
+    printf("PASSED, ebur128_set_overview (fixed point)\n");
+  } else {
+    printf("FAILED, ebur128_set_overview (fixed point)\n");
+  }
+
+  if (test_normalizer("seq-3341-7_seq-3342-5-24bit.wav")) {
+    printf("PASSED, ebur128_normalizer\n");
+  } else {
+    printf("FAILED, ebur128_normalizer\n");
+  }
+
+  if (test_threads("seq-3341-7_seq-3342-5-24bit.wav")) {
+    printf("PASSED, ebur128_set_threads\n");
+  } else {
+    printf("FAILED, ebur128_set_threads\n");
+  }
+
+  /* The worker thread processes the same frames as a direct call. */
+  if (test_async("seq-3341-7_seq-3342-5-24bit.wav") == 0.0) {
+    printf("PASSED, ebur128_async\n");
+  } else {
+    printf("FAILED, ebur128_async\n");
+  }
+#if defined(__linux__)
+  if (test_async_error()) {
+    printf("PASSED, ebur128_async (write error)\n");
+  } else {
+    printf("FAILED, ebur128_async (write error)\n");
+  }
+#endif
+
 #define TEST_MAX_TRUE_PEAK(filename, expected)                                 \
-  result = test_true_peak(filename);                                           \
+  result = test_true_peak(filename, EBUR128_MODE_TRUE_PEAK);                   \
   if (result == result) {                                                      \
     printf("%s - %s: %1.16e\n",                                                \
            (result <= expected + 0.2 && result >= expected - 0.4) ? "PASSED"   \
                                                                   : "FAILED",  \
            filename, result);                                                  \
+  }                                                                            \
+  result = test_true_peak(filename,                                            \
+                          EBUR128_MODE_TRUE_PEAK | EBUR128_MODE_FIXED_POINT);  \
+  if (result == result) {                                                      \
+    printf("%s - %s (fixed point): %1.16e\n",                                  \
+           (result <= expected + 0.2 && result >= expected - 0.4) ? "PASSED"   \
+                                                                  : "FAILED",  \
+           filename, result);                                                  \
   }
 
   TEST_MAX_TRUE_PEAK("seq-3341-15-24bit.wav.wav", -6.0)
@@ -352,6 +2101,13 @@ after_multiple_test:;
            (result <= expected + 0.1 && result >= expected - 0.1) ? "PASSED"   \
                                                                   : "FAILED",  \
            filename, result);                                                  \
+  }                                                                            \
+  result = test_max_loudness_tracked(filename, EBUR128_MODE_M);                \
+  if (result == result) {                                                      \
+    printf("%s - %s (tracked): %1.16e\n",                                      \
+           (result <= expected + 0.1 && result >= expected - 0.1) ? "PASSED"   \
+                                                                  : "FAILED",  \
+           filename, result);                                                  \
   }
 
   TEST_MAX_MOMENTARY("seq-3341-13-1-24bit.wav", -23.0)
@@ -382,6 +2138,13 @@ after_multiple_test:;
            (result <= expected + 0.1 && result >= expected - 0.1) ? "PASSED"   \
                                                                   : "FAILED",  \
            filename, result);                                                  \
+  }                                                                            \
+  result = test_max_loudness_tracked(filename, EBUR128_MODE_S);                \
+  if (result == result) {                                                      \
+    printf("%s - %s (tracked): %1.16e\n",                                      \
+           (result <= expected + 0.1 && result >= expected - 0.1) ? "PASSED"   \
+                                                                  : "FAILED",  \
+           filename, result);                                                  \
   }
 
   TEST_MAX_SHORTTERM("seq-3341-10-1-24bit.wav", -23.0)